@@ -0,0 +1,254 @@
+#include "acceptor.h"
+#include "creds.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+extern "C" {
+    #include <gssapi/gssapi_krb5.h>
+}
+#include <easylogging/easylogging++.h>
+
+AcceptorCred::AcceptorCred(const std::string& keytab_name_,
+                           const std::string& principal_):
+        keytab_name(keytab_name_),
+        principal(principal_),
+        current(NULL),
+        generation(0),
+        built(0),
+        keytab_ino(0) {
+
+    memset(&keytab_mtime, 0, sizeof(keytab_mtime));
+    pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&krb_lock, NULL);
+
+    ssh_gssapi_krb5_init(&krb_context);
+
+    if (keytab_name.empty()) {
+        char name[1024];
+        if (krb5_kt_default_name(krb_context, name, sizeof(name)) == 0) {
+            keytab_name = name;
+        }
+    }
+
+    // Only file keytabs can be watched for changes.
+    keytab_path = keytab_name;
+    if (keytab_path.find("FILE:") == 0) {
+        keytab_path = keytab_path.substr(strlen("FILE:"));
+    }
+    else if (keytab_path.find("WRFILE:") == 0) {
+        keytab_path = keytab_path.substr(strlen("WRFILE:"));
+    }
+    else if (keytab_path.find(':') != std::string::npos) {
+        keytab_path.clear();
+    }
+}
+
+AcceptorCred::~AcceptorCred() {
+    if (current) {
+        unref(current);
+        current = NULL;
+    }
+    krb5_free_context(krb_context);
+    pthread_mutex_destroy(&krb_lock);
+    pthread_mutex_destroy(&lock);
+}
+
+bool AcceptorCred::keytab_stat(struct stat *st) const {
+    if (keytab_path.empty()) {
+        return false;
+    }
+    return stat(keytab_path.c_str(), st) == 0;
+}
+
+bool AcceptorCred::load() {
+    struct acceptor_ref *ref = build();
+    if (ref == NULL) {
+        return false;
+    }
+    install(ref);
+    return true;
+}
+
+struct acceptor_ref *AcceptorCred::build() {
+    krb5_error_code rc;
+    OM_uint32 maj, min;
+
+    struct stat st;
+    bool have_stat = keytab_stat(&st);
+
+    pthread_mutex_lock(&krb_lock);
+
+    krb5_principal princ = NULL;
+    if (!principal.empty()) {
+        rc = krb5_parse_name(krb_context, principal.c_str(), &princ);
+        if (rc) {
+            LOG(ERROR) << "krb5_parse_name: " << principal << ": "
+                       << error_message(rc);
+            pthread_mutex_unlock(&krb_lock);
+            return NULL;
+        }
+    }
+
+    krb5_keytab kt;
+    rc = krb5_kt_resolve(krb_context, keytab_name.c_str(), &kt);
+    if (rc) {
+        LOG(ERROR) << "krb5_kt_resolve: " << keytab_name << ": "
+                   << error_message(rc);
+        krb5_free_principal(krb_context, princ);
+        pthread_mutex_unlock(&krb_lock);
+        return NULL;
+    }
+
+    // Every key version is kept, tickets issued under an older kvno are
+    // accepted for as long as the keytab has it.
+    std::vector<krb5_keytab_entry> entries;
+
+    krb5_kt_cursor cursor;
+    rc = krb5_kt_start_seq_get(krb_context, kt, &cursor);
+    if (rc == 0) {
+        krb5_keytab_entry entry;
+        while (krb5_kt_next_entry(krb_context, kt, &entry, &cursor) == 0) {
+            if (princ && !krb5_principal_compare(krb_context,
+                                                 princ,
+                                                 entry.principal)) {
+                krb5_free_keytab_entry_contents(krb_context, &entry);
+                continue;
+            }
+
+            entries.push_back(entry);
+        }
+        krb5_kt_end_seq_get(krb_context, kt, &cursor);
+    }
+    else {
+        LOG(ERROR) << "krb5_kt_start_seq_get: " << keytab_name << ": "
+                   << error_message(rc);
+    }
+    krb5_kt_close(krb_context, kt);
+
+    unsigned gen = ++built;
+    char mem_name[64];
+    snprintf(mem_name, sizeof(mem_name), "MEMORY:tkt-recv-acceptor-%u", gen);
+
+    krb5_keytab mem_kt = NULL;
+    size_t loaded = 0;
+    rc = krb5_kt_resolve(krb_context, mem_name, &mem_kt);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (rc == 0 &&
+            krb5_kt_add_entry(krb_context, mem_kt, &entries[i]) == 0) {
+            ++loaded;
+        }
+        krb5_free_keytab_entry_contents(krb_context, &entries[i]);
+    }
+
+    if (rc || loaded == 0) {
+        LOG(ERROR) << "No usable keys in keytab: " << keytab_name;
+        if (mem_kt) {
+            krb5_kt_close(krb_context, mem_kt);
+        }
+        krb5_free_principal(krb_context, princ);
+        pthread_mutex_unlock(&krb_lock);
+        return NULL;
+    }
+
+    gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
+    maj = gss_krb5_import_cred(&min, NULL, princ, mem_kt, &cred);
+    krb5_free_principal(krb_context, princ);
+    if (GSS_ERROR(maj)) {
+        LOG(ERROR) << "gss_krb5_import_cred failed, major: " << maj
+                   << ", minor: " << min;
+        krb5_kt_close(krb_context, mem_kt);
+        pthread_mutex_unlock(&krb_lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&krb_lock);
+
+    struct acceptor_ref *ref = new acceptor_ref;
+    ref->refs = 1;
+    ref->generation = gen;
+    ref->cred = cred;
+    ref->keytab = mem_kt;
+    ref->keytab_ino = have_stat ? st.st_ino : 0;
+    if (have_stat) {
+        ref->keytab_mtime = st.st_mtim;
+    }
+
+    LOG(INFO) << "Acceptor credential loaded from: " << keytab_name
+              << ", keys: " << loaded << "/" << entries.size()
+              << ", generation: " << gen;
+    return ref;
+}
+
+void AcceptorCred::install(struct acceptor_ref *ref) {
+    pthread_mutex_lock(&lock);
+    struct acceptor_ref *old = current;
+    if (ref->generation > generation) {
+        current = ref;
+        generation = ref->generation;
+        if (ref->keytab_ino) {
+            keytab_ino = ref->keytab_ino;
+            keytab_mtime = ref->keytab_mtime;
+        }
+    }
+    else {
+        old = ref;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (old) {
+        put(old);
+    }
+}
+
+struct acceptor_ref *AcceptorCred::reload_if_changed() {
+    struct stat st;
+    if (!keytab_stat(&st)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    bool changed = st.st_ino != keytab_ino ||
+                   st.st_mtim.tv_sec != keytab_mtime.tv_sec ||
+                   st.st_mtim.tv_nsec != keytab_mtime.tv_nsec;
+    pthread_mutex_unlock(&lock);
+
+    if (!changed) {
+        return NULL;
+    }
+    LOG(INFO) << "Keytab changed, reloading: " << keytab_name;
+    return build();
+}
+
+struct acceptor_ref *AcceptorCred::get() {
+    pthread_mutex_lock(&lock);
+    struct acceptor_ref *ref = current;
+    if (ref) {
+        ++ref->refs;
+    }
+    pthread_mutex_unlock(&lock);
+    return ref;
+}
+
+void AcceptorCred::put(struct acceptor_ref *ref) {
+    pthread_mutex_lock(&lock);
+    bool last = (--ref->refs == 0);
+    pthread_mutex_unlock(&lock);
+
+    if (last) {
+        unref(ref);
+    }
+}
+
+void AcceptorCred::unref(struct acceptor_ref *ref) {
+    OM_uint32 min;
+    gss_release_cred(&min, &ref->cred);
+
+    pthread_mutex_lock(&krb_lock);
+    krb5_kt_close(krb_context, ref->keytab);
+    pthread_mutex_unlock(&krb_lock);
+
+    delete ref;
+}
@@ -0,0 +1,74 @@
+#ifndef _ACCEPTOR_H
+#define _ACCEPTOR_H
+
+#include <krb5.h>
+#include <gssapi/gssapi_generic.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <string>
+
+// Acceptor credential backed by an in-memory copy of the host keytab.
+struct acceptor_ref {
+    int refs;
+    unsigned generation;
+    gss_cred_id_t cred;
+    krb5_keytab keytab;
+    // keytab file it was built from, 0 - not a file
+    ino_t keytab_ino;
+    struct timespec keytab_mtime;
+};
+
+// Acceptor credential shared by all loops and crypto threads. The
+// relevant keytab entries are copied into a MEMORY: keytab once, so key
+// lookup during gss_accept_sec_context never touches the disk. When the
+// keytab file changes, a new credential is built and swapped in; handshakes
+// in flight keep using the one they started with.
+class AcceptorCred {
+public:
+    AcceptorCred(const std::string& keytab_name_,
+                 const std::string& principal_);
+    ~AcceptorCred();
+
+    // Build credential from the keytab and install it, returns false if
+    // no usable entries were found.
+    bool load();
+
+    // Build a new credential if keytab file inode or mtime changed since
+    // the last load, NULL if it did not or the keytab has no usable keys.
+    // Reads the keytab, so it runs off the loop threads; the result is
+    // passed to install().
+    struct acceptor_ref *reload_if_changed();
+
+    // Make ref the current credential unless a newer one is installed,
+    // takes over the reference.
+    void install(struct acceptor_ref *ref);
+
+    // Current credential or NULL, release with put().
+    struct acceptor_ref *get();
+    void put(struct acceptor_ref *ref);
+
+private:
+    bool keytab_stat(struct stat *st) const;
+    struct acceptor_ref *build();
+    void unref(struct acceptor_ref *ref);
+
+    // krb_context is not safe for concurrent use
+    pthread_mutex_t krb_lock;
+    krb5_context krb_context;
+    std::string keytab_name;
+    std::string keytab_path;
+    std::string principal;
+
+    pthread_mutex_t lock;
+    struct acceptor_ref *current;
+    unsigned generation;
+    // last generation built, under krb_lock
+    unsigned built;
+
+    ino_t keytab_ino;
+    struct timespec keytab_mtime;
+};
+
+#endif  // _ACCEPTOR_H
@@ -0,0 +1,160 @@
+#include "ccache.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+// FILE ccache v4 layout, all integers big endian:
+//
+//   version (0x0504), header length, header tags
+//   default principal
+//   credentials until end of file
+//
+// Principal: name type, component count, realm, components; every string
+// is a 32 bit length followed by the bytes.
+#define FCC_FILE_FORMAT_V4 0x0504
+
+// Output position. Every encoder runs twice: with buf NULL it only counts
+// bytes, so the result is written once into a buffer of the exact size.
+// Growing a string instead would leave freed copies of the session keys
+// on the heap, where the caller's explicit_bzero() can't reach them.
+struct fcc_out {
+    char *buf;
+    size_t len;
+};
+
+static void put_raw(struct fcc_out *out, const void *data, size_t len) {
+    if (out->buf && len) {
+        memcpy(out->buf + out->len, data, len);
+    }
+    out->len += len;
+}
+
+static void put8(struct fcc_out *out, uint8_t v) {
+    put_raw(out, &v, 1);
+}
+
+static void put16(struct fcc_out *out, uint16_t v) {
+    unsigned char b[2] = { (unsigned char)(v >> 8), (unsigned char)v };
+    put_raw(out, b, sizeof(b));
+}
+
+static void put32(struct fcc_out *out, uint32_t v) {
+    unsigned char b[4] = {
+        (unsigned char)(v >> 24), (unsigned char)(v >> 16),
+        (unsigned char)(v >> 8), (unsigned char)v
+    };
+    put_raw(out, b, sizeof(b));
+}
+
+static void put_bytes(struct fcc_out *out, const void *data,
+                      unsigned int len) {
+    put32(out, len);
+    put_raw(out, data, len);
+}
+
+static void put_principal(struct fcc_out *out, krb5_const_principal princ) {
+    put32(out, princ->type);
+    put32(out, princ->length);
+    put_bytes(out, princ->realm.data, princ->realm.length);
+    for (krb5_int32 i = 0; i < princ->length; ++i) {
+        put_bytes(out, princ->data[i].data, princ->data[i].length);
+    }
+}
+
+static void put_creds(struct fcc_out *out, const krb5_creds& creds) {
+    put_principal(out, creds.client);
+    put_principal(out, creds.server);
+
+    put16(out, (uint16_t)creds.keyblock.enctype);
+    put_bytes(out, creds.keyblock.contents, creds.keyblock.length);
+
+    put32(out, creds.times.authtime);
+    put32(out, creds.times.starttime);
+    put32(out, creds.times.endtime);
+    put32(out, creds.times.renew_till);
+
+    put8(out, creds.is_skey ? 1 : 0);
+    put32(out, creds.ticket_flags);
+
+    size_t naddrs = 0;
+    while (creds.addresses && creds.addresses[naddrs]) {
+        ++naddrs;
+    }
+    put32(out, naddrs);
+    for (size_t i = 0; i < naddrs; ++i) {
+        put16(out, (uint16_t)creds.addresses[i]->addrtype);
+        put_bytes(out, creds.addresses[i]->contents,
+                  creds.addresses[i]->length);
+    }
+
+    size_t nauthdata = 0;
+    while (creds.authdata && creds.authdata[nauthdata]) {
+        ++nauthdata;
+    }
+    put32(out, nauthdata);
+    for (size_t i = 0; i < nauthdata; ++i) {
+        put16(out, (uint16_t)creds.authdata[i]->ad_type);
+        put_bytes(out, creds.authdata[i]->contents,
+                  creds.authdata[i]->length);
+    }
+
+    put_bytes(out, creds.ticket.data, creds.ticket.length);
+    put_bytes(out, creds.second_ticket.data, creds.second_ticket.length);
+}
+
+static void put_ccache(struct fcc_out *out, krb5_const_principal princ,
+                       const std::vector<krb5_creds>& creds) {
+    put16(out, FCC_FILE_FORMAT_V4);
+    // No header tags, krb5 only writes the KDC time offset there.
+    put16(out, 0);
+    put_principal(out, princ);
+    for (size_t i = 0; i < creds.size(); ++i) {
+        put_creds(out, creds[i]);
+    }
+}
+
+krb5_error_code
+fcc_encode(krb5_context ctx, krb5_ccache cc, std::string& out) {
+    krb5_error_code rc;
+
+    krb5_principal princ;
+    if ((rc = krb5_cc_get_principal(ctx, cc, &princ))) {
+        return rc;
+    }
+
+    krb5_cc_cursor cursor;
+    if ((rc = krb5_cc_start_seq_get(ctx, cc, &cursor))) {
+        krb5_free_principal(ctx, princ);
+        return rc;
+    }
+
+    // Only the structs are copied when the vector grows, key and ticket
+    // contents stay where krb5 allocated them.
+    std::vector<krb5_creds> creds;
+    krb5_creds cred;
+    while ((rc = krb5_cc_next_cred(ctx, cc, &cursor, &cred)) == 0) {
+        creds.push_back(cred);
+    }
+    krb5_cc_end_seq_get(ctx, cc, &cursor);
+
+    if (rc == KRB5_CC_END) {
+        rc = 0;
+
+        struct fcc_out size = { NULL, 0 };
+        put_ccache(&size, princ, creds);
+
+        out.clear();
+        out.resize(size.len);
+
+        struct fcc_out data = { size.len ? &out[0] : NULL, 0 };
+        put_ccache(&data, princ, creds);
+    }
+
+    for (size_t i = 0; i < creds.size(); ++i) {
+        krb5_free_cred_contents(ctx, &creds[i]);
+    }
+    krb5_free_principal(ctx, princ);
+    return rc;
+}
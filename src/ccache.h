@@ -0,0 +1,18 @@
+#ifndef _CLOUD_TREADMILL_CCACHE_H
+#define _CLOUD_TREADMILL_CCACHE_H
+
+#include <string>
+
+extern "C" {
+    #include <krb5.h>
+}
+
+// Serialize all credentials in cc (typically a MEMORY: ccache) in FILE
+// ccache format version 4, the format MIT krb5 writes by default. The
+// result can be written to a spool file in one go instead of going through
+// the FILE ccache backend, which locks, seeks and writes for every field.
+// out is sized once, so no partial copies of the keys are left behind.
+krb5_error_code
+fcc_encode(krb5_context ctx, krb5_ccache cc, std::string& out);
+
+#endif  // _CLOUD_TREADMILL_CCACHE_H
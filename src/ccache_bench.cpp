@@ -0,0 +1,315 @@
+#include <errno.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <gssapi/gssapi_krb5.h>
+}
+#include <easylogging/easylogging++.h>
+#include <optionparser/optionparser.h>
+
+#include "credmgr.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+namespace el = easyloggingpp;
+
+// Cost of one store through CredMgr::store_creds() with the native ccache
+// writer and with the krb5 FILE ccache backend: wall latency per store, and
+// CPU time and context switches per store from getrusage. For syscall
+// counts run one writer at a time under strace:
+//
+//     make -C src ccache-bench
+//     src/ccache-bench --sync
+//     strace -c -f src/ccache-bench --writer=native --stores=1000
+//     strace -c -f src/ccache-bench --writer=file --stores=1000
+
+void init_log() {
+    el::Configurations log_conf;
+    log_conf.setToDefault();
+    log_conf.setAll(el::ConfigurationType::ToFile, "false");
+    log_conf.setAll(el::ConfigurationType::ToStandardOutput, "true");
+    // Every store logs a line, keep them out of the measurement.
+    log_conf.set(el::Level::Info, el::ConfigurationType::Enabled, "false");
+    el::Loggers::reconfigureAllLoggers(log_conf);
+    log_conf.clear();
+}
+
+enum optionIndex {
+    UNKNOWN,
+    HELP,
+    STORES,
+    SPOOL_DIR,
+    SYNC,
+    WRITER
+};
+const option::Descriptor usage[] = {
+    {UNKNOWN, 0, "" , "" , option::Arg::None,
+        "USAGE: ccache-bench [options]\n\n"
+        "Measure ticket cache stores into a spool directory.\n\n"
+        "Options:" },
+    {HELP, 0, "" , "help", option::Arg::None,
+        "  --help  \tPrint usage and exit." },
+    {STORES, 0, "" , "stores", option::Arg::Optional,
+        "  --stores=<n>  \tStores per writer, defaults 5000." },
+    {SPOOL_DIR, 0, "d", "dir", option::Arg::Optional,
+        "  -d<dir>, \t--dir=<dir>  \tCreate the bench spool in <dir>,"
+        " defaults /var/tmp. Removed when done." },
+    {SYNC, 0, "" , "sync", option::Arg::None,
+        "  --sync  \tFsync every ccache, like --durability=file." },
+    {WRITER, 0, "" , "writer", option::Arg::Optional,
+        "  --writer=<writer>  \tnative or file, defaults both." },
+    {0, 0, 0, 0, 0, 0}
+};
+
+// Forwarded TGT plus service tickets, sized like AD issued tickets with a
+// PAC.
+#define BENCH_SERVICE_TICKETS 2
+#define BENCH_TICKET          1400
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double tv_us(const struct timeval& tv) {
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static bool krb5_check(krb5_context ctx, krb5_error_code rc,
+                       const char *what) {
+    if (rc == 0) {
+        return true;
+    }
+    const char *msg = krb5_get_error_message(ctx, rc);
+    LOG(ERROR) << what << ": " << msg;
+    krb5_free_error_message(ctx, msg);
+    return false;
+}
+
+// Client credential as gss_accept_sec_context hands it over for a
+// forwarded TGT, imported from a MEMORY ccache.
+static bool make_client_cred(krb5_context ctx, const std::string& princ,
+                             gss_cred_id_t *cred) {
+    std::string realm = princ.substr(princ.find('@') + 1);
+    std::string tgs = "krbtgt/" + realm + "@" + realm;
+
+    krb5_principal client;
+    krb5_ccache cc;
+    if (!krb5_check(ctx, krb5_parse_name(ctx, princ.c_str(), &client),
+                    "krb5_parse_name") ||
+        !krb5_check(ctx, krb5_cc_new_unique(ctx, "MEMORY", NULL, &cc),
+                    "krb5_cc_new_unique") ||
+        !krb5_check(ctx, krb5_cc_initialize(ctx, cc, client),
+                    "krb5_cc_initialize")) {
+        return false;
+    }
+
+    std::string key(32, 0x11);
+    std::string ticket(BENCH_TICKET, 0x22);
+    time_t now = time(NULL);
+    for (int i = 0; i <= BENCH_SERVICE_TICKETS; ++i) {
+        char name[256];
+        if (i == 0) {
+            snprintf(name, sizeof(name), "%s", tgs.c_str());
+        }
+        else {
+            snprintf(name, sizeof(name), "host/node%d.%s@%s", i,
+                     realm.c_str(), realm.c_str());
+        }
+
+        krb5_creds creds;
+        memset(&creds, 0, sizeof(creds));
+        creds.client = client;
+        if (!krb5_check(ctx, krb5_parse_name(ctx, name, &creds.server),
+                        "krb5_parse_name")) {
+            return false;
+        }
+        creds.keyblock.enctype = 18;
+        creds.keyblock.length = key.size();
+        creds.keyblock.contents = (krb5_octet *)&key[0];
+        creds.times.authtime = now;
+        creds.times.starttime = now;
+        creds.times.endtime = now + 36000;
+        creds.times.renew_till = now + 7 * 86400;
+        creds.ticket_flags = 0x40e10000;
+        creds.ticket.length = ticket.size();
+        creds.ticket.data = &ticket[0];
+
+        krb5_error_code rc = krb5_cc_store_cred(ctx, cc, &creds);
+        krb5_free_principal(ctx, creds.server);
+        if (!krb5_check(ctx, rc, "krb5_cc_store_cred")) {
+            return false;
+        }
+    }
+
+    OM_uint32 min;
+    OM_uint32 maj = gss_krb5_import_cred(&min, cc, client, NULL, cred);
+    krb5_free_principal(ctx, client);
+    if (GSS_ERROR(maj)) {
+        LOG(ERROR) << "gss_krb5_import_cred failed, major: " << maj
+                   << ", minor: " << min;
+        return false;
+    }
+    return true;
+}
+
+static bool run(const char *what, bool native, bool sync,
+                const std::string& spool, const std::string& princ,
+                gss_cred_id_t cred, long stores) {
+    CredMgr cred_mgr(spool, native, sync, NULL, false);
+
+    struct sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+
+    std::vector<double> latency;
+    latency.reserve(stores);
+    long failed = 0;
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    double start = now_us();
+    for (long i = 0; i < stores; ++i) {
+        double t = now_us();
+        bool skipped;
+        if (!cred_mgr.store_creds(princ, cred, peer, &skipped)) {
+            ++failed;
+        }
+        latency.push_back(now_us() - t);
+    }
+    double elapsed = now_us() - start;
+    getrusage(RUSAGE_SELF, &after);
+
+    std::sort(latency.begin(), latency.end());
+    double user = tv_us(after.ru_utime) - tv_us(before.ru_utime);
+    double sys = tv_us(after.ru_stime) - tv_us(before.ru_stime);
+    long ctxsw = (after.ru_nvcsw - before.ru_nvcsw) +
+                 (after.ru_nivcsw - before.ru_nivcsw);
+
+    printf("%-6s %s %6ld stores %8.3f s  mean %7.1f us  p50 %7.1f us  "
+           "p99 %7.1f us  user %6.1f us  sys %6.1f us  ctxsw %5.2f  "
+           "per store, failed %ld\n",
+           what, sync ? "sync  " : "nosync", stores, elapsed / 1e6,
+           elapsed / stores,
+           latency[latency.size() / 2],
+           latency[latency.size() * 99 / 100],
+           user / stores, sys / stores, (double)ctxsw / stores, failed);
+    return failed == 0;
+}
+
+int main(int argc, char **argv) {
+    init_log();
+
+    // skip program name argv[0] if present
+    argc -= (argc > 0);
+    argv += (argc > 0);
+
+    option::Stats  stats(usage, argc, argv);
+    option::Option* options = new option::Option[stats.options_max];
+    option::Option* buffer  = new option::Option[stats.buffer_max];
+
+    option::Parser parse(usage, argc, argv, options, buffer);
+
+    if (parse.error()) {
+        return -1;
+    }
+
+    if (options[HELP]) {
+        option::printUsage(std::cout, usage);
+        return -1;
+    }
+
+    long stores = 5000;
+    if (options[STORES] && options[STORES].arg) {
+        stores = atol(options[STORES].arg);
+    }
+    if (stores < 1) {
+        LOG(ERROR) << "--stores must be at least 1.";
+        return -1;
+    }
+
+    std::string parent = "/var/tmp";
+    if (options[SPOOL_DIR] && options[SPOOL_DIR].arg) {
+        parent = options[SPOOL_DIR].arg;
+    }
+
+    bool sync = options[SYNC];
+
+    bool native = true;
+    bool file = true;
+    if (options[WRITER] && options[WRITER].arg) {
+        std::string writer(options[WRITER].arg);
+        if (writer == "native") {
+            file = false;
+        }
+        else if (writer == "file") {
+            native = false;
+        }
+        else {
+            LOG(ERROR) << "--writer must be native or file.";
+            return -1;
+        }
+    }
+
+    // Only root may store other users' tickets.
+    struct passwd *pw = getpwuid(geteuid());
+    if (pw == NULL) {
+        LOG(ERROR) << "No user name for euid " << geteuid();
+        return 1;
+    }
+    std::string princ = std::string(pw->pw_name) + "@BENCH.EXAMPLE";
+
+    std::string spool_template = parent + "/ccache-bench.XXXXXX";
+    std::vector<char> spool_path(spool_template.begin(),
+                                 spool_template.end());
+    spool_path.push_back('\0');
+    if (mkdtemp(&spool_path[0]) == NULL) {
+        LOG(ERROR) << "mkdtemp: " << &spool_path[0] << ", "
+                   << strerror(errno);
+        return 1;
+    }
+    std::string spool(&spool_path[0]);
+
+    krb5_context ctx;
+    if (krb5_init_context(&ctx) != 0) {
+        LOG(ERROR) << "krb5_init_context failed.";
+        rmdir(spool.c_str());
+        return 1;
+    }
+
+    gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
+    bool ok = make_client_cred(ctx, princ, &cred);
+    if (ok && native) {
+        ok = run("native", true, sync, spool, princ, cred, stores);
+    }
+    if (ok && file) {
+        ok = run("file", false, sync, spool, princ, cred, stores);
+    }
+
+    OM_uint32 min;
+    gss_release_cred(&min, &cred);
+    krb5_free_context(ctx);
+
+    // CredMgr leaves its temp area behind.
+    std::string target = spool + "/" + princ;
+    unlink(target.c_str());
+    std::string tmp = spool + "/.tkt-tmp";
+    rmdir(tmp.c_str());
+    if (rmdir(spool.c_str()) != 0) {
+        LOG(ERROR) << "Unable to remove " << spool << ", "
+                   << strerror(errno);
+    }
+    return ok ? 0 : 1;
+}
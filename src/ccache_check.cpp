@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <easylogging/easylogging++.h>
+
+#include "ccache.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+namespace el = easyloggingpp;
+
+// Round trip check of fcc_encode() against the krb5 FILE ccache backend:
+//
+//   - credentials encoded by fcc_encode() are read back through FILE:,
+//     field by field, so the output parses as a v4 ccache,
+//   - the encoding is compared byte for byte with what FILE: writes for
+//     the same credentials.
+//
+// Not built by default:
+//
+//     make -C src ccache-check && src/ccache-check
+
+void init_log() {
+    el::Configurations log_conf;
+    log_conf.setToDefault();
+    log_conf.setAll(el::ConfigurationType::ToFile, "false");
+    log_conf.setAll(el::ConfigurationType::ToStandardOutput, "true");
+    el::Loggers::reconfigureAllLoggers(log_conf);
+    log_conf.clear();
+}
+
+static int failures = 0;
+
+#define CHECK(cond, what) \
+    do { \
+        if (!(cond)) { \
+            LOG(ERROR) << "Mismatch: " << what; \
+            ++failures; \
+        } \
+    } while (0)
+
+static bool krb5_check(krb5_context ctx, krb5_error_code rc,
+                       const char *what) {
+    if (rc == 0) {
+        return true;
+    }
+    const char *msg = krb5_get_error_message(ctx, rc);
+    LOG(ERROR) << what << ": " << msg;
+    krb5_free_error_message(ctx, msg);
+    ++failures;
+    return false;
+}
+
+static std::string fill(size_t len, char seed) {
+    std::string s(len, 0);
+    for (size_t i = 0; i < len; ++i) {
+        s[i] = (char)(seed + i * 7);
+    }
+    return s;
+}
+
+static bool data_equal(const krb5_data& a, const krb5_data& b) {
+    return a.length == b.length &&
+           (a.length == 0 || memcmp(a.data, b.data, a.length) == 0);
+}
+
+static void compare_creds(krb5_context ctx, const krb5_creds& want,
+                          const krb5_creds& got) {
+    CHECK(krb5_principal_compare(ctx, want.client, got.client), "client");
+    CHECK(krb5_principal_compare(ctx, want.server, got.server), "server");
+    CHECK(want.client->type == got.client->type, "client name type");
+    CHECK(want.server->type == got.server->type, "server name type");
+
+    CHECK(want.keyblock.enctype == got.keyblock.enctype, "enctype");
+    CHECK(want.keyblock.length == got.keyblock.length &&
+          memcmp(want.keyblock.contents, got.keyblock.contents,
+                 want.keyblock.length) == 0, "session key");
+
+    CHECK(want.times.authtime == got.times.authtime, "authtime");
+    CHECK(want.times.starttime == got.times.starttime, "starttime");
+    CHECK(want.times.endtime == got.times.endtime, "endtime");
+    CHECK(want.times.renew_till == got.times.renew_till, "renew_till");
+    CHECK(want.is_skey == got.is_skey, "is_skey");
+    CHECK(want.ticket_flags == got.ticket_flags, "ticket_flags");
+
+    size_t i = 0;
+    for (; want.addresses && want.addresses[i]; ++i) {
+        const krb5_address *w = want.addresses[i];
+        const krb5_address *g = got.addresses ? got.addresses[i] : NULL;
+        CHECK(g && w->addrtype == g->addrtype && w->length == g->length &&
+              memcmp(w->contents, g->contents, w->length) == 0, "address");
+        if (g == NULL) {
+            return;
+        }
+    }
+    CHECK(got.addresses == NULL || got.addresses[i] == NULL, "addresses");
+
+    i = 0;
+    for (; want.authdata && want.authdata[i]; ++i) {
+        const krb5_authdata *w = want.authdata[i];
+        const krb5_authdata *g = got.authdata ? got.authdata[i] : NULL;
+        CHECK(g && w->ad_type == g->ad_type && w->length == g->length &&
+              memcmp(w->contents, g->contents, w->length) == 0, "authdata");
+        if (g == NULL) {
+            return;
+        }
+    }
+    CHECK(got.authdata == NULL || got.authdata[i] == NULL, "authdata");
+
+    CHECK(data_equal(want.ticket, got.ticket), "ticket");
+    CHECK(data_equal(want.second_ticket, got.second_ticket), "second_ticket");
+}
+
+static bool read_file(const std::string& path, std::string *out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG(ERROR) << "Unable to open " << path << ": " << strerror(errno);
+        return false;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out->append(buf, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+static bool write_file(const std::string& path, const std::string& data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+    if (fd < 0) {
+        LOG(ERROR) << "Unable to create " << path << ": " << strerror(errno);
+        return false;
+    }
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+    close(fd);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    init_log();
+
+    krb5_context ctx;
+    if (krb5_init_context(&ctx) != 0) {
+        LOG(ERROR) << "krb5_init_context failed.";
+        return 1;
+    }
+
+    char dir[] = "/tmp/ccache-check.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        LOG(ERROR) << "mkdtemp: " << strerror(errno);
+        return 1;
+    }
+    std::string encoded_path = std::string(dir) + "/encoded";
+    std::string reference_path = std::string(dir) + "/reference";
+
+    krb5_principal client, tgs, service;
+    if (!krb5_check(ctx, krb5_parse_name(ctx, "user@EXAMPLE.COM", &client),
+                    "krb5_parse_name") ||
+        !krb5_check(ctx, krb5_parse_name(ctx,
+                    "krbtgt/EXAMPLE.COM@EXAMPLE.COM", &tgs),
+                    "krb5_parse_name") ||
+        !krb5_check(ctx, krb5_parse_name(ctx,
+                    "host/node.example.com@EXAMPLE.COM", &service),
+                    "krb5_parse_name")) {
+        return 1;
+    }
+
+    // A forwarded TGT with addresses and authdata, a user-to-user service
+    // ticket, and a ticket too large for a one byte DER length.
+    std::string key1 = fill(32, 1);
+    std::string key2 = fill(16, 2);
+    std::string ticket1 = fill(1100, 3);
+    std::string ticket2 = fill(300, 4);
+    std::string second = fill(280, 5);
+    std::string big_ticket = fill(70000, 6);
+    std::string addr4 = fill(4, 7);
+    std::string addr6 = fill(16, 8);
+    std::string ad = fill(40, 9);
+
+    krb5_address a4 = { 0, 2, 4, (krb5_octet *)&addr4[0] };
+    krb5_address a6 = { 0, 24, 16, (krb5_octet *)&addr6[0] };
+    krb5_address *addrs[] = { &a4, &a6, NULL };
+    krb5_authdata ad1 = { 0, 1, 40, (krb5_octet *)&ad[0] };
+    krb5_authdata *authdata[] = { &ad1, NULL };
+
+    std::vector<krb5_creds> creds(3);
+    for (size_t i = 0; i < creds.size(); ++i) {
+        memset(&creds[i], 0, sizeof(creds[i]));
+        creds[i].client = client;
+        creds[i].times.authtime = 1700000000 + i;
+        creds[i].times.starttime = 1700000010 + i;
+        creds[i].times.endtime = 1700036000 + i;
+        creds[i].times.renew_till = 1700600000 + i;
+    }
+
+    creds[0].server = tgs;
+    creds[0].keyblock.enctype = 18;
+    creds[0].keyblock.length = key1.size();
+    creds[0].keyblock.contents = (krb5_octet *)&key1[0];
+    creds[0].ticket_flags = 0x40e10000;
+    creds[0].addresses = addrs;
+    creds[0].authdata = authdata;
+    creds[0].ticket.length = ticket1.size();
+    creds[0].ticket.data = &ticket1[0];
+
+    creds[1].server = service;
+    creds[1].keyblock.enctype = 17;
+    creds[1].keyblock.length = key2.size();
+    creds[1].keyblock.contents = (krb5_octet *)&key2[0];
+    creds[1].is_skey = 1;
+    creds[1].ticket_flags = 0x00a00000;
+    creds[1].ticket.length = ticket2.size();
+    creds[1].ticket.data = &ticket2[0];
+    creds[1].second_ticket.length = second.size();
+    creds[1].second_ticket.data = &second[0];
+
+    creds[2].server = service;
+    creds[2].keyblock.enctype = 18;
+    creds[2].keyblock.length = key1.size();
+    creds[2].keyblock.contents = (krb5_octet *)&key1[0];
+    creds[2].ticket.length = big_ticket.size();
+    creds[2].ticket.data = &big_ticket[0];
+
+    krb5_ccache mem, reference;
+    if (!krb5_check(ctx, krb5_cc_new_unique(ctx, "MEMORY", NULL, &mem),
+                    "krb5_cc_new_unique") ||
+        !krb5_check(ctx, krb5_cc_initialize(ctx, mem, client),
+                    "krb5_cc_initialize") ||
+        !krb5_check(ctx, krb5_cc_resolve(ctx,
+                    ("FILE:" + reference_path).c_str(), &reference),
+                    "krb5_cc_resolve") ||
+        !krb5_check(ctx, krb5_cc_initialize(ctx, reference, client),
+                    "krb5_cc_initialize")) {
+        return 1;
+    }
+    for (size_t i = 0; i < creds.size(); ++i) {
+        if (!krb5_check(ctx, krb5_cc_store_cred(ctx, mem, &creds[i]),
+                        "krb5_cc_store_cred") ||
+            !krb5_check(ctx, krb5_cc_store_cred(ctx, reference, &creds[i]),
+                        "krb5_cc_store_cred")) {
+            return 1;
+        }
+    }
+    krb5_cc_close(ctx, reference);
+
+    std::string encoded;
+    if (!krb5_check(ctx, fcc_encode(ctx, mem, encoded), "fcc_encode") ||
+        !write_file(encoded_path, encoded)) {
+        return 1;
+    }
+
+    // Read back through the krb5 FILE parser.
+    krb5_ccache file;
+    krb5_principal princ;
+    krb5_cc_cursor cursor;
+    if (!krb5_check(ctx, krb5_cc_resolve(ctx,
+                    ("FILE:" + encoded_path).c_str(), &file),
+                    "krb5_cc_resolve") ||
+        !krb5_check(ctx, krb5_cc_get_principal(ctx, file, &princ),
+                    "krb5_cc_get_principal") ||
+        !krb5_check(ctx, krb5_cc_start_seq_get(ctx, file, &cursor),
+                    "krb5_cc_start_seq_get")) {
+        return 1;
+    }
+    CHECK(krb5_principal_compare(ctx, princ, client), "default principal");
+    krb5_free_principal(ctx, princ);
+
+    size_t n = 0;
+    krb5_creds got;
+    krb5_error_code rc;
+    while ((rc = krb5_cc_next_cred(ctx, file, &cursor, &got)) == 0) {
+        if (n < creds.size()) {
+            compare_creds(ctx, creds[n], got);
+        }
+        ++n;
+        krb5_free_cred_contents(ctx, &got);
+    }
+    krb5_cc_end_seq_get(ctx, file, &cursor);
+    krb5_cc_close(ctx, file);
+    CHECK(rc == KRB5_CC_END, "credentials end, " << error_message(rc));
+    CHECK(n == creds.size(), "credential count " << n);
+
+    // Byte for byte against the FILE writer.
+    std::string expected;
+    if (read_file(reference_path, &expected)) {
+        CHECK(encoded == expected,
+              "encoding, " << encoded.size() << " bytes, FILE: wrote "
+              << expected.size());
+    }
+    else {
+        ++failures;
+    }
+
+    krb5_cc_destroy(ctx, mem);
+    krb5_free_principal(ctx, client);
+    krb5_free_principal(ctx, tgs);
+    krb5_free_principal(ctx, service);
+    krb5_free_context(ctx);
+
+    unlink(encoded_path.c_str());
+    unlink(reference_path.c_str());
+    rmdir(dir);
+
+    if (failures) {
+        LOG(ERROR) << failures << " check(s) failed.";
+        return 1;
+    }
+    LOG(INFO) << "fcc_encode round trip ok, " << creds.size()
+              << " credentials, " << encoded.size() << " bytes.";
+    return 0;
+}
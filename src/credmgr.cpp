@@ -1,126 +1,561 @@
 #include "credmgr.h"
 #include "creds.h"
+#include "ccache.h"
+#include "spoolindex.h"
+#include "hotlog.h"
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
 
-#include <easylogging/easylogging++.h>
+#include <functional>
+#include <vector>
 
-static int safe_move(const std::string& src, const std::string& dst) {
-    // Safely cope src to dst by creating tmp file and renaming it.
-    std::string dst_template = dst + "XXXXXX";
+#include <easylogging/easylogging++.h>
 
-    char temp[dst_template.size() + 1];
-    memset(temp, 0, sizeof(temp));
-    strcpy(temp, dst_template.c_str());
+// Temp area inside the spool, on the same filesystem so that finished
+// ccaches can be renamed into place.
+#define SPOOL_TMP_DIR ".tkt-tmp"
 
-    int temp_fd = mkstemp(temp);
-    int src_fd = open(src.c_str(), O_RDONLY, 0);
+// Stores and renewals of the same spool file commit under the same lock,
+// so a renewal can check that the file is still the one it renewed right
+// before replacing it.
+#define COMMIT_LOCKS 64
 
-    char buf[BUFSIZ];
-    ssize_t bytes_read;
-    ssize_t bytes_written;
+static pthread_mutex_t commit_locks[COMMIT_LOCKS];
+static pthread_once_t commit_locks_once = PTHREAD_ONCE_INIT;
 
-    int success = 1;
-    while ((bytes_read = read(src_fd, buf, BUFSIZ)) > 0) {
-        // TODO: need to check for EINTR and retry.
-        if (bytes_read == -1) {
-            LOG(ERROR) << "read error: " << src << " errno: " << errno;
-            success = 0;
-            break;
-        }
-        bytes_written = write(temp_fd, buf, bytes_read);
-        // TODO: need to check for EINTR and retry.
-        if (bytes_written == -1) {
-            LOG(ERROR) << "write error: " << temp << " errno: " << errno;
-            success = 0;
-            break;
-        }
-        if (bytes_written != bytes_read) {
-            LOG(ERROR) << "partial write: "
-                << bytes_written << "/" << bytes_read << " errno: " << errno;
-            success = 0;
-            break;
-        }
+static void commit_locks_init() {
+    for (int i = 0; i < COMMIT_LOCKS; ++i) {
+        pthread_mutex_init(&commit_locks[i], NULL);
     }
+}
 
-    close(temp_fd);
-    close(src_fd);
+static pthread_mutex_t *commit_lock(const std::string& name) {
+    pthread_once(&commit_locks_once, commit_locks_init);
+    return &commit_locks[std::hash<std::string>()(name) % COMMIT_LOCKS];
+}
 
-    if (!success) {
-        LOG(ERROR) << "Failed to write tickets to: " << dst;
-        unlink(temp);
-        return 0;
+static bool fsync_fd(int fd) {
+    while (fsync(fd) != 0) {
+        if (errno != EINTR) {
+            LOG(ERROR) << "fsync: " << strerror(errno);
+            return false;
+        }
     }
+    return true;
+}
 
-    int rc = rename(temp, dst.c_str());
-    if (rc == 0) {
-        LOG(INFO) << "Rename: " << temp << " " << dst << ", rc = " << rc;
-    } else {
-        LOG(INFO) << "Rename: " << temp << " " << dst << ", rc = " << rc
-                  << ", "
-                  << strerror(errno);
-        if(0 != unlink(temp)) {
-            LOG(ERROR) << "Unable to unlink: " << temp << " errno: " << errno;
+static bool copy_fd(int src_fd, int dst_fd) {
+#ifdef HAVE_COPY_FILE_RANGE
+    for (;;) {
+        ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, 1 << 20, 0);
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            return true;
         }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+            errno != EOPNOTSUPP) {
+            LOG(ERROR) << "copy_file_range: " << strerror(errno);
+            return false;
+        }
+        // Not supported between these files, copy the rest by hand.
+        break;
     }
+#endif
+
+    char buf[BUFSIZ];
+    for (;;) {
+        ssize_t bytes_read = read(src_fd, buf, sizeof(buf));
+        if (bytes_read == 0) {
+            return true;
+        }
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(ERROR) << "read: " << strerror(errno);
+            return false;
+        }
 
-    if(0 != unlink(src.c_str())) {
-        LOG(ERROR) << "Unable to unlink: " << src << " errno: " << errno;
+        ssize_t off = 0;
+        while (off < bytes_read) {
+            ssize_t bytes_written = write(dst_fd, buf + off, bytes_read - off);
+            if (bytes_written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG(ERROR) << "write: " << strerror(errno);
+                return false;
+            }
+            off += bytes_written;
+        }
     }
-    return rc == 0;
 }
 
-CredMgr::CredMgr(const std::string& tkt_spool_dir_):
+CredMgr::CredMgr(const std::string& tkt_spool_dir_,
+                 bool native_writer_,
+                 bool sync_writes_,
+                 SpoolIndex *index_,
+                 bool skip_unchanged_):
         tkt_spool_dir(tkt_spool_dir_),
+        spool_fd(-1),
+        tmp_fd(-1),
+        native_writer(native_writer_),
+        sync_writes(sync_writes_),
+        index(index_),
+        skip_unchanged(skip_unchanged_),
         euid(geteuid()) {
 
     ssh_gssapi_krb5_init(&krb_context);
 
     struct passwd *pw = getpwuid(euid);
     me.assign(pw->pw_name);
+    LOG(INFO) << "Credential manager running as euid: " << euid
+              << ", username: " << me;
+
+    spool_fd = open(tkt_spool_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (spool_fd < 0) {
+        LOG(ERROR) << "Unable to open spool dir: " << tkt_spool_dir
+                   << ", " << strerror(errno);
+    }
+    else {
+        if (mkdirat(spool_fd, SPOOL_TMP_DIR, 0700) != 0 && errno != EEXIST) {
+            LOG(ERROR) << "Unable to create: " << tkt_spool_dir
+                       << "/" SPOOL_TMP_DIR ", " << strerror(errno);
+        }
+        tmp_fd = openat(spool_fd, SPOOL_TMP_DIR,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        // May have been created by someone else first, /tmp is the default
+        // spool. Whoever can write to it can replace a ccache before it is
+        // renamed into the spool.
+        struct stat st;
+        if (tmp_fd >= 0 && (fstat(tmp_fd, &st) != 0 || st.st_uid != euid ||
+                            (st.st_mode & (S_IWGRP | S_IWOTH)))) {
+            LOG(ERROR) << "Refusing " << tkt_spool_dir << "/" SPOOL_TMP_DIR
+                       << ", not a private directory of uid " << euid;
+            close(tmp_fd);
+            tmp_fd = -1;
+        }
+        if (tmp_fd >= 0) {
+            tmp_dir = tkt_spool_dir + "/" SPOOL_TMP_DIR;
+        }
+    }
+
+    if (tmp_fd < 0) {
+        // No temp area in the spool, ccaches are copied in from /tmp.
+        LOG(ERROR) << "Spool temp area unavailable, writing ccaches to /tmp.";
+        tmp_dir = "/tmp";
+        tmp_fd = open(tmp_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
 }
 
 CredMgr::~CredMgr() {
+    if (tmp_fd >= 0) {
+        close(tmp_fd);
+    }
+    if (spool_fd >= 0) {
+        close(spool_fd);
+    }
 }
 
-bool CredMgr::store_creds(const std::string& accepted_princ,
-                          gss_cred_id_t client_creds) const {
+// Copy ccache into a new file in the spool and rename it over name, used
+// when the temp area is on another filesystem.
+bool CredMgr::copy_into_spool(const char *tmp_name,
+                              const std::string& name) const {
+    int src_fd = openat(tmp_fd, tmp_name, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) {
+        LOG(ERROR) << "Unable to open: " << tmp_dir << "/" << tmp_name
+                   << ", " << strerror(errno);
+        return false;
+    }
 
-    LOG(INFO) << "Credential manager running as euid: " << euid
-              << ", username: " << me;
+    std::string dst_template = tkt_spool_dir + "/" + name + "XXXXXX";
+    std::vector<char> temp(dst_template.begin(), dst_template.end());
+    temp.push_back('\0');
+
+    int temp_fd = mkostemp(&temp[0], O_CLOEXEC);
+    if (temp_fd < 0) {
+        LOG(ERROR) << "mkstemp: " << &temp[0] << ", " << strerror(errno);
+        close(src_fd);
+        return false;
+    }
+    const char *temp_name = &temp[0] + tkt_spool_dir.size() + 1;
+
+    bool success = copy_fd(src_fd, temp_fd);
+    if (success && sync_writes) {
+        success = fsync_fd(temp_fd);
+    }
+    close(src_fd);
+    if (close(temp_fd) != 0) {
+        success = false;
+    }
+
+    if (success && renameat(spool_fd, temp_name, spool_fd, name.c_str()) == 0) {
+        return !sync_writes || fsync_fd(spool_fd);
+    }
+
+    LOG(ERROR) << "Failed to write tickets to: " << tkt_spool_dir << "/"
+               << name << ", " << strerror(errno);
+    unlinkat(spool_fd, temp_name, 0);
+    return false;
+}
+
+// Write serialized ccache to a new file in the temp area, returns its
+// FILE: name or empty string on error.
+std::string CredMgr::write_ccache(const std::string& data) const {
+    std::string ccname = "FILE:" + tmp_dir + "/krb5cc_" +
+                         std::to_string((long long)euid) + "_XXXXXXXXXX";
+    std::vector<char> path(ccname.begin() + strlen("FILE:"), ccname.end());
+    path.push_back('\0');
+
+    int fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd < 0) {
+        LOG(ERROR) << "mkstemp: " << &path[0] << ", " << strerror(errno);
+        return std::string();
+    }
+
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t bytes_written = write(fd, data.data() + off, data.size() - off);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(ERROR) << "write: " << &path[0] << ", " << strerror(errno);
+            close(fd);
+            unlink(&path[0]);
+            return std::string();
+        }
+        off += bytes_written;
+    }
+
+    if (sync_writes && !fsync_fd(fd)) {
+        close(fd);
+        unlink(&path[0]);
+        return std::string();
+    }
+
+    if (close(fd) != 0) {
+        LOG(ERROR) << "close: " << &path[0] << ", " << strerror(errno);
+        unlink(&path[0]);
+        return std::string();
+    }
+    return "FILE:" + std::string(&path[0]);
+}
+
+// Flush ccache written by the krb5 FILE backend, removes it on error.
+bool CredMgr::sync_tmp_ccache(const std::string& tmp_ccname) const {
+    const char *tmp_name = tmp_ccname.c_str() + tmp_ccname.rfind('/') + 1;
+
+    bool success = false;
+    int fd = openat(tmp_fd, tmp_name, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        success = fsync_fd(fd);
+        close(fd);
+    }
+    else {
+        LOG(ERROR) << "Unable to open: " << tmp_ccname
+                   << ", " << strerror(errno);
+    }
+
+    if (!success) {
+        unlinkat(tmp_fd, tmp_name, 0);
+    }
+    return success;
+}
+
+// Remove ccache from the temp area.
+void CredMgr::discard_ccache(const std::string& tmp_ccname) const {
+    const char *tmp_name = tmp_ccname.c_str() + tmp_ccname.rfind('/') + 1;
+    if (unlinkat(tmp_fd, tmp_name, 0) != 0) {
+        LOG(ERROR) << "Unable to unlink: " << tmp_ccname
+                   << " errno: " << errno;
+    }
+}
+
+// Move finished ccache from the temp area to name in the spool.
+bool CredMgr::commit_ccache(const std::string& tmp_ccname,
+                            const std::string& name) const {
+    const char *tmp_name = tmp_ccname.c_str() + tmp_ccname.rfind('/') + 1;
+
+    if (renameat(tmp_fd, tmp_name, spool_fd, name.c_str()) == 0) {
+        return !sync_writes || fsync_fd(spool_fd);
+    }
+
+    bool success = false;
+    if (errno == EXDEV) {
+        success = copy_into_spool(tmp_name, name);
+    }
+    else {
+        LOG(ERROR) << "Rename: " << tmp_ccname << " " << name
+                   << ", " << strerror(errno);
+    }
+
+    if (unlinkat(tmp_fd, tmp_name, 0) != 0) {
+        LOG(ERROR) << "Unable to unlink: " << tmp_ccname
+                   << " errno: " << errno;
+    }
+    return success;
+}
+
+// Index entry of spool file name, if the file is still the one indexed.
+bool CredMgr::spool_current(const std::string& name,
+                            struct spool_meta *current) const {
+    if (!index->lookup(name, current)) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstatat(spool_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        st.st_ino != current->ino ||
+        st.st_mtim.tv_sec != current->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != current->mtime.tv_nsec) {
+        // Removed or replaced by someone else.
+        index->remove(name);
+        return false;
+    }
+    return true;
+}
+
+// True if spool file name is the one indexed and already holds a TGT at
+// least as new as incoming.
+bool CredMgr::spool_has(const std::string& name,
+                        const struct spool_meta& incoming) const {
+    struct spool_meta current;
+    return spool_current(name, &current) &&
+           spool_meta_not_newer(incoming, current);
+}
+
+void CredMgr::spool_record(const std::string& name,
+                           struct spool_meta& meta) const {
+    struct stat st;
+    if (fstatat(spool_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        index->remove(name);
+        return;
+    }
+    meta.ino = st.st_ino;
+    meta.mtime = st.st_mtim;
+    index->update(name, meta);
+}
+
+bool CredMgr::store_creds(const std::string& accepted_princ,
+                          gss_cred_id_t client_creds,
+                          const struct sockaddr_in& peer,
+                          bool *skipped) const {
+    *skipped = false;
 
     if (euid != 0 && accepted_princ.find(me + "@") != 0) {
-        LOG(INFO) << "Ignoring unexpected connection from: "
+        HLOG(INFO) << "Ignoring unexpected connection from: "
                   << accepted_princ;
         return false;
     }
 
-    std::string tmp_ccname = ssh_gssapi_krb5_storecreds(
-                krb_context,
-                client_creds,
-                accepted_princ.c_str());
+    krb5_ccache mem_ccache = NULL;
+    if (native_writer || index) {
+        if (!ssh_gssapi_krb5_memcreds(krb_context,
+                                      client_creds,
+                                      accepted_princ.c_str(),
+                                      &mem_ccache)) {
+            return false;
+        }
+    }
+
+    time_t now = time(NULL);
+    struct spool_meta meta;
+    bool have_meta = index &&
+        spool_meta_from_ccache(krb_context, mem_ccache, &meta);
+    if (have_meta && skip_unchanged && spool_has(accepted_princ, meta)) {
+        krb5_cc_destroy(krb_context, mem_ccache);
+        HLOG(INFO) << "Spool already has current tickets: " << accepted_princ;
+        index->touch(accepted_princ, now, peer);
+        *skipped = true;
+        return true;
+    }
+
+    std::string tmp_ccname;
+    if (native_writer) {
+        std::string data;
+        krb5_error_code rc = fcc_encode(krb_context, mem_ccache, data);
+        if (rc == 0) {
+            tmp_ccname = write_ccache(data);
+        }
+        else {
+            LOG(ERROR) << "fcc_encode: " << error_message(rc);
+        }
+        // Serialized ccache holds session keys.
+        explicit_bzero(&data[0], data.size());
+    }
+    else {
+        tmp_ccname = ssh_gssapi_krb5_storecreds(
+                    krb_context,
+                    client_creds,
+                    accepted_princ.c_str(),
+                    tmp_dir.c_str());
+        if (!tmp_ccname.empty() && sync_writes &&
+            !sync_tmp_ccache(tmp_ccname)) {
+            tmp_ccname.clear();
+        }
+    }
+    if (mem_ccache) {
+        krb5_cc_destroy(krb_context, mem_ccache);
+    }
     if (tmp_ccname.empty()) {
-        LOG(ERROR) << "Unexpected error storing new creds.";
+        HLOG(ERROR) << "Unexpected error storing new creds.";
         return false;
     }
 
-    // Rename temp tmp_ccname into target.
+    // Rename temp tmp_ccname into target, and index it before a renewal
+    // of the principal can look at the file.
     std::string tgt_ccname = tkt_spool_dir + "/" + accepted_princ;
-    if (safe_move(tmp_ccname, tgt_ccname)) {
-        LOG(INFO) << "Ticket cache moved: FILE:"
-                  << tgt_ccname;
+    pthread_mutex_t *lock = commit_lock(accepted_princ);
+    pthread_mutex_lock(lock);
+    bool committed = commit_ccache(tmp_ccname, accepted_princ);
+    if (committed && have_meta) {
+        meta.last_forward = now;
+        meta.last_peer = peer;
+        spool_record(accepted_princ, meta);
     }
-    else {
-        LOG(ERROR) << "Error rename: "
+    else if (index) {
+        index->remove(accepted_princ);
+    }
+    pthread_mutex_unlock(lock);
+
+    if (!committed) {
+        HLOG(ERROR) << "Error rename: "
                    << tmp_ccname
                    << tgt_ccname;
+        return false;
     }
 
-    LOG(INFO) << "Tickets stored successfully: " << tgt_ccname;
+    HLOG(INFO) << "Tickets stored successfully: " << tgt_ccname;
+    return true;
+}
+
+bool CredMgr::renew_creds(const std::string& name, bool *skipped) const {
+    *skipped = false;
+
+    struct spool_meta current;
+    if (!index || !spool_current(name, &current)) {
+        return false;
+    }
+
+    std::string ccname = "FILE:" + tkt_spool_dir + "/" + name;
+    krb5_ccache spool_ccache = NULL;
+    krb5_principal client = NULL;
+    krb5_creds creds;
+    memset(&creds, 0, sizeof(creds));
+
+    krb5_error_code rc = krb5_cc_resolve(krb_context, ccname.c_str(),
+                                         &spool_ccache);
+    if (rc == 0) {
+        rc = krb5_cc_get_principal(krb_context, spool_ccache, &client);
+    }
+    if (rc == 0) {
+        // TGT of the client's realm.
+        rc = krb5_get_renewed_creds(krb_context, &creds, client,
+                                    spool_ccache, NULL);
+    }
+    if (spool_ccache) {
+        krb5_cc_close(krb_context, spool_ccache);
+    }
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to renew: " << name << ", "
+                   << error_message(rc);
+        if (client) {
+            krb5_free_principal(krb_context, client);
+        }
+        return false;
+    }
+
+    // Like kinit -R, the renewed cache holds just the new TGT.
+    krb5_ccache mem_ccache = NULL;
+    rc = krb5_cc_new_unique(krb_context, "MEMORY", NULL, &mem_ccache);
+    if (rc == 0) {
+        rc = krb5_cc_initialize(krb_context, mem_ccache, client);
+    }
+    if (rc == 0) {
+        rc = krb5_cc_store_cred(krb_context, mem_ccache, &creds);
+    }
+    krb5_free_cred_contents(krb_context, &creds);
+    krb5_free_principal(krb_context, client);
+
+    struct spool_meta meta;
+    if (rc != 0 ||
+        !spool_meta_from_ccache(krb_context, mem_ccache, &meta)) {
+        LOG(ERROR) << "Unable to cache renewed tickets: " << name
+                   << (rc ? ", " : "") << (rc ? error_message(rc) : "");
+        if (mem_ccache) {
+            krb5_cc_destroy(krb_context, mem_ccache);
+        }
+        return false;
+    }
+
+    if (spool_has(name, meta)) {
+        // A forward beat us to it.
+        krb5_cc_destroy(krb_context, mem_ccache);
+        *skipped = true;
+        return true;
+    }
+
+    // Always written natively, there are no gss creds to hand to the krb5
+    // FILE writer.
+    std::string tmp_ccname;
+    std::string data;
+    rc = fcc_encode(krb_context, mem_ccache, data);
+    if (rc == 0) {
+        tmp_ccname = write_ccache(data);
+    }
+    else {
+        LOG(ERROR) << "fcc_encode: " << error_message(rc);
+    }
+    explicit_bzero(&data[0], data.size());
+    krb5_cc_destroy(krb_context, mem_ccache);
+
+    if (tmp_ccname.empty()) {
+        LOG(ERROR) << "Unable to store renewed tickets: " << name;
+        return false;
+    }
+
+    // A forward may have replaced the file while the KDC was asked, its
+    // tickets are newer than ours and must not be overwritten.
+    pthread_mutex_t *lock = commit_lock(name);
+    pthread_mutex_lock(lock);
+    struct spool_meta latest;
+    if (!spool_current(name, &latest) ||
+        latest.ino != current.ino ||
+        latest.mtime.tv_sec != current.mtime.tv_sec ||
+        latest.mtime.tv_nsec != current.mtime.tv_nsec) {
+        pthread_mutex_unlock(lock);
+        discard_ccache(tmp_ccname);
+        HLOG(INFO) << "Spool file changed during renewal, dropped: " << name;
+        *skipped = true;
+        return true;
+    }
+
+    if (!commit_ccache(tmp_ccname, name)) {
+        pthread_mutex_unlock(lock);
+        LOG(ERROR) << "Unable to store renewed tickets: " << name;
+        return false;
+    }
+
+    // Renewal is not a forward.
+    meta.last_forward = current.last_forward;
+    meta.last_peer = current.last_peer;
+    spool_record(name, meta);
+    pthread_mutex_unlock(lock);
+
+    HLOG(INFO) << "Tickets renewed: " << tkt_spool_dir << "/" << name;
     return true;
 }
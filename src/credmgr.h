@@ -4,19 +4,68 @@
 #include <krb5.h>
 #include <gssapi/gssapi_generic.h>
 
+#include <netinet/in.h>
+
 #include <string>
 
+class SpoolIndex;
+struct spool_meta;
+
 class CredMgr {
 public:
-    CredMgr(const std::string& tkt_spool_dir_);
+    // native_writer - serialize ccache in memory and write it in one go,
+    // otherwise write through the krb5 FILE ccache backend
+    // sync_writes - fsync every ccache and the spool directory before
+    // store_creds() returns
+    // index - metadata of spool files, updated on every store; NULL - no
+    // index
+    // skip_unchanged - don't rewrite a ccache with the same or an older TGT
+    CredMgr(const std::string& tkt_spool_dir_,
+            bool native_writer_,
+            bool sync_writes_,
+            SpoolIndex *index_,
+            bool skip_unchanged_);
     ~CredMgr();
 
+    // Returns true if creds are in the spool, *skipped is set if the
+    // spool already had them and nothing was written.
     bool store_creds(const std::string& accepted_princ,
-                     gss_cred_id_t client_creds) const;
+                     gss_cred_id_t client_creds,
+                     const struct sockaddr_in& peer,
+                     bool *skipped) const;
+
+    // Renew the TGT in spool file name with the KDC and replace the file.
+    // Returns false if the file is not the indexed one or the KDC refused,
+    // *skipped is set if the spool meanwhile got a newer TGT, or the file
+    // was replaced while the KDC was asked.
+    bool renew_creds(const std::string& name, bool *skipped) const;
 
 private:
+    std::string write_ccache(const std::string& data) const;
+    bool sync_tmp_ccache(const std::string& tmp_ccname) const;
+    bool spool_current(const std::string& name,
+                       struct spool_meta *current) const;
+    bool spool_has(const std::string& name,
+                   const struct spool_meta& incoming) const;
+    void spool_record(const std::string& name,
+                      struct spool_meta& meta) const;
+    bool commit_ccache(const std::string& tmp_ccname,
+                       const std::string& name) const;
+    void discard_ccache(const std::string& tmp_ccname) const;
+    bool copy_into_spool(const char *tmp_name,
+                         const std::string& name) const;
+
     krb5_context krb_context;
     std::string tkt_spool_dir;
+    // ccaches are written in tmp_dir and renamed into the spool, both
+    // directories are kept open for openat/renameat
+    std::string tmp_dir;
+    int spool_fd;
+    int tmp_fd;
+    bool native_writer;
+    bool sync_writes;
+    SpoolIndex *index;
+    bool skip_unchanged;
     std::string me;
     int euid;
 };
@@ -1,9 +1,15 @@
 #ifndef _WIN32
 
 #include "creds.h"
+#include "hotlog.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+
+#include <vector>
 
 extern "C" {
     #include <gssapi/gssapi_generic.h>
@@ -25,16 +31,18 @@ ssh_gssapi_krb5_init(krb5_context *context) {
 }
 
 krb5_error_code
-ssh_krb5_cc_gen(krb5_context ctx, krb5_ccache *ccache) {
-    char ccname_tmp[40];
-	int ret = snprintf(ccname_tmp, sizeof(ccname_tmp),
-	    "FILE:/tmp/krb5cc_%d_XXXXXXXXXX", geteuid());
-	if (ret < 0 || (size_t)ret >= sizeof(ccname_tmp)) {
-		return ENOMEM;
-    }
+ssh_krb5_cc_gen(krb5_context ctx, const char *dir, krb5_ccache *ccache) {
+	std::string ccname_tmp("FILE:");
+	ccname_tmp += dir;
+	ccname_tmp += "/krb5cc_";
+	ccname_tmp += std::to_string((long long)geteuid());
+	ccname_tmp += "_XXXXXXXXXX";
+
+	std::vector<char> ccname(ccname_tmp.begin(), ccname_tmp.end());
+	ccname.push_back('\0');
 
 	mode_t old_umask = umask(0177);
-	int tmpfd = mkstemp(ccname_tmp + strlen("FILE:"));
+	int tmpfd = mkostemp(&ccname[strlen("FILE:")], O_CLOEXEC);
 	umask(old_umask);
 	if (tmpfd == -1) {
         LOG(ERROR) << "mkstemp: " << strerror(errno);
@@ -48,15 +56,16 @@ ssh_krb5_cc_gen(krb5_context ctx, krb5_ccache *ccache) {
 	}
 	close(tmpfd);
 
-    LOG(INFO) << "Ticket file: " << ccname_tmp;
-	return krb5_cc_resolve(ctx, ccname_tmp, ccache);
+    HLOG(INFO) << "Ticket file: " << &ccname[0];
+	return krb5_cc_resolve(ctx, &ccname[0], ccache);
 }
 
 const std::string
 ssh_gssapi_krb5_storecreds(
         krb5_context krb_context,
 	    gss_cred_id_t creds,
-	    const char *exportedname) {
+	    const char *exportedname,
+	    const char *dir) {
 
     krb5_ccache ccache;
 	krb5_error_code problem;
@@ -65,7 +74,7 @@ ssh_gssapi_krb5_storecreds(
 	int len;
     std::string empty;
 
-    LOG(INFO) << "About to store creds: " << exportedname;
+    HLOG(INFO) << "About to store creds: " << exportedname;
 	if (creds == NULL) {
         LOG(ERROR) << "No credentials storedxx";
 		return empty;
@@ -79,7 +88,7 @@ ssh_gssapi_krb5_storecreds(
 		return empty;
 	}
 #else
-	if ((problem = ssh_krb5_cc_gen(krb_context, &ccache))) {
+	if ((problem = ssh_krb5_cc_gen(krb_context, dir, &ccache))) {
 		LOG(ERROR) << "ssh_krb5_cc_gen: "
 		           << krb5_get_err_text(krb_context, problem);
 		return empty;
@@ -110,10 +119,57 @@ ssh_gssapi_krb5_storecreds(
 
 	std::string new_ccname = krb5_cc_get_name(krb_context, ccache);
 
-    LOG(INFO) << "Ticket file: " << new_ccname;
+    HLOG(INFO) << "Ticket file: " << new_ccname;
 	krb5_cc_close(krb_context, ccache);
 
     return new_ccname;
 }
 
+bool
+ssh_gssapi_krb5_memcreds(
+        krb5_context krb_context,
+	    gss_cred_id_t creds,
+	    const char *exportedname,
+	    krb5_ccache *ccache) {
+
+	krb5_error_code problem;
+	krb5_principal princ;
+	OM_uint32 maj_status, min_status;
+
+	if (creds == NULL) {
+		LOG(ERROR) << "No credentials stored";
+		return false;
+	}
+
+	if ((problem = krb5_cc_new_unique(krb_context, "MEMORY", NULL, ccache))) {
+		LOG(ERROR) << "krb5_cc_new_unique: "
+		           << krb5_get_err_text(krb_context, problem);
+		return false;
+	}
+
+	if ((problem = krb5_parse_name(krb_context, exportedname, &princ))) {
+		LOG(ERROR) << "krb5_parse_name: "
+		           << krb5_get_err_text(krb_context, problem);
+		krb5_cc_destroy(krb_context, *ccache);
+		return false;
+	}
+
+	problem = krb5_cc_initialize(krb_context, *ccache, princ);
+	krb5_free_principal(krb_context, princ);
+	if (problem) {
+		LOG(ERROR) << "krb5_cc_initialize: "
+		           << krb5_get_err_text(krb_context, problem);
+		krb5_cc_destroy(krb_context, *ccache);
+		return false;
+	}
+
+	if ((maj_status = gss_krb5_copy_ccache(&min_status, creds, *ccache))) {
+		LOG(ERROR) << "gss_krb5_copy_ccache failed.";
+		krb5_cc_destroy(krb_context, *ccache);
+		return false;
+	}
+
+	return true;
+}
+
 #endif  // #ifndef _WIN32
@@ -12,13 +12,24 @@ extern "C" {
 bool
 ssh_gssapi_krb5_init(krb5_context *context);
 
+// Create empty FILE ccache with unique name in dir.
 krb5_error_code
-ssh_krb5_cc_gen(krb5_context ctx, krb5_ccache *ccache);
+ssh_krb5_cc_gen(krb5_context ctx, const char *dir, krb5_ccache *ccache);
 
 const std::string
 ssh_gssapi_krb5_storecreds(
         krb5_context krb_context,
 	    gss_cred_id_t creds,
-	    const char *exportedname);
+	    const char *exportedname,
+	    const char *dir);
+
+// Copy delegated creds into a new MEMORY ccache, destroy with
+// krb5_cc_destroy.
+bool
+ssh_gssapi_krb5_memcreds(
+        krb5_context krb_context,
+	    gss_cred_id_t creds,
+	    const char *exportedname,
+	    krb5_ccache *ccache);
 
 #endif  //  _CLOUD_TREADMILL_KRB_CREDS_H
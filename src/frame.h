@@ -0,0 +1,28 @@
+#ifndef _CLOUD_TREADMILL_FRAME_H
+#define _CLOUD_TREADMILL_FRAME_H
+
+// Wire framing shared by tkt-send and tkt-recv: every GSS token is sent as
+// a 4 byte big endian length followed by the token.
+
+#include <stddef.h>
+
+#define FRAME_HDR_LEN 4
+
+// Protocol limit on the token size, tkt-recv can be configured lower.
+#define FRAME_MAX_LEN (1024 * 1024)
+
+inline void frame_encode_hdr(size_t len, unsigned char *hdr) {
+    hdr[0] = (unsigned char)(len >> 24);
+    hdr[1] = (unsigned char)(len >> 16);
+    hdr[2] = (unsigned char)(len >> 8);
+    hdr[3] = (unsigned char)(len);
+}
+
+inline size_t frame_decode_hdr(const unsigned char *hdr) {
+    return ((size_t)hdr[0] << 24) |
+           ((size_t)hdr[1] << 16) |
+           ((size_t)hdr[2] << 8) |
+           (size_t)hdr[3];
+}
+
+#endif  // _CLOUD_TREADMILL_FRAME_H
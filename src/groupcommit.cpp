@@ -0,0 +1,134 @@
+#include "groupcommit.h"
+#include "workpool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <easylogging/easylogging++.h>
+
+GroupCommit::GroupCommit(const std::string& spool_dir,
+                         unsigned window_ms_,
+                         fail_fn fail_):
+        dir(spool_dir),
+        dir_fd(-1),
+        window_ms(window_ms_),
+        fail(fail_),
+        head(NULL),
+        tail(NULL),
+        stopping(false),
+        started(false) {
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+GroupCommit::~GroupCommit() {
+    if (started) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(thread, NULL);
+    }
+
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+bool GroupCommit::start() {
+    dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        LOG(ERROR) << "Unable to open spool dir: " << dir
+                   << ", " << strerror(errno);
+        return false;
+    }
+
+    int rc = pthread_create(&thread, NULL, thread_main, this);
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to start commit thread: " << strerror(rc);
+        return false;
+    }
+    started = true;
+
+    LOG(INFO) << "Group commit enabled, window: " << window_ms << "ms";
+    return true;
+}
+
+void GroupCommit::add(struct work_job *job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&lock);
+    bool wakeup = (head == NULL);
+    if (tail) {
+        tail->next = job;
+    }
+    else {
+        head = job;
+    }
+    tail = job;
+    if (wakeup) {
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Flush file data and directory entries of the whole spool filesystem,
+// renames included.
+bool GroupCommit::sync() {
+    while (syncfs(dir_fd) != 0) {
+        if (errno != EINTR) {
+            LOG(ERROR) << "syncfs: " << dir << ", " << strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+void *GroupCommit::thread_main(void *arg) {
+    GroupCommit *gc = (GroupCommit *)arg;
+
+    pthread_mutex_lock(&gc->lock);
+    for (;;) {
+        while (gc->head == NULL && !gc->stopping) {
+            pthread_cond_wait(&gc->cond, &gc->lock);
+        }
+
+        if (gc->head == NULL) {
+            break;
+        }
+
+        // Let stores finishing right behind this one join the batch.
+        if (gc->window_ms && !gc->stopping) {
+            pthread_mutex_unlock(&gc->lock);
+            usleep(gc->window_ms * 1000);
+            pthread_mutex_lock(&gc->lock);
+        }
+
+        struct work_job *job = gc->head;
+        gc->head = NULL;
+        gc->tail = NULL;
+        pthread_mutex_unlock(&gc->lock);
+
+        // Jobs queued while syncing go into the next batch. On failure the
+        // stores stay in the spool, only their durability is unknown.
+        bool synced = gc->sync();
+        while (job) {
+            struct work_job *next = job->next;
+            if (!synced) {
+                gc->fail(job);
+            }
+            loop_post(job->loop, job);
+            job = next;
+        }
+
+        pthread_mutex_lock(&gc->lock);
+    }
+    pthread_mutex_unlock(&gc->lock);
+    return NULL;
+}
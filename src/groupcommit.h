@@ -0,0 +1,55 @@
+#ifndef _GROUP_COMMIT_H
+#define _GROUP_COMMIT_H
+
+#include <pthread.h>
+
+#include <string>
+
+struct work_job;
+
+// Releases completed stores in batches once they are durable. Stores are
+// written and renamed without fsync; the commit thread collects the jobs
+// finished within a short window, makes the spool filesystem durable with
+// a single syncfs() and only then posts the jobs back to their loops, so
+// acks are sent after the data is on disk.
+//
+// A failed sync nacks the whole batch, but its ticket caches are already
+// renamed into the spool and indexed: a nack from group commit means the
+// store is not known to be durable, not that it did not happen. A retry
+// by the client syncs it again.
+class GroupCommit {
+public:
+    // Called on the commit thread for every job of a batch that could not
+    // be synced, before the job is posted.
+    typedef void (*fail_fn)(struct work_job *job);
+
+    GroupCommit(const std::string& spool_dir,
+                unsigned window_ms_,
+                fail_fn fail_);
+    ~GroupCommit();
+
+    bool start();
+
+    // Queue job, it is posted to its loop once the next batch is synced.
+    void add(struct work_job *job);
+
+private:
+    static void *thread_main(void *arg);
+    bool sync();
+
+    std::string dir;
+    int dir_fd;
+    unsigned window_ms;
+    fail_fn fail;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct work_job *head;
+    struct work_job *tail;
+    bool stopping;
+
+    bool started;
+    pthread_t thread;
+};
+
+#endif  // _GROUP_COMMIT_H
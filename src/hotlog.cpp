@@ -0,0 +1,332 @@
+#include "hotlog.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <easylogging/easylogging++.h>
+
+struct hotlog_record {
+    // Vyukov bounded queue sequence: == position - free for the producer
+    // of that position, == position + 1 - filled
+    uint64_t seq;
+    hotlog_level level;
+    uint32_t suppressed;
+    struct timespec ts;
+    uint32_t len;
+    char msg[HOTLOG_LINE];
+};
+
+static unsigned log_rate;
+static unsigned log_sample;
+
+// The ring is never freed once allocated: a producer that saw ring_open
+// may still be inside ring_push when hotlog_stop() returns.
+static struct hotlog_record *ring;
+static bool ring_open;
+static size_t ring_mask;
+static uint64_t ring_head;
+static uint64_t ring_tail;
+static uint64_t ring_drops;
+
+static bool writer_stopping;
+static bool writer_started;
+static pthread_t writer_thread;
+
+// Writer output is batched up to this size per write(2).
+#define HOTLOG_BATCH (64 * 1024)
+
+// Writer poll interval while the ring is empty.
+#define HOTLOG_IDLE_NS (10 * 1000 * 1000)
+
+static const char *level_name(hotlog_level level) {
+    switch (level) {
+    case HOTLOG_WARNING:
+        return "WARNING";
+    case HOTLOG_ERROR:
+        return "ERROR";
+    default:
+        return "INFO";
+    }
+}
+
+// Per site token window, shared by all threads logging from the site.
+static bool site_admit(struct hotlog_site *site, uint32_t *suppressed) {
+    *suppressed = 0;
+    if (log_rate == 0) {
+        return true;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = ts.tv_sec;
+
+    uint64_t window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+    if (window != now &&
+        __atomic_compare_exchange_n(&site->window, &window, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+
+    uint32_t n = __atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED);
+    if (n <= log_rate ||
+        (log_sample && (n - log_rate) % log_sample == 0)) {
+        *suppressed = __atomic_exchange_n(&site->suppressed, 0,
+                                          __ATOMIC_RELAXED);
+        return true;
+    }
+
+    __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+// Multi-producer push, drops the line if the ring is full.
+static void ring_push(hotlog_level level, uint32_t suppressed,
+                      const char *msg, size_t len) {
+    struct hotlog_record *rec;
+    uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &ring[pos & ring_mask];
+        uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            __atomic_add_fetch(&ring_drops, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->level = level;
+    rec->suppressed = suppressed;
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->len = len;
+    memcpy(rec->msg, msg, len);
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Same layout as the default easylogging++ format.
+static size_t format_record(const struct hotlog_record *rec, char *out,
+                            size_t size) {
+    static time_t cached_sec = -1;
+    static char cached_date[32];
+    if (rec->ts.tv_sec != cached_sec) {
+        struct tm tm;
+        localtime_r(&rec->ts.tv_sec, &tm);
+        strftime(cached_date, sizeof(cached_date), "%d/%m/%Y %H:%M:%S", &tm);
+        cached_sec = rec->ts.tv_sec;
+    }
+
+    int n = snprintf(out, size, "%s.%03ld %s  [trivial] %.*s",
+                     cached_date, rec->ts.tv_nsec / 1000000,
+                     level_name(rec->level), (int)rec->len, rec->msg);
+    if (rec->suppressed && n >= 0 && (size_t)n < size) {
+        n += snprintf(out + n, size - n, " (%u similar suppressed)",
+                      rec->suppressed);
+    }
+    if (n < 0 || (size_t)n >= size - 1) {
+        n = size - 2;
+    }
+    out[n++] = '\n';
+    return n;
+}
+
+static void *writer_main(void *) {
+    char *batch = new char[HOTLOG_BATCH];
+    size_t batch_len = 0;
+    uint64_t reported_drops = 0;
+
+    for (;;) {
+        struct hotlog_record *rec = &ring[ring_tail & ring_mask];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == ring_tail + 1) {
+            if (HOTLOG_BATCH - batch_len < HOTLOG_LINE + 128) {
+                write_all(batch, batch_len);
+                batch_len = 0;
+            }
+            batch_len += format_record(rec, batch + batch_len,
+                                       HOTLOG_BATCH - batch_len);
+            __atomic_store_n(&rec->seq, ring_tail + ring_mask + 1,
+                             __ATOMIC_RELEASE);
+            ++ring_tail;
+            continue;
+        }
+
+        // Ring is empty.
+        if (batch_len) {
+            write_all(batch, batch_len);
+            batch_len = 0;
+        }
+
+        uint64_t drops = __atomic_load_n(&ring_drops, __ATOMIC_RELAXED);
+        if (drops != reported_drops) {
+            LOG(WARNING) << "Log buffer full, dropped "
+                         << drops - reported_drops << " line(s).";
+            reported_drops = drops;
+        }
+
+        if (__atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        struct timespec idle = {0, HOTLOG_IDLE_NS};
+        nanosleep(&idle, NULL);
+    }
+
+    delete[] batch;
+    return NULL;
+}
+
+bool hotlog_start(const struct hotlog_config& config) {
+    log_rate = config.rate;
+    log_sample = config.sample;
+
+    if (!config.async) {
+        return true;
+    }
+
+    size_t size = 1;
+    while (size < config.ring_lines) {
+        size <<= 1;
+    }
+    ring = new hotlog_record[size];
+    ring_mask = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+        ring[i].seq = i;
+    }
+
+    int rc = pthread_create(&writer_thread, NULL, writer_main, NULL);
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to start log writer: " << strerror(rc);
+        delete[] ring;
+        ring = NULL;
+        return false;
+    }
+    writer_started = true;
+    __atomic_store_n(&ring_open, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+void hotlog_stop() {
+    if (!writer_started) {
+        return;
+    }
+
+    // Late lines go to easylogging++. Lines pushed between here and the
+    // writer's last pass are dropped.
+    __atomic_store_n(&ring_open, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&writer_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    writer_started = false;
+}
+
+HotLogLine::HotLogLine(struct hotlog_site *site_):
+        site(site_),
+        done(false),
+        async(false),
+        len(0) {
+
+    admitted = site_admit(site, &suppressed);
+    if (admitted) {
+        async = __atomic_load_n(&ring_open, __ATOMIC_ACQUIRE);
+    }
+}
+
+void HotLogLine::flush() {
+    done = true;
+
+    if (async && __atomic_load_n(&ring_open, __ATOMIC_ACQUIRE)) {
+        ring_push(site->level, suppressed, buf, len);
+        return;
+    }
+
+    // Sync mode, or the writer stopped while the line was built.
+    std::string line = async ? std::string(buf, len) : text;
+    if (suppressed) {
+        line += " (" + std::to_string((unsigned long long)suppressed) +
+                " similar suppressed)";
+    }
+    switch (site->level) {
+    case HOTLOG_WARNING:
+        LOG(WARNING) << line;
+        break;
+    case HOTLOG_ERROR:
+        LOG(ERROR) << line;
+        break;
+    default:
+        LOG(INFO) << line;
+        break;
+    }
+}
+
+void HotLogLine::append(const char *s, size_t n) {
+    if (!async) {
+        text.append(s, n);
+        return;
+    }
+
+    if (n > sizeof(buf) - len) {
+        n = sizeof(buf) - len;
+    }
+    memcpy(buf + len, s, n);
+    len += n;
+}
+
+HotLogLine& HotLogLine::operator<<(const char *s) {
+    if (s == NULL) {
+        s = "(null)";
+    }
+    append(s, strlen(s));
+    return *this;
+}
+
+HotLogLine& HotLogLine::operator<<(const std::string& s) {
+    append(s.data(), s.size());
+    return *this;
+}
+
+HotLogLine& HotLogLine::operator<<(char c) {
+    append(&c, 1);
+    return *this;
+}
+
+#define HOTLOG_FORMAT(type, fmt, cast) \
+    HotLogLine& HotLogLine::operator<<(type v) { \
+        char num[32]; \
+        int n = snprintf(num, sizeof(num), fmt, (cast)v); \
+        append(num, n); \
+        return *this; \
+    }
+
+HOTLOG_FORMAT(int, "%d", int)
+HOTLOG_FORMAT(unsigned, "%u", unsigned)
+HOTLOG_FORMAT(long, "%ld", long)
+HOTLOG_FORMAT(unsigned long, "%lu", unsigned long)
+HOTLOG_FORMAT(long long, "%lld", long long)
+HOTLOG_FORMAT(unsigned long long, "%llu", unsigned long long)
+HOTLOG_FORMAT(double, "%g", double)
+HOTLOG_FORMAT(const void *, "%p", const void *)
@@ -0,0 +1,97 @@
+#ifndef _HOT_LOG_H
+#define _HOT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+// Logging for the connection path. HLOG(level) << ... formats into a small
+// buffer on the caller's stack and, in async mode, hands the line to a
+// lock-free ring drained by a writer thread, so loops never block on
+// stdout. Every call site is rate limited on its own: past the configured
+// lines per second, only one in every sample lines is logged and the
+// number suppressed is reported with the next line that gets through.
+// Without hotlog_start() lines go to easylogging++ synchronously.
+
+enum hotlog_level {
+    HOTLOG_INFO,
+    HOTLOG_WARNING,
+    HOTLOG_ERROR
+};
+
+// Per call site limiter state, a static in every HLOG() expansion.
+struct hotlog_site {
+    hotlog_level level;
+    // second of the current window and lines seen in it
+    uint64_t window;
+    uint32_t count;
+    uint32_t suppressed;
+};
+
+// Ring records hold this much, longer async lines are truncated. Lines
+// logged synchronously are passed on whole.
+#define HOTLOG_LINE 240
+
+struct hotlog_config {
+    // log through the ring and writer thread
+    bool async;
+    // lines per second per call site, 0 - unlimited
+    unsigned rate;
+    // over the rate, log one in every sample lines, 0 - none
+    unsigned sample;
+    // ring capacity in lines, rounded up to a power of two
+    size_t ring_lines;
+};
+
+// Apply config, start the writer thread in async mode. Call before any
+// thread logs with HLOG().
+bool hotlog_start(const struct hotlog_config& config);
+// Write out what is queued and stop the writer.
+void hotlog_stop();
+
+class HotLogLine {
+public:
+    explicit HotLogLine(struct hotlog_site *site_);
+
+    bool pass() const { return admitted && !done; }
+    void flush();
+
+    HotLogLine& operator<<(const char *s);
+    HotLogLine& operator<<(const std::string& s);
+    HotLogLine& operator<<(char c);
+    HotLogLine& operator<<(int v);
+    HotLogLine& operator<<(unsigned v);
+    HotLogLine& operator<<(long v);
+    HotLogLine& operator<<(unsigned long v);
+    HotLogLine& operator<<(long long v);
+    HotLogLine& operator<<(unsigned long long v);
+    HotLogLine& operator<<(double v);
+    HotLogLine& operator<<(const void *p);
+
+private:
+    void append(const char *s, size_t n);
+
+    struct hotlog_site *site;
+    bool admitted;
+    bool done;
+    // ring was up when the line started, the line is built in buf
+    bool async;
+    uint32_t suppressed;
+    size_t len;
+    char buf[HOTLOG_LINE];
+    // line built for easylogging++, not truncated
+    std::string text;
+};
+
+// Every expansion gets its own limiter state, the static in the lambda.
+#define HLOG(level) \
+    for (HotLogLine _hlog([]() -> struct hotlog_site * { \
+             static struct hotlog_site site = {HOTLOG_##level, 0, 0, 0}; \
+             return &site; \
+         }()); \
+         _hlog.pass(); \
+         _hlog.flush()) \
+        _hlog
+
+#endif  // _HOT_LOG_H
@@ -0,0 +1,368 @@
+#include "metrics.h"
+#include "tktrecv.h"
+#include "workpool.h"
+#include "spoolindex.h"
+#include "sweeper.h"
+#include "renewer.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include <easylogging/easylogging++.h>
+
+uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct loop_counter {
+    const char *name;
+    const char *help;
+    size_t offset;
+};
+
+#define LOOP_COUNTER(field, help) \
+    {"tktrecv_" #field "_total", help, offsetof(struct server_stats, field)}
+
+static const struct loop_counter loop_counters[] = {
+    LOOP_COUNTER(accept_wakeups, "Listener wakeups."),
+    LOOP_COUNTER(accepted, "Connections accepted."),
+    LOOP_COUNTER(accept_errors, "accept4 failures."),
+    LOOP_COUNTER(rejected, "Connections reset by admission control."),
+    LOOP_COUNTER(accept_pauses, "Times the listener was paused."),
+    LOOP_COUNTER(timeouts, "Handshakes that missed their deadline."),
+    LOOP_COUNTER(close_timeouts, "Connections closed before the peer did."),
+    LOOP_COUNTER(oversized_tokens, "Tokens over the size limit."),
+    LOOP_COUNTER(token_memory_rejects, "Tokens over the memory limit."),
+    LOOP_COUNTER(replays, "Replayed or unrecognized initial tokens."),
+    LOOP_COUNTER(rcache_full, "Handshakes rejected, replay cache full."),
+    LOOP_COUNTER(handshakes_ok, "Completed GSS handshakes."),
+    LOOP_COUNTER(stores_written, "Stores written to the spool."),
+    LOOP_COUNTER(stores_skipped, "Stores the spool already had."),
+    LOOP_COUNTER(stores_coalesced, "Stores merged into another store."),
+    LOOP_COUNTER(store_failures, "Failed stores."),
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    "first_byte",
+    "token_receive",
+    "gss_accept",
+    "store",
+    "ack_drain",
+};
+
+// RFC 2744 routine errors, by code.
+static const char *gss_error_names[GSS_ROUTINE_ERRORS] = {
+    "calling_error",
+    "bad_mech",
+    "bad_name",
+    "bad_nametype",
+    "bad_bindings",
+    "bad_status",
+    "bad_mic",
+    "no_cred",
+    "no_context",
+    "defective_token",
+    "defective_credential",
+    "credentials_expired",
+    "context_expired",
+    "failure",
+    "bad_qop",
+    "unauthorized",
+    "unavailable",
+    "duplicate_element",
+    "name_not_mn",
+};
+
+static void header(std::string& out, const char *name,
+                   const char *type, const char *help) {
+    out += "# HELP ";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+}
+
+static void sample(std::string& out, const char *name,
+                   const char *labels, double value) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s%s%s %.17g\n",
+             name,
+             labels[0] ? "{" : "",
+             labels,
+             labels[0] ? "}" : "",
+             value);
+    out += line;
+}
+
+MetricsServer::MetricsServer(const std::string& addr_,
+                             int port_,
+                             struct server_loop *loops_,
+                             int nloops_):
+        addr(addr_),
+        port(port_),
+        loops(loops_),
+        nloops(nloops_),
+        spool_index(NULL),
+        sweeper(NULL),
+        renewer(NULL),
+        evbase(NULL),
+        http(NULL),
+        stop_fd(-1),
+        stop_event(NULL),
+        started(false) {
+}
+
+MetricsServer::~MetricsServer() {
+    if (started) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0) {
+            LOG(ERROR) << "Unable to stop metrics thread: " << strerror(errno);
+        }
+        pthread_join(thread, NULL);
+    }
+
+    if (stop_event) {
+        event_free(stop_event);
+    }
+    if (http) {
+        evhttp_free(http);
+    }
+    if (evbase) {
+        event_base_free(evbase);
+    }
+    if (stop_fd >= 0) {
+        close(stop_fd);
+    }
+}
+
+void MetricsServer::set_spool_index(SpoolIndex *spool_index_) {
+    spool_index = spool_index_;
+}
+
+void MetricsServer::set_sweeper(SpoolSweeper *sweeper_) {
+    sweeper = sweeper_;
+}
+
+void MetricsServer::set_renewer(Renewer *renewer_) {
+    renewer = renewer_;
+}
+
+bool MetricsServer::start() {
+    evbase = event_base_new();
+    if (evbase == NULL) {
+        LOG(ERROR) << "Unable to create metrics event base.";
+        return false;
+    }
+
+    http = evhttp_new(evbase);
+    if (http == NULL ||
+        evhttp_bind_socket(http, addr.c_str(), port) != 0) {
+        LOG(ERROR) << "Unable to listen for metrics on " << addr
+                   << ":" << port;
+        return false;
+    }
+    evhttp_set_allowed_methods(http, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD);
+    evhttp_set_gencb(http, on_request, this);
+
+    // The event base is not shared, the loop is stopped from its own
+    // thread through an eventfd.
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        LOG(ERROR) << "eventfd: " << strerror(errno);
+        return false;
+    }
+    stop_event = event_new(evbase, stop_fd, EV_READ, on_stop, evbase);
+    event_add(stop_event, NULL);
+
+    int rc = pthread_create(&thread, NULL, thread_main, this);
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to start metrics thread: " << strerror(rc);
+        return false;
+    }
+    started = true;
+
+    LOG(INFO) << "Serving metrics on http://" << addr << ":" << port
+              << "/metrics";
+    return true;
+}
+
+void *MetricsServer::thread_main(void *arg) {
+    MetricsServer *ms = (MetricsServer *)arg;
+    event_base_dispatch(ms->evbase);
+    return NULL;
+}
+
+void MetricsServer::on_stop(int fd, short ev, void *arg) {
+    event_base_loopbreak((struct event_base *)arg);
+}
+
+void MetricsServer::on_request(struct evhttp_request *req, void *arg) {
+    MetricsServer *ms = (MetricsServer *)arg;
+
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+    if (path == NULL || strcmp(path, "/metrics") != 0) {
+        evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+        return;
+    }
+
+    std::string body = ms->render();
+    struct evbuffer *buf = evbuffer_new();
+    evbuffer_add(buf, body.data(), body.size());
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "Content-Type", "text/plain; version=0.0.4");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    evbuffer_free(buf);
+}
+
+std::string MetricsServer::render() const {
+    std::string out;
+    char labels[128];
+
+    size_t ncounters = sizeof(loop_counters) / sizeof(loop_counters[0]);
+    for (size_t c = 0; c < ncounters; ++c) {
+        header(out, loop_counters[c].name, "counter", loop_counters[c].help);
+        for (int i = 0; i < nloops; ++i) {
+            const uint64_t *value = (const uint64_t *)
+                ((const char *)&loops[i].stats + loop_counters[c].offset);
+            snprintf(labels, sizeof(labels), "loop=\"%d\"", loops[i].id);
+            sample(out, loop_counters[c].name, labels, STAT_READ(*value));
+        }
+    }
+
+    header(out, "tktrecv_handshake_failures_total", "counter",
+           "Failed gss_accept_sec_context calls by GSS major code.");
+    for (int i = 0; i < nloops; ++i) {
+        for (int code = 0; code < GSS_ROUTINE_ERRORS; ++code) {
+            uint64_t value = STAT_READ(loops[i].stats.gss_failures[code]);
+            if (value == 0) {
+                continue;
+            }
+            snprintf(labels, sizeof(labels), "loop=\"%d\",major=\"%s\"",
+                     loops[i].id, gss_error_names[code]);
+            sample(out, "tktrecv_handshake_failures_total", labels, value);
+        }
+    }
+
+    header(out, "tktrecv_loop_stalls_total", "counter",
+           "Loop callbacks that ran past the stall threshold.");
+    for (int i = 0; i < nloops; ++i) {
+        for (int cb = 0; cb < LOOP_CB_COUNT; ++cb) {
+            uint64_t value = STAT_READ(loops[i].activity.stalls[cb]);
+            if (value == 0) {
+                continue;
+            }
+            snprintf(labels, sizeof(labels), "loop=\"%d\",callback=\"%s\"",
+                     loops[i].id, loop_callback_name(cb));
+            sample(out, "tktrecv_loop_stalls_total", labels, value);
+        }
+    }
+
+    header(out, "tktrecv_loop_stall_max_seconds", "gauge",
+           "Longest stall by loop callback.");
+    for (int i = 0; i < nloops; ++i) {
+        for (int cb = 0; cb < LOOP_CB_COUNT; ++cb) {
+            uint64_t value = STAT_READ(loops[i].activity.stall_max_us[cb]);
+            if (value == 0) {
+                continue;
+            }
+            snprintf(labels, sizeof(labels), "loop=\"%d\",callback=\"%s\"",
+                     loops[i].id, loop_callback_name(cb));
+            sample(out, "tktrecv_loop_stall_max_seconds", labels, value / 1e6);
+        }
+    }
+
+    header(out, "tktrecv_loop_stalled_seconds", "gauge",
+           "How long the loop has been stuck in its current callback.");
+    for (int i = 0; i < nloops; ++i) {
+        snprintf(labels, sizeof(labels), "loop=\"%d\"", loops[i].id);
+        sample(out, "tktrecv_loop_stalled_seconds", labels,
+               STAT_READ(loops[i].activity.stalled_us) / 1e6);
+    }
+
+    header(out, "tktrecv_max_loop_lag_seconds", "gauge",
+           "Worst timer wheel lag seen by the loop.");
+    for (int i = 0; i < nloops; ++i) {
+        snprintf(labels, sizeof(labels), "loop=\"%d\"", loops[i].id);
+        sample(out, "tktrecv_max_loop_lag_seconds", labels,
+               STAT_READ(loops[i].stats.max_lag_ms) / 1e3);
+    }
+
+    // Shared by all loops.
+    header(out, "tktrecv_live_workers", "gauge",
+           "Connections in progress.");
+    sample(out, "tktrecv_live_workers", "",
+           loops[0].load->live_workers.load());
+    header(out, "tktrecv_token_bytes", "gauge",
+           "Memory held by partially received tokens.");
+    sample(out, "tktrecv_token_bytes", "", loops[0].load->token_bytes.load());
+    if (loops[0].store_pool) {
+        header(out, "tktrecv_pending_stores", "gauge",
+               "Stores queued to the store pool.");
+        sample(out, "tktrecv_pending_stores", "",
+               loops[0].store_pool->queued());
+    }
+    if (spool_index) {
+        header(out, "tktrecv_spool_index_entries", "gauge",
+               "Spool files in the index.");
+        sample(out, "tktrecv_spool_index_entries", "", spool_index->size());
+    }
+    if (sweeper) {
+        header(out, "tktrecv_expired_swept_total", "counter",
+               "Expired ticket caches removed from the spool.");
+        sample(out, "tktrecv_expired_swept_total", "", sweeper->swept());
+    }
+    if (renewer) {
+        header(out, "tktrecv_renewals_total", "counter",
+               "Tickets renewed with the KDC.");
+        sample(out, "tktrecv_renewals_total", "", renewer->renewed());
+        header(out, "tktrecv_renewal_failures_total", "counter",
+               "Failed renewals.");
+        sample(out, "tktrecv_renewal_failures_total", "", renewer->failed());
+    }
+
+    header(out, "tktrecv_phase_seconds", "histogram",
+           "Handshake phase latency.");
+    for (int i = 0; i < nloops; ++i) {
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            const struct latency_hist *hist = &loops[i].hist[p];
+            uint64_t cumulative = 0;
+            for (int b = 0; b <= HIST_BUCKETS; ++b) {
+                cumulative += STAT_READ(hist->buckets[b]);
+                if (b < HIST_BUCKETS) {
+                    snprintf(labels, sizeof(labels),
+                             "loop=\"%d\",phase=\"%s\",le=\"%.6f\"",
+                             loops[i].id, phase_names[p],
+                             (double)(1ULL << b) / 1e6);
+                }
+                else {
+                    snprintf(labels, sizeof(labels),
+                             "loop=\"%d\",phase=\"%s\",le=\"+Inf\"",
+                             loops[i].id, phase_names[p]);
+                }
+                sample(out, "tktrecv_phase_seconds_bucket", labels,
+                       cumulative);
+            }
+            snprintf(labels, sizeof(labels), "loop=\"%d\",phase=\"%s\"",
+                     loops[i].id, phase_names[p]);
+            sample(out, "tktrecv_phase_seconds_sum", labels,
+                   STAT_READ(hist->sum_us) / 1e6);
+            sample(out, "tktrecv_phase_seconds_count", labels,
+                   STAT_READ(hist->count));
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,142 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+
+struct server_loop;
+struct event_base;
+struct evhttp;
+struct evhttp_request;
+struct event;
+class SpoolIndex;
+class SpoolSweeper;
+class Renewer;
+
+// Loop counters and histograms have a single writer, the loop thread, and
+// are read by the metrics thread. Updates are plain relaxed stores, no
+// locked read-modify-write on the connection path.
+#define STAT_ADD(counter, n) \
+    __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+#define STAT_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Handshake phases with latency histograms.
+enum latency_phase {
+    // accept to the first frame header
+    PHASE_FIRST_BYTE,
+    // first bytes of a token to the complete token
+    PHASE_TOKEN_RECV,
+    // gss_accept_sec_context
+    PHASE_GSS_ACCEPT,
+    // store_creds queued to done, coalescing and group commit included
+    PHASE_STORE,
+    // ack written to output flushed
+    PHASE_ACK_DRAIN,
+    PHASE_COUNT
+};
+
+// Bucket i counts latencies up to 2^i microseconds, the last one the rest.
+#define HIST_BUCKETS 25
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t buckets[HIST_BUCKETS + 1];
+};
+
+uint64_t monotonic_us();
+
+// Record latency, called on the owning loop thread only.
+inline void hist_record(struct latency_hist *hist, uint64_t us) {
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > HIST_BUCKETS) {
+        bucket = HIST_BUCKETS;
+    }
+    STAT_INC(hist->buckets[bucket]);
+    STAT_INC(hist->count);
+    STAT_ADD(hist->sum_us, us);
+}
+
+// Record latency since start_us, 0 - not started. Returns the latency.
+inline uint64_t hist_since(struct latency_hist *hist, uint64_t start_us) {
+    if (start_us == 0) {
+        return 0;
+    }
+    uint64_t now = monotonic_us();
+    uint64_t us = now > start_us ? now - start_us : 0;
+    hist_record(hist, us);
+    return us;
+}
+
+// GSS routine error codes are 1..18, 0 counts calling errors.
+#define GSS_ROUTINE_ERRORS 19
+
+// Per loop counters, only updated on the loop thread with STAT_INC(), read
+// by the metrics and stats segment threads with STAT_READ(). Copied as is
+// into the stats segment, see statshm.h.
+struct server_stats {
+    uint64_t accept_wakeups;
+    uint64_t accepted;
+    uint64_t accept_errors;
+    uint64_t timeouts;
+    uint64_t oversized_tokens;
+    uint64_t close_timeouts;
+    uint64_t rejected;
+    uint64_t accept_pauses;
+    uint64_t token_memory_rejects;
+    uint64_t replays;
+    uint64_t rcache_full;
+    uint64_t handshakes_ok;
+    // failed gss_accept_sec_context by routine error code
+    uint64_t gss_failures[GSS_ROUTINE_ERRORS];
+    uint64_t stores_written;
+    uint64_t stores_skipped;
+    uint64_t stores_coalesced;
+    uint64_t store_failures;
+    uint64_t max_lag_ms;
+};
+
+// Serves loop counters, gauges and histograms in Prometheus text format
+// on http://<addr>:<port>/metrics, from its own thread and event base.
+class MetricsServer {
+public:
+    MetricsServer(const std::string& addr_,
+                  int port_,
+                  struct server_loop *loops_,
+                  int nloops_);
+    ~MetricsServer();
+
+    // Optional sources, set before start().
+    void set_spool_index(SpoolIndex *spool_index_);
+    void set_sweeper(SpoolSweeper *sweeper_);
+    void set_renewer(Renewer *renewer_);
+
+    bool start();
+
+private:
+    static void *thread_main(void *arg);
+    static void on_request(struct evhttp_request *req, void *arg);
+    static void on_stop(int fd, short ev, void *arg);
+    std::string render() const;
+
+    std::string addr;
+    int port;
+    struct server_loop *loops;
+    int nloops;
+    SpoolIndex *spool_index;
+    SpoolSweeper *sweeper;
+    Renewer *renewer;
+
+    struct event_base *evbase;
+    struct evhttp *http;
+    int stop_fd;
+    struct event *stop_event;
+
+    bool started;
+    pthread_t thread;
+};
+
+#endif  // _METRICS_H
@@ -0,0 +1,34 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+// Static tracepoints for bpftrace/systemtap/perf, see contrib/bpftrace.
+// A disabled probe is a nop in the instruction stream plus a note in the
+// ELF, arguments are only evaluated into registers. Builds without
+// <sys/sdt.h> get no probes.
+//
+// Pass strings as const char *, they are read from the process by the
+// tracer.
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define TKT_PROBE1(provider, name, a) \
+    DTRACE_PROBE1(provider, name, a)
+#define TKT_PROBE2(provider, name, a, b) \
+    DTRACE_PROBE2(provider, name, a, b)
+#define TKT_PROBE3(provider, name, a, b, c) \
+    DTRACE_PROBE3(provider, name, a, b, c)
+#define TKT_PROBE4(provider, name, a, b, c, d) \
+    DTRACE_PROBE4(provider, name, a, b, c, d)
+
+#else
+
+#define TKT_PROBE1(provider, name, a) do {} while (0)
+#define TKT_PROBE2(provider, name, a, b) do {} while (0)
+#define TKT_PROBE3(provider, name, a, b, c) do {} while (0)
+#define TKT_PROBE4(provider, name, a, b, c, d) do {} while (0)
+
+#endif  // HAVE_SYS_SDT_H
+
+#endif  // _PROBES_H
@@ -0,0 +1,378 @@
+#include "rcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include <easylogging/easylogging++.h>
+
+#define RCACHE_MAGIC      "TKTRC01"
+#define RCACHE_VERSION    1
+
+// Slots per shard and probe run length.
+#define RCACHE_SHARD_SLOTS 4096
+#define RCACHE_PROBE       16
+
+// Expiry granularity, seconds.
+#define RCACHE_BUCKET     16
+
+struct rcache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t lifetime;
+    uint64_t slots;
+    // hash key, kept with the table so persisted entries stay valid
+    uint64_t k0;
+    uint64_t k1;
+};
+
+struct rcache_entry {
+    uint64_t key;
+    uint32_t expires;
+    uint32_t reserved;
+};
+
+// Entries start at the first cache line after the header.
+#define RCACHE_ENTRIES_OFFSET 64
+
+// SipHash-2-4, keyed so that peers can't aim collisions at other
+// clients' authenticators.
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+static uint64_t siphash(uint64_t k0, uint64_t k1,
+                        const unsigned char *in, size_t len) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t b = ((uint64_t)len) << 56;
+
+    const unsigned char *end = in + len - (len % 8);
+    for (; in != end; in += 8) {
+        uint64_t m = 0;
+        for (int i = 0; i < 8; ++i) {
+            m |= ((uint64_t)in[i]) << (8 * i);
+        }
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    for (int i = len % 8 - 1; i >= 0; --i) {
+        b |= ((uint64_t)in[i]) << (8 * i);
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// DER element with the given tag at p, returns pointer to its contents.
+static const unsigned char *der_next(const unsigned char *p,
+                                     const unsigned char *end,
+                                     unsigned char tag,
+                                     size_t *len) {
+    if (p >= end || *p != tag) {
+        return NULL;
+    }
+    ++p;
+
+    if (p >= end) {
+        return NULL;
+    }
+
+    size_t l = *p++;
+    if (l & 0x80) {
+        size_t n = l & 0x7f;
+        if (n == 0 || n > 4 || (size_t)(end - p) < n) {
+            return NULL;
+        }
+        l = 0;
+        while (n--) {
+            l = (l << 8) | *p++;
+        }
+    }
+
+    if ((size_t)(end - p) < l) {
+        return NULL;
+    }
+    *len = l;
+    return p;
+}
+
+bool gss_token_authenticator(const unsigned char *token, size_t len,
+                             const unsigned char **cipher,
+                             size_t *cipher_len) {
+    // 1.2.840.113554.1.2.2
+    static const unsigned char krb5_oid[] = {
+        0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02
+    };
+
+    const unsigned char *end = token + len;
+    size_t l;
+
+    // InitialContextToken: [APPLICATION 0] { mech OID, TOK_ID, AP-REQ }
+    const unsigned char *p = der_next(token, end, 0x60, &l);
+    if (p == NULL) {
+        return false;
+    }
+    end = p + l;
+
+    const unsigned char *oid = der_next(p, end, 0x06, &l);
+    if (oid == NULL || l != sizeof(krb5_oid) ||
+        memcmp(oid, krb5_oid, sizeof(krb5_oid)) != 0) {
+        return false;
+    }
+    p = oid + l;
+
+    if (end - p < 2 || p[0] != 0x01 || p[1] != 0x00) {
+        return false;
+    }
+    p += 2;
+
+    // AP-REQ ::= [APPLICATION 14] SEQUENCE { ... [4] authenticator }
+    p = der_next(p, end, 0x6e, &l);
+    if (p == NULL) {
+        return false;
+    }
+    p = der_next(p, p + l, 0x30, &l);
+    if (p == NULL) {
+        return false;
+    }
+
+    const unsigned char *seq_end = p + l;
+    while (p < seq_end) {
+        unsigned char tag = *p;
+        const unsigned char *field = der_next(p, seq_end, tag, &l);
+        if (field == NULL) {
+            return false;
+        }
+
+        if (tag == 0xa4) {
+            // EncryptedData ::= SEQUENCE { [0] etype, [1] kvno, [2] cipher }
+            size_t enc_len;
+            const unsigned char *enc = der_next(field, field + l, 0x30,
+                                                &enc_len);
+            if (enc == NULL) {
+                return false;
+            }
+
+            const unsigned char *enc_end = enc + enc_len;
+            while (enc < enc_end) {
+                unsigned char enc_tag = *enc;
+                size_t fl;
+                const unsigned char *f = der_next(enc, enc_end, enc_tag, &fl);
+                if (f == NULL) {
+                    return false;
+                }
+                if (enc_tag == 0xa2) {
+                    *cipher = der_next(f, f + fl, 0x04, cipher_len);
+                    return *cipher != NULL && *cipher_len > 0;
+                }
+                enc = f + fl;
+            }
+            return false;
+        }
+        p = field + l;
+    }
+    return false;
+}
+
+ReplayCache::ReplayCache(size_t slots_, unsigned lifetime_):
+        slots(slots_),
+        lifetime(lifetime_),
+        map(NULL),
+        map_len(0),
+        header(NULL),
+        entries(NULL),
+        nshards(0),
+        shard_slots(RCACHE_SHARD_SLOTS),
+        locks(NULL),
+        nfull(0) {
+
+    if (slots < shard_slots) {
+        slots = shard_slots;
+    }
+    nshards = (slots + shard_slots - 1) / shard_slots;
+    slots = nshards * shard_slots;
+}
+
+ReplayCache::~ReplayCache() {
+    if (map) {
+        munmap(map, map_len);
+    }
+    if (locks) {
+        for (size_t i = 0; i < nshards; ++i) {
+            pthread_mutex_destroy(&locks[i]);
+        }
+        delete[] locks;
+    }
+}
+
+bool ReplayCache::open(const std::string& path) {
+    map_len = RCACHE_ENTRIES_OFFSET + slots * sizeof(struct rcache_entry);
+
+    bool reuse = false;
+    if (path.empty()) {
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    else {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            LOG(ERROR) << "Unable to open replay cache: " << path
+                       << ", " << strerror(errno);
+            return false;
+        }
+
+        struct stat st;
+        reuse = (fstat(fd, &st) == 0 && (size_t)st.st_size == map_len);
+        if (!reuse && ftruncate(fd, map_len) != 0) {
+            LOG(ERROR) << "Unable to size replay cache: " << path
+                       << ", " << strerror(errno);
+            close(fd);
+            return false;
+        }
+
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+
+    if (map == MAP_FAILED) {
+        LOG(ERROR) << "Unable to map replay cache: " << strerror(errno);
+        map = NULL;
+        return false;
+    }
+
+    header = (struct rcache_header *)map;
+    entries = (struct rcache_entry *)((char *)map + RCACHE_ENTRIES_OFFSET);
+
+    if (reuse) {
+        reuse = memcmp(header->magic, RCACHE_MAGIC, sizeof(RCACHE_MAGIC)) == 0
+                && header->version == RCACHE_VERSION
+                && header->slots == slots;
+    }
+
+    if (!reuse) {
+        memset(map, 0, map_len);
+        memcpy(header->magic, RCACHE_MAGIC, sizeof(RCACHE_MAGIC));
+        header->version = RCACHE_VERSION;
+        header->slots = slots;
+        if (getrandom(&header->k0, sizeof(header->k0), 0) < 0 ||
+            getrandom(&header->k1, sizeof(header->k1), 0) < 0) {
+            LOG(ERROR) << "getrandom: " << strerror(errno);
+            return false;
+        }
+    }
+    header->lifetime = lifetime;
+
+    locks = new pthread_mutex_t[nshards];
+    for (size_t i = 0; i < nshards; ++i) {
+        pthread_mutex_init(&locks[i], NULL);
+    }
+
+    LOG(INFO) << "Replay cache: " << (path.empty() ? "memory" : path)
+              << ", slots: " << slots
+              << ", lifetime: " << lifetime << "s"
+              << (reuse ? ", reusing persisted entries" : "");
+    return true;
+}
+
+ReplayCache::result ReplayCache::insert(uint64_t key, uint32_t now) {
+    // Never use 0 as a key, it marks empty slots.
+    key |= 1;
+
+    size_t shard = (key >> 32) % nshards;
+    struct rcache_entry *run = entries + shard * shard_slots;
+    size_t first = key % shard_slots;
+
+    uint32_t expires =
+        ((now + lifetime) / RCACHE_BUCKET + 1) * RCACHE_BUCKET;
+
+    pthread_mutex_lock(&locks[shard]);
+
+    struct rcache_entry *free_slot = NULL;
+    for (size_t i = 0; i < RCACHE_PROBE; ++i) {
+        struct rcache_entry *e = &run[(first + i) % shard_slots];
+        if (e->expires <= now) {
+            if (free_slot == NULL) {
+                free_slot = e;
+            }
+            continue;
+        }
+
+        if (e->key == key) {
+            pthread_mutex_unlock(&locks[shard]);
+            return REPLAY;
+        }
+    }
+
+    if (free_slot == NULL) {
+        // Probe run is full of live entries. Evicting one would let its
+        // authenticator be replayed, fail closed instead.
+        pthread_mutex_unlock(&locks[shard]);
+        __atomic_add_fetch(&nfull, 1, __ATOMIC_RELAXED);
+        return FULL;
+    }
+
+    free_slot->key = key;
+    free_slot->expires = expires;
+
+    pthread_mutex_unlock(&locks[shard]);
+    return FRESH;
+}
+
+ReplayCache::result ReplayCache::check_token(const void *token, size_t len,
+                                             uint64_t *key) {
+    const unsigned char *cipher;
+    size_t cipher_len;
+    if (!gss_token_authenticator((const unsigned char *)token, len,
+                                 &cipher, &cipher_len)) {
+        return MALFORMED;
+    }
+
+    *key = siphash(header->k0, header->k1, cipher, cipher_len) | 1;
+    return insert(*key, (uint32_t)time(NULL));
+}
+
+void ReplayCache::forget(uint64_t key) {
+    size_t shard = (key >> 32) % nshards;
+    struct rcache_entry *run = entries + shard * shard_slots;
+    size_t first = key % shard_slots;
+
+    pthread_mutex_lock(&locks[shard]);
+    for (size_t i = 0; i < RCACHE_PROBE; ++i) {
+        struct rcache_entry *e = &run[(first + i) % shard_slots];
+        if (e->key == key) {
+            e->key = 0;
+            e->expires = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&locks[shard]);
+}
+
+uint64_t ReplayCache::full() const {
+    return __atomic_load_n(&nfull, __ATOMIC_RELAXED);
+}
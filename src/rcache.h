@@ -0,0 +1,76 @@
+#ifndef _RCACHE_H
+#define _RCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <string>
+
+// In-process replay cache for AP-REQ authenticators. Used instead of the
+// krb5 file replay cache, which takes a file lock and appends for every
+// authenticator.
+//
+// Entries are keyed by a keyed hash of the authenticator ciphertext, same
+// as MIT's file2 replay cache. The table is split in shards, each shard
+// has its own lock and a fixed number of slots; a key probes a short run
+// of slots inside its shard. Expiry times are rounded up to time buckets,
+// expired slots are reused in place, there is no separate purge pass.
+// Live entries are never evicted: when a probe run has no free slot the
+// token is rejected, so flooding a shard can't push a captured
+// authenticator out of the cache.
+//
+// The table can live in a memory mapped file, so replay protection
+// survives restarts.
+class ReplayCache {
+public:
+    enum result {
+        FRESH,
+        REPLAY,
+        MALFORMED,
+        // no free slot in the probe run, token can't be checked
+        FULL
+    };
+
+    ReplayCache(size_t slots_, unsigned lifetime_);
+    ~ReplayCache();
+
+    // Map table from file, or anonymous memory if path is empty.
+    bool open(const std::string& path);
+
+    // Check initial GSS krb5 token and remember its authenticator. On
+    // FRESH, *key identifies the entry for forget().
+    result check_token(const void *token, size_t len, uint64_t *key);
+
+    // Drop entry, used when the handshake failed after the check, so
+    // garbage tokens do not occupy the cache.
+    void forget(uint64_t key);
+
+    // Tokens rejected because their probe run was full.
+    uint64_t full() const;
+
+private:
+    result insert(uint64_t key, uint32_t now);
+
+    size_t slots;
+    unsigned lifetime;
+
+    void *map;
+    size_t map_len;
+    struct rcache_header *header;
+    struct rcache_entry *entries;
+
+    size_t nshards;
+    size_t shard_slots;
+    pthread_mutex_t *locks;
+
+    uint64_t nfull;
+};
+
+// Locate the authenticator ciphertext inside an initial GSS krb5 token,
+// returns false if the token is not a krb5 AP-REQ.
+bool gss_token_authenticator(const unsigned char *token, size_t len,
+                             const unsigned char **cipher,
+                             size_t *cipher_len);
+
+#endif  // _RCACHE_H
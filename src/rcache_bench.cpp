@@ -0,0 +1,426 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <easylogging/easylogging++.h>
+#include <optionparser/optionparser.h>
+
+#include "rcache.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+namespace el = easyloggingpp;
+
+// Throughput of the built-in replay cache against a file replay cache
+// that does what MIT's file2 cache (the krb5 default) does for every
+// authenticator: open the file, take an fcntl lock, probe its hash
+// tables with pread, pwrite the tag, close. MIT's store call is not part
+// of the public krb5 API, so the file cache is reproduced here instead of
+// linked.
+//
+// Not built by default:
+//
+//     make -C src rcache-bench
+//     src/rcache-bench --threads=8
+
+void init_log() {
+    el::Configurations log_conf;
+    log_conf.setToDefault();
+    log_conf.setAll(el::ConfigurationType::ToFile, "false");
+    log_conf.setAll(el::ConfigurationType::ToStandardOutput, "true");
+    el::Loggers::reconfigureAllLoggers(log_conf);
+    log_conf.clear();
+}
+
+enum optionIndex {
+    UNKNOWN,
+    HELP,
+    THREADS,
+    TOKENS,
+    SLOTS,
+    RCACHE_FILE,
+    FILE_TOKENS
+};
+const option::Descriptor usage[] = {
+    {UNKNOWN, 0, "" , "" , option::Arg::None,
+        "USAGE: rcache-bench [options]\n\n"
+        "Measure replay cache checks per second.\n\n"
+        "Options:" },
+    {HELP, 0, "" , "help", option::Arg::None,
+        "  --help  \tPrint usage and exit." },
+    {THREADS, 0, "t", "threads", option::Arg::Optional,
+        "  -t<n>, \t--threads=<n>  \tChecking threads, defaults 1." },
+    {TOKENS, 0, "" , "tokens", option::Arg::Optional,
+        "  --tokens=<n>  \tTokens per thread, defaults 1000000." },
+    {SLOTS, 0, "" , "slots", option::Arg::Optional,
+        "  --slots=<n>  \tBuilt-in cache slots, defaults to fit all tokens." },
+    {RCACHE_FILE, 0, "" , "file", option::Arg::Optional,
+        "  --file=<path>  \tFile replay cache, defaults /var/tmp/rcache-bench."
+        " Removed when done." },
+    {FILE_TOKENS, 0, "" , "file-tokens", option::Arg::Optional,
+        "  --file-tokens=<n>  \tTokens per thread for the file cache, "
+        "defaults 20000, 0 skips it." },
+    {0, 0, 0, 0, 0, 0}
+};
+
+// Authenticator ciphertext length, aes256-cts-hmac-sha1-96 sized.
+#define BENCH_CIPHER 128
+
+// MIT file2 layout: 16 byte tag, 4 byte timestamp per record, tables of
+// doubling size one after another, one probe per table.
+#define FILE_RECORD       20
+#define FILE_TAG          16
+#define FILE_FIRST_TABLE  1024
+#define FILE_MAX_TABLES   8
+
+// Replay window, seconds.
+#define BENCH_LIFETIME    300
+
+struct bench_thread {
+    int id;
+    long tokens;
+    ReplayCache *rcache;
+    std::string file;
+
+    pthread_t thread;
+    long fresh;
+    long replays;
+    long failed;
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put_len(std::vector<unsigned char> *out, size_t len) {
+    if (len < 0x80) {
+        out->push_back(len);
+    }
+    else {
+        out->push_back(0x82);
+        out->push_back(len >> 8);
+        out->push_back(len & 0xff);
+    }
+}
+
+static void put_der(std::vector<unsigned char> *out, unsigned char tag,
+                    const std::vector<unsigned char>& contents) {
+    out->push_back(tag);
+    put_len(out, contents.size());
+    out->insert(out->end(), contents.begin(), contents.end());
+}
+
+// Initial GSS krb5 token around an AP-REQ with the given authenticator
+// ciphertext, enough for gss_token_authenticator().
+static std::vector<unsigned char> make_token(const unsigned char *cipher,
+                                             size_t len) {
+    static const unsigned char krb5_oid[] = {
+        0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02
+    };
+
+    std::vector<unsigned char> octets;
+    put_der(&octets, 0x04, std::vector<unsigned char>(cipher, cipher + len));
+    std::vector<unsigned char> field;
+    put_der(&field, 0xa2, octets);
+    std::vector<unsigned char> enc;
+    put_der(&enc, 0x30, field);
+    std::vector<unsigned char> authenticator;
+    put_der(&authenticator, 0xa4, enc);
+    std::vector<unsigned char> seq;
+    put_der(&seq, 0x30, authenticator);
+    std::vector<unsigned char> ap_req;
+    put_der(&ap_req, 0x6e, seq);
+
+    std::vector<unsigned char> inner;
+    put_der(&inner, 0x06, std::vector<unsigned char>(
+        krb5_oid, krb5_oid + sizeof(krb5_oid)));
+    inner.push_back(0x01);
+    inner.push_back(0x00);
+    inner.insert(inner.end(), ap_req.begin(), ap_req.end());
+
+    std::vector<unsigned char> token;
+    put_der(&token, 0x60, inner);
+    return token;
+}
+
+// Ciphertext unique to thread and token, filler does not matter.
+static void make_cipher(unsigned char *cipher, int thread, long n) {
+    memset(cipher, 0x5a, BENCH_CIPHER);
+    memcpy(cipher, &thread, sizeof(thread));
+    memcpy(cipher + sizeof(thread), &n, sizeof(n));
+}
+
+static void *memory_main(void *arg) {
+    struct bench_thread *bt = (struct bench_thread *)arg;
+
+    unsigned char cipher[BENCH_CIPHER];
+    make_cipher(cipher, bt->id, 0);
+    std::vector<unsigned char> token = make_token(cipher, sizeof(cipher));
+
+    // Ciphertext offset is the same in every token, rewrite it in place.
+    const unsigned char *found;
+    size_t found_len;
+    if (!gss_token_authenticator(&token[0], token.size(), &found,
+                                 &found_len)) {
+        LOG(ERROR) << "Bench token is not an AP-REQ.";
+        bt->failed = bt->tokens;
+        return NULL;
+    }
+    unsigned char *slot = &token[0] + (found - &token[0]);
+
+    for (long i = 0; i < bt->tokens; ++i) {
+        make_cipher(slot, bt->id, i);
+
+        uint64_t key;
+        switch (bt->rcache->check_token(&token[0], token.size(), &key)) {
+        case ReplayCache::FRESH:
+            ++bt->fresh;
+            break;
+        case ReplayCache::REPLAY:
+            ++bt->replays;
+            break;
+        default:
+            ++bt->failed;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static bool file_lock(int fd, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) != 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// One check against the file cache, 1 - fresh, 0 - replay, -1 - error.
+static int file_check(const std::string& path, const unsigned char *tag,
+                      uint32_t now) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!file_lock(fd, F_WRLCK)) {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t hash;
+    memcpy(&hash, tag, sizeof(hash));
+
+    int rc = -1;
+    off_t table = 0;
+    off_t avail = -1;
+    for (int i = 0; i < FILE_MAX_TABLES; ++i) {
+        size_t records = (size_t)FILE_FIRST_TABLE << i;
+        off_t off = (table + hash % records) * FILE_RECORD;
+        table += records;
+
+        unsigned char record[FILE_RECORD];
+        ssize_t n = pread(fd, record, sizeof(record), off);
+        if (n < 0) {
+            break;
+        }
+
+        uint32_t stamp = 0;
+        if (n == FILE_RECORD) {
+            memcpy(&stamp, record + FILE_TAG, sizeof(stamp));
+        }
+
+        if (n == FILE_RECORD && stamp + BENCH_LIFETIME > now &&
+            memcmp(record, tag, FILE_TAG) == 0) {
+            rc = 0;
+            break;
+        }
+
+        // empty, short read past the end, or expired
+        if (n < FILE_RECORD || stamp + BENCH_LIFETIME <= now) {
+            avail = off;
+            break;
+        }
+    }
+
+    if (rc != 0 && avail >= 0) {
+        unsigned char record[FILE_RECORD];
+        memcpy(record, tag, FILE_TAG);
+        memcpy(record + FILE_TAG, &now, sizeof(now));
+        rc = pwrite(fd, record, sizeof(record), avail) == FILE_RECORD ? 1 : -1;
+    }
+
+    file_lock(fd, F_UNLCK);
+    close(fd);
+    return rc;
+}
+
+static void *file_main(void *arg) {
+    struct bench_thread *bt = (struct bench_thread *)arg;
+
+    unsigned char cipher[BENCH_CIPHER];
+    for (long i = 0; i < bt->tokens; ++i) {
+        make_cipher(cipher, bt->id, i);
+
+        // file2 keys records by a hash of the ciphertext too
+        unsigned char tag[FILE_TAG];
+        uint64_t h = 1469598103934665603ULL;
+        for (size_t j = 0; j < sizeof(cipher); ++j) {
+            h = (h ^ cipher[j]) * 1099511628211ULL;
+        }
+        memcpy(tag, &h, sizeof(h));
+        memcpy(tag + sizeof(h), cipher, FILE_TAG - sizeof(h));
+
+        switch (file_check(bt->file, tag, (uint32_t)time(NULL))) {
+        case 1:
+            ++bt->fresh;
+            break;
+        case 0:
+            ++bt->replays;
+            break;
+        default:
+            ++bt->failed;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static bool run(const char *what, void *(*fn)(void *),
+                std::vector<struct bench_thread>& threads) {
+    double start = now_s();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        int rc = pthread_create(&threads[i].thread, NULL, fn, &threads[i]);
+        if (rc != 0) {
+            LOG(ERROR) << "Unable to start thread: " << strerror(rc);
+            return false;
+        }
+    }
+
+    long fresh = 0;
+    long replays = 0;
+    long failed = 0;
+    for (size_t i = 0; i < threads.size(); ++i) {
+        pthread_join(threads[i].thread, NULL);
+        fresh += threads[i].fresh;
+        replays += threads[i].replays;
+        failed += threads[i].failed;
+    }
+    double elapsed = now_s() - start;
+
+    long total = fresh + replays + failed;
+    printf("%-8s %2zu threads %10ld checks %8.3f s %12.0f checks/s "
+           "%8.3f us/check  fresh %ld replay %ld failed %ld\n",
+           what, threads.size(), total, elapsed,
+           elapsed > 0 ? total / elapsed : 0,
+           total ? elapsed * 1e6 / total * threads.size() : 0,
+           fresh, replays, failed);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    init_log();
+
+    // skip program name argv[0] if present
+    argc -= (argc > 0);
+    argv += (argc > 0);
+
+    option::Stats  stats(usage, argc, argv);
+    option::Option* options = new option::Option[stats.options_max];
+    option::Option* buffer  = new option::Option[stats.buffer_max];
+
+    option::Parser parse(usage, argc, argv, options, buffer);
+
+    if (parse.error()) {
+        return -1;
+    }
+
+    if (options[HELP]) {
+        option::printUsage(std::cout, usage);
+        return -1;
+    }
+
+    int nthreads = 1;
+    if (options[THREADS] && options[THREADS].arg) {
+        nthreads = atoi(options[THREADS].arg);
+    }
+
+    long tokens = 1000000;
+    if (options[TOKENS] && options[TOKENS].arg) {
+        tokens = atol(options[TOKENS].arg);
+    }
+
+    long file_tokens = 20000;
+    if (options[FILE_TOKENS] && options[FILE_TOKENS].arg) {
+        file_tokens = atol(options[FILE_TOKENS].arg);
+    }
+
+    if (nthreads < 1 || tokens < 1 || file_tokens < 0) {
+        LOG(ERROR) << "--threads and --tokens must be at least 1.";
+        return -1;
+    }
+
+    // Headroom, so probe runs rarely fill up.
+    size_t slots = 4 * (size_t)nthreads * tokens;
+    if (options[SLOTS] && options[SLOTS].arg) {
+        slots = strtoull(options[SLOTS].arg, NULL, 10);
+    }
+
+    std::string file = "/var/tmp/rcache-bench";
+    if (options[RCACHE_FILE] && options[RCACHE_FILE].arg) {
+        file = options[RCACHE_FILE].arg;
+    }
+
+    ReplayCache rcache(slots, BENCH_LIFETIME);
+    if (!rcache.open("")) {
+        return 1;
+    }
+
+    std::vector<struct bench_thread> threads(nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        threads[i].id = i;
+        threads[i].tokens = tokens;
+        threads[i].rcache = &rcache;
+        threads[i].file = file;
+        threads[i].fresh = threads[i].replays = threads[i].failed = 0;
+    }
+
+    // Second pass sees every token again and must report replays only.
+    if (!run("memory", memory_main, threads)) {
+        return 1;
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        threads[i].fresh = threads[i].replays = threads[i].failed = 0;
+    }
+    if (!run("memory", memory_main, threads)) {
+        return 1;
+    }
+
+    if (file_tokens == 0) {
+        return 0;
+    }
+
+    unlink(file.c_str());
+    for (int i = 0; i < nthreads; ++i) {
+        threads[i].tokens = file_tokens;
+        threads[i].fresh = threads[i].replays = threads[i].failed = 0;
+    }
+    bool ok = run("file", file_main, threads);
+    unlink(file.c_str());
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,278 @@
+#include "renewer.h"
+#include "credmgr.h"
+#include "spoolindex.h"
+#include "workpool.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include <easylogging/easylogging++.h>
+
+// Wait before retrying a failed renewal, plus up to a minute of jitter.
+#define RENEW_RETRY 300
+
+struct Renewer::renew_job {
+    struct work_job job;
+    Renewer *renewer;
+    std::string name;
+    // false - failed, retry later
+    bool ok;
+};
+
+Renewer::Renewer(const server_config& config_, SpoolIndex *index_):
+        config(config_),
+        index(index_),
+        pool(NULL),
+        salt(0),
+        stopping(false),
+        inflight(0),
+        nrenewed(0),
+        nfailed(0),
+        started(false) {
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+Renewer::~Renewer() {
+    if (started) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(thread, NULL);
+    }
+
+    // Runs the jobs still queued, then nothing updates the index on our
+    // behalf. Stores must be stopped before the renewer is deleted.
+    delete pool;
+    index->set_listener(NULL, NULL);
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+bool Renewer::start() {
+    if (getrandom(&salt, sizeof(salt), 0) < 0) {
+        LOG(WARNING) << "getrandom: " << strerror(errno);
+    }
+
+    pool = new WorkPool("renew",
+                        config.renew_concurrency,
+                        config.renew_concurrency,
+                        worker_init,
+                        worker_fini,
+                        (void *)this);
+
+    std::vector<std::pair<std::string, struct spool_meta> > entries;
+    index->list(entries);
+    index->set_listener(on_index_update, this);
+
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        time_t due = deadline(entries[i].first, entries[i].second);
+        if (due) {
+            schedule(entries[i].first, due);
+        }
+    }
+    size_t nqueued = queued.size();
+    pthread_mutex_unlock(&lock);
+
+    int rc = pthread_create(&thread, NULL, thread_main, this);
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to start renewer thread: " << strerror(rc);
+        index->set_listener(NULL, NULL);
+        return false;
+    }
+    started = true;
+
+    LOG(INFO) << "Renewing tickets " << config.renew_before
+              << "s before expiry, jitter: " << config.renew_jitter
+              << "s, concurrency: " << config.renew_concurrency
+              << ", scheduled: " << nqueued;
+    return true;
+}
+
+uint64_t Renewer::renewed() const {
+    return __atomic_load_n(&nrenewed, __ATOMIC_RELAXED);
+}
+
+uint64_t Renewer::failed() const {
+    return __atomic_load_n(&nfailed, __ATOMIC_RELAXED);
+}
+
+// When the TGT described by meta should be renewed, 0 - never.
+time_t Renewer::deadline(const std::string& name,
+                         const struct spool_meta& meta) const {
+    if (meta.renew_till <= meta.endtime) {
+        return 0;
+    }
+
+    uint64_t jitter = (std::hash<std::string>()(name) ^ salt) %
+                      ((uint64_t)config.renew_jitter + 1);
+    time_t due = meta.endtime - config.renew_before - (time_t)jitter;
+
+    // Short lived tickets: not before half of the lifetime left when
+    // stored, or every store would be followed by a renewal.
+    time_t half = meta.mtime.tv_sec + (meta.endtime - meta.mtime.tv_sec) / 2;
+    return due > half ? due : half;
+}
+
+// Called with lock held.
+void Renewer::schedule(const std::string& name, time_t due) {
+    std::unordered_map<std::string, time_t>::iterator it = queued.find(name);
+    if (it != queued.end()) {
+        if (it->second <= due) {
+            // Existing slot fires first and requeues.
+            return;
+        }
+        it->second = due;
+    }
+    else {
+        queued[name] = due;
+    }
+    queue.push(renew_slot(due, name));
+}
+
+void Renewer::on_index_update(void *arg,
+                              const std::string& name,
+                              const struct spool_meta& meta) {
+    Renewer *renewer = (Renewer *)arg;
+
+    time_t due = renewer->deadline(name, meta);
+    if (due == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&renewer->lock);
+    bool earliest = renewer->queue.empty() || due < renewer->queue.top().first;
+    renewer->schedule(name, due);
+    if (earliest) {
+        pthread_cond_signal(&renewer->cond);
+    }
+    pthread_mutex_unlock(&renewer->lock);
+}
+
+// Hand due renewals to the pool, called with lock held.
+void Renewer::dispatch(time_t now) {
+    while (inflight < (unsigned)config.renew_concurrency && !queue.empty() &&
+           queue.top().first <= now) {
+        renew_slot slot = queue.top();
+        queue.pop();
+
+        std::unordered_map<std::string, time_t>::iterator it =
+            queued.find(slot.second);
+        if (it == queued.end() || it->second != slot.first) {
+            continue;
+        }
+        queued.erase(it);
+
+        struct spool_meta meta;
+        if (!index->lookup(slot.second, &meta) ||
+            meta.endtime <= now || meta.renew_till <= now) {
+            // Gone, or too late to renew.
+            continue;
+        }
+
+        // Retries fire after the deadline, anything else early is requeued.
+        time_t due = deadline(slot.second, meta);
+        if (due == 0) {
+            continue;
+        }
+        if (due > now) {
+            schedule(slot.second, due);
+            continue;
+        }
+
+        struct renew_job *rj = new renew_job;
+        rj->job.run = job_run;
+        rj->job.done = NULL;
+        rj->job.post = job_post;
+        rj->job.loop = NULL;
+        rj->renewer = this;
+        rj->name = slot.second;
+        rj->ok = false;
+
+        if (!pool->submit(&rj->job)) {
+            delete rj;
+            schedule(slot.second, now + RENEW_RETRY);
+            break;
+        }
+        ++inflight;
+    }
+}
+
+void *Renewer::worker_init(void *arg) {
+    Renewer *renewer = (Renewer *)arg;
+    return new CredMgr(renewer->config.tkt_spool_dir,
+                       renewer->config.native_ccache_writer,
+                       // renewals are not group committed
+                       durability_sync_writes(renewer->config.durability,
+                                              false),
+                       renewer->index,
+                       true);
+}
+
+void Renewer::worker_fini(void *thread_ctx) {
+    delete (CredMgr *)thread_ctx;
+}
+
+void Renewer::job_run(struct work_job *job, void *thread_ctx) {
+    struct renew_job *rj = (struct renew_job *)job;
+    const CredMgr *cred_mgr = (const CredMgr *)thread_ctx;
+
+    bool skipped;
+    rj->ok = cred_mgr->renew_creds(rj->name, &skipped);
+    if (!rj->ok) {
+        __atomic_add_fetch(&rj->renewer->nfailed, 1, __ATOMIC_RELAXED);
+    }
+    else if (!skipped) {
+        __atomic_add_fetch(&rj->renewer->nrenewed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Runs on the pool thread, renewals have no loop to go back to.
+void Renewer::job_post(struct work_job *job) {
+    struct renew_job *rj = (struct renew_job *)job;
+    Renewer *renewer = rj->renewer;
+
+    pthread_mutex_lock(&renewer->lock);
+    --renewer->inflight;
+    if (!rj->ok) {
+        // Renewed or newly stored tickets are scheduled by the index
+        // update, anything else is retried until the TGT expires.
+        struct spool_meta meta;
+        if (renewer->index->lookup(rj->name, &meta)) {
+            time_t retry = time(NULL) + RENEW_RETRY +
+                (time_t)((std::hash<std::string>()(rj->name) ^ renewer->salt)
+                         % 60);
+            renewer->schedule(rj->name, retry);
+        }
+    }
+    pthread_cond_signal(&renewer->cond);
+    pthread_mutex_unlock(&renewer->lock);
+
+    delete rj;
+}
+
+void *Renewer::thread_main(void *arg) {
+    Renewer *renewer = (Renewer *)arg;
+
+    pthread_mutex_lock(&renewer->lock);
+    while (!renewer->stopping) {
+        renewer->dispatch(time(NULL));
+
+        if (renewer->queue.empty() ||
+            renewer->inflight >= (unsigned)renewer->config.renew_concurrency) {
+            pthread_cond_wait(&renewer->cond, &renewer->lock);
+        }
+        else {
+            struct timespec deadline = {renewer->queue.top().first, 0};
+            pthread_cond_timedwait(&renewer->cond, &renewer->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&renewer->lock);
+    return NULL;
+}
@@ -0,0 +1,79 @@
+#ifndef _RENEWER_H
+#define _RENEWER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <functional>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tktrecv.h"
+
+struct spool_meta;
+
+// Renews renewable TGTs in the spool before they expire, so clients don't
+// have to forward again just to keep them fresh. Every spool file gets a
+// deadline of endtime - renew_before - jitter; the scheduler thread hands
+// due files to a pool of at most renew_concurrency threads, each with its
+// own credential manager. Jitter is fixed per principal, so files stored
+// together are spread over the jitter window instead of hitting the KDC
+// at once.
+class Renewer {
+public:
+    Renewer(const server_config& config_, SpoolIndex *index_);
+    ~Renewer();
+
+    bool start();
+
+    uint64_t renewed() const;
+    uint64_t failed() const;
+
+private:
+    struct renew_job;
+
+    static void on_index_update(void *arg,
+                                const std::string& name,
+                                const struct spool_meta& meta);
+    static void *thread_main(void *arg);
+    static void *worker_init(void *arg);
+    static void worker_fini(void *thread_ctx);
+    static void job_run(struct work_job *job, void *thread_ctx);
+    static void job_post(struct work_job *job);
+
+    time_t deadline(const std::string& name,
+                    const struct spool_meta& meta) const;
+    void schedule(const std::string& name, time_t due);
+    void dispatch(time_t now);
+
+    const server_config& config;
+    SpoolIndex *index;
+    WorkPool *pool;
+    uint64_t salt;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+    unsigned inflight;
+
+    // Min-heap of (deadline, name) with at most one live slot per name,
+    // the live slot's deadline is kept in queued. Slots that fire early
+    // are requeued with the deadline of the current index entry.
+    typedef std::pair<time_t, std::string> renew_slot;
+    std::priority_queue<renew_slot,
+                        std::vector<renew_slot>,
+                        std::greater<renew_slot> > queue;
+    std::unordered_map<std::string, time_t> queued;
+
+    uint64_t nrenewed;
+    uint64_t nfailed;
+
+    bool started;
+    pthread_t thread;
+};
+
+#endif  // _RENEWER_H
@@ -0,0 +1,541 @@
+#include "spoolindex.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <vector>
+
+#include <easylogging/easylogging++.h>
+
+#define SNAPSHOT_MAGIC   "TKTIDX1"
+#define SNAPSHOT_VERSION 1
+
+// Snapshot layout: header, count fixed size records, names. Integers are
+// in host byte order, the snapshot is not meant to move between hosts.
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t names_len;
+};
+
+struct snapshot_record {
+    int64_t endtime;
+    int64_t renew_till;
+    uint64_t ticket_hash;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t last_forward;
+    uint32_t peer_addr;
+    uint16_t peer_port;
+    uint16_t reserved;
+    uint32_t name_len;
+    uint32_t name_off;
+};
+
+// FNV-1a, identifies the ticket, not meant to resist collisions.
+static uint64_t ticket_hash(const krb5_data& ticket) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned int i = 0; i < ticket.length; ++i) {
+        hash ^= (unsigned char)ticket.data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool is_tgt(krb5_const_principal server) {
+    return server->length == 2 &&
+           server->data[0].length == KRB5_TGS_NAME_SIZE &&
+           memcmp(server->data[0].data, KRB5_TGS_NAME,
+                  KRB5_TGS_NAME_SIZE) == 0;
+}
+
+SpoolIndex::SpoolIndex(const std::string& snapshot_path_):
+        snapshot_path(snapshot_path_),
+        generation(0),
+        saved_generation(0),
+        listener(NULL),
+        listener_arg(NULL) {
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&save_lock, NULL);
+}
+
+SpoolIndex::~SpoolIndex() {
+    pthread_mutex_destroy(&save_lock);
+    pthread_mutex_destroy(&lock);
+}
+
+void SpoolIndex::set_listener(update_fn fn, void *arg) {
+    listener = fn;
+    listener_arg = arg;
+}
+
+bool SpoolIndex::lookup(const std::string& name,
+                        struct spool_meta *meta) const {
+    pthread_mutex_lock(&lock);
+    std::unordered_map<std::string, struct spool_meta>::const_iterator it =
+        entries.find(name);
+    bool found = (it != entries.end());
+    if (found) {
+        *meta = it->second;
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+void SpoolIndex::update(const std::string& name,
+                        const struct spool_meta& meta) {
+    time_t expire = spool_meta_expire(meta);
+
+    pthread_mutex_lock(&lock);
+    struct spool_meta& entry = entries[name];
+    time_t queued = entry.queued_expire;
+    entry = meta;
+    if (queued && queued <= expire) {
+        // Existing slot fires first and requeues.
+        entry.queued_expire = queued;
+    }
+    else {
+        expiry_queue.push(expiry_slot(expire, name));
+        entry.queued_expire = expire;
+    }
+    ++generation;
+    pthread_mutex_unlock(&lock);
+
+    if (listener) {
+        listener(listener_arg, name, meta);
+    }
+}
+
+void SpoolIndex::remove(const std::string& name) {
+    pthread_mutex_lock(&lock);
+    if (entries.erase(name)) {
+        ++generation;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void SpoolIndex::touch(const std::string& name,
+                       time_t when,
+                       const struct sockaddr_in& peer) {
+    pthread_mutex_lock(&lock);
+    std::unordered_map<std::string, struct spool_meta>::iterator it =
+        entries.find(name);
+    if (it != entries.end()) {
+        it->second.last_forward = when;
+        it->second.last_peer = peer;
+        ++generation;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+size_t SpoolIndex::size() const {
+    pthread_mutex_lock(&lock);
+    size_t n = entries.size();
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void SpoolIndex::expired(
+        time_t now,
+        size_t max,
+        std::vector<std::pair<std::string, struct spool_meta> >& out) {
+    pthread_mutex_lock(&lock);
+    while (out.size() < max && !expiry_queue.empty() &&
+           expiry_queue.top().first <= now) {
+        expiry_slot slot = expiry_queue.top();
+        expiry_queue.pop();
+
+        std::unordered_map<std::string, struct spool_meta>::iterator it =
+            entries.find(slot.second);
+        if (it == entries.end() || it->second.queued_expire != slot.first) {
+            continue;
+        }
+
+        time_t expire = spool_meta_expire(it->second);
+        if (expire > now) {
+            slot.first = expire;
+            it->second.queued_expire = expire;
+            expiry_queue.push(slot);
+            continue;
+        }
+
+        it->second.queued_expire = 0;
+        out.push_back(std::make_pair(it->first, it->second));
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void SpoolIndex::requeue(const std::string& name, ino_t ino, time_t when) {
+    pthread_mutex_lock(&lock);
+    std::unordered_map<std::string, struct spool_meta>::iterator it =
+        entries.find(name);
+    if (it != entries.end() && it->second.ino == ino &&
+        it->second.queued_expire == 0) {
+        expiry_queue.push(expiry_slot(when, name));
+        it->second.queued_expire = when;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void SpoolIndex::remove_if(const std::string& name, ino_t ino) {
+    pthread_mutex_lock(&lock);
+    std::unordered_map<std::string, struct spool_meta>::iterator it =
+        entries.find(name);
+    if (it != entries.end() && it->second.ino == ino) {
+        entries.erase(it);
+        ++generation;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void SpoolIndex::list(
+        std::vector<std::pair<std::string, struct spool_meta> >& out) const {
+    pthread_mutex_lock(&lock);
+    out.reserve(out.size() + entries.size());
+    std::unordered_map<std::string, struct spool_meta>::const_iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it) {
+        out.push_back(*it);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+size_t SpoolIndex::load() {
+    if (snapshot_path.empty()) {
+        return 0;
+    }
+
+    int fd = open(snapshot_path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            LOG(ERROR) << "Unable to open index snapshot: " << snapshot_path
+                       << ", " << strerror(errno);
+        }
+        return 0;
+    }
+
+    // Entries drive the sweeper and renewer, only trust our own snapshot.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        LOG(ERROR) << "Ignoring index snapshot not private to uid "
+                   << geteuid() << ": " << snapshot_path;
+        close(fd);
+        return 0;
+    }
+    if ((size_t)st.st_size < sizeof(snapshot_header)) {
+        close(fd);
+        return 0;
+    }
+
+    size_t len = st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG(ERROR) << "Unable to map index snapshot: " << strerror(errno);
+        return 0;
+    }
+
+    const struct snapshot_header *hdr = (const struct snapshot_header *)map;
+    const struct snapshot_record *records =
+        (const struct snapshot_record *)(hdr + 1);
+
+    // Names are located from count, so count is checked against the file
+    // size before it is used.
+    bool valid =
+        memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+        hdr->version == SNAPSHOT_VERSION &&
+        hdr->record_size == sizeof(struct snapshot_record) &&
+        hdr->count <= (len - sizeof(*hdr)) / sizeof(struct snapshot_record);
+    const char *names = NULL;
+    if (valid) {
+        size_t names_off = sizeof(*hdr) +
+                           hdr->count * sizeof(struct snapshot_record);
+        names = (const char *)map + names_off;
+        valid = hdr->names_len == len - names_off;
+    }
+    if (!valid) {
+        LOG(ERROR) << "Ignoring invalid index snapshot: " << snapshot_path;
+        munmap(map, len);
+        return 0;
+    }
+
+    std::vector<expiry_slot> slots;
+    slots.reserve(hdr->count);
+
+    pthread_mutex_lock(&lock);
+    entries.reserve(hdr->count);
+    size_t loaded = 0;
+    for (uint64_t i = 0; i < hdr->count; ++i) {
+        const struct snapshot_record& r = records[i];
+        if (r.name_off > hdr->names_len ||
+            r.name_len > hdr->names_len - r.name_off) {
+            continue;
+        }
+
+        struct spool_meta meta;
+        memset(&meta, 0, sizeof(meta));
+        meta.endtime = r.endtime;
+        meta.renew_till = r.renew_till;
+        meta.ticket_hash = r.ticket_hash;
+        meta.ino = r.ino;
+        meta.mtime.tv_sec = r.mtime_sec;
+        meta.mtime.tv_nsec = r.mtime_nsec;
+        meta.last_forward = r.last_forward;
+        meta.last_peer.sin_family = AF_INET;
+        meta.last_peer.sin_addr.s_addr = r.peer_addr;
+        meta.last_peer.sin_port = r.peer_port;
+        meta.queued_expire = spool_meta_expire(meta);
+
+        std::string name(names + r.name_off, r.name_len);
+        slots.push_back(expiry_slot(meta.queued_expire, name));
+        entries[name] = meta;
+        ++loaded;
+    }
+    expiry_queue = std::priority_queue<expiry_slot,
+                                       std::vector<expiry_slot>,
+                                       std::greater<expiry_slot> >(
+            std::greater<expiry_slot>(), slots);
+    saved_generation = generation;
+    pthread_mutex_unlock(&lock);
+
+    munmap(map, len);
+
+    LOG(INFO) << "Loaded spool index snapshot: " << snapshot_path
+              << ", entries: " << loaded;
+    return loaded;
+}
+
+size_t SpoolIndex::scan(const std::string& dir) {
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        LOG(ERROR) << "Unable to scan spool dir: " << dir << ", "
+                   << strerror(errno);
+        return 0;
+    }
+
+    krb5_context ctx;
+    if (krb5_init_context(&ctx) != 0) {
+        LOG(ERROR) << "krb5_init_context failed, spool not scanned.";
+        closedir(d);
+        return 0;
+    }
+
+    uid_t euid = geteuid();
+    std::vector<std::pair<std::string, struct spool_meta> > found;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        // Spool files are named after principals, dot files are our own.
+        if (de->d_name[0] == '.' || strchr(de->d_name, '@') == NULL) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(st.st_mode) || st.st_uid != euid) {
+            continue;
+        }
+
+        std::string ccname = "FILE:" + dir + "/" + de->d_name;
+        krb5_ccache cc;
+        if (krb5_cc_resolve(ctx, ccname.c_str(), &cc) != 0) {
+            continue;
+        }
+        struct spool_meta meta;
+        bool have_meta = spool_meta_from_ccache(ctx, cc, &meta);
+        krb5_cc_close(ctx, cc);
+        if (!have_meta) {
+            continue;
+        }
+
+        meta.ino = st.st_ino;
+        meta.mtime = st.st_mtim;
+        meta.last_peer.sin_family = AF_INET;
+        found.push_back(std::make_pair(std::string(de->d_name), meta));
+    }
+    closedir(d);
+    krb5_free_context(ctx);
+
+    size_t added = 0;
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < found.size(); ++i) {
+        struct spool_meta& meta = found[i].second;
+        if (entries.count(found[i].first)) {
+            continue;
+        }
+        meta.queued_expire = spool_meta_expire(meta);
+        expiry_queue.push(expiry_slot(meta.queued_expire, found[i].first));
+        entries[found[i].first] = meta;
+        ++added;
+    }
+    if (added) {
+        ++generation;
+    }
+    pthread_mutex_unlock(&lock);
+
+    LOG(INFO) << "Scanned spool dir: " << dir << ", entries: " << added;
+    return added;
+}
+
+bool SpoolIndex::save() {
+    if (snapshot_path.empty()) {
+        return true;
+    }
+
+    pthread_mutex_lock(&save_lock);
+
+    // Serialize under the index lock, write without it.
+    std::vector<char> buf;
+    pthread_mutex_lock(&lock);
+    uint64_t gen = generation;
+    if (gen == saved_generation) {
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&save_lock);
+        return true;
+    }
+
+    size_t names_len = 0;
+    std::unordered_map<std::string, struct spool_meta>::const_iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it) {
+        names_len += it->first.size();
+    }
+
+    size_t count = entries.size();
+    buf.resize(sizeof(struct snapshot_header) +
+               count * sizeof(struct snapshot_record) + names_len);
+
+    struct snapshot_header *hdr = (struct snapshot_header *)&buf[0];
+    struct snapshot_record *records = (struct snapshot_record *)(hdr + 1);
+    char *names = (char *)(records + count);
+
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    hdr->version = SNAPSHOT_VERSION;
+    hdr->record_size = sizeof(struct snapshot_record);
+    hdr->count = count;
+    hdr->names_len = names_len;
+
+    size_t i = 0;
+    size_t name_off = 0;
+    for (it = entries.begin(); it != entries.end(); ++it, ++i) {
+        const struct spool_meta& meta = it->second;
+        struct snapshot_record& r = records[i];
+        memset(&r, 0, sizeof(r));
+        r.endtime = meta.endtime;
+        r.renew_till = meta.renew_till;
+        r.ticket_hash = meta.ticket_hash;
+        r.ino = meta.ino;
+        r.mtime_sec = meta.mtime.tv_sec;
+        r.mtime_nsec = meta.mtime.tv_nsec;
+        r.last_forward = meta.last_forward;
+        r.peer_addr = meta.last_peer.sin_addr.s_addr;
+        r.peer_port = meta.last_peer.sin_port;
+        r.name_len = it->first.size();
+        r.name_off = name_off;
+        memcpy(names + name_off, it->first.data(), it->first.size());
+        name_off += it->first.size();
+    }
+    pthread_mutex_unlock(&lock);
+
+    // New file every time, never one planted under the temp name.
+    std::vector<char> temp_name(snapshot_path.begin(), snapshot_path.end());
+    const char suffix[] = ".XXXXXX";
+    temp_name.insert(temp_name.end(), suffix, suffix + sizeof(suffix));
+    int fd = mkostemp(&temp_name[0], O_CLOEXEC);
+    std::string temp(&temp_name[0]);
+    if (fd < 0) {
+        LOG(ERROR) << "Unable to write index snapshot: " << temp
+                   << ", " << strerror(errno);
+        pthread_mutex_unlock(&save_lock);
+        return false;
+    }
+
+    bool success = true;
+    size_t off = 0;
+    while (off < buf.size()) {
+        ssize_t n = write(fd, &buf[off], buf.size() - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            success = false;
+            break;
+        }
+        off += n;
+    }
+    // On disk before it replaces the previous snapshot, like spool files.
+    if (success && fsync(fd) != 0) {
+        success = false;
+    }
+    if (close(fd) != 0) {
+        success = false;
+    }
+
+    if (!success || rename(temp.c_str(), snapshot_path.c_str()) != 0) {
+        LOG(ERROR) << "Unable to write index snapshot: " << snapshot_path
+                   << ", " << strerror(errno);
+        unlink(temp.c_str());
+        pthread_mutex_unlock(&save_lock);
+        return false;
+    }
+
+    size_t slash = snapshot_path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." :
+                      slash == 0 ? "/" : snapshot_path.substr(0, slash);
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0 || fsync(dir_fd) != 0) {
+        LOG(WARNING) << "Unable to sync index snapshot directory: " << dir
+                     << ", " << strerror(errno);
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+
+    pthread_mutex_lock(&lock);
+    saved_generation = gen;
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_unlock(&save_lock);
+    return true;
+}
+
+bool spool_meta_from_ccache(krb5_context ctx,
+                            krb5_ccache cc,
+                            struct spool_meta *meta) {
+    krb5_cc_cursor cursor;
+    if (krb5_cc_start_seq_get(ctx, cc, &cursor)) {
+        return false;
+    }
+
+    bool found = false;
+    krb5_creds creds;
+    while (!found && krb5_cc_next_cred(ctx, cc, &cursor, &creds) == 0) {
+        if (!krb5_is_config_principal(ctx, creds.server) &&
+            is_tgt(creds.server)) {
+            memset(meta, 0, sizeof(*meta));
+            meta->endtime = creds.times.endtime;
+            meta->renew_till = creds.times.renew_till;
+            meta->ticket_hash = ticket_hash(creds.ticket);
+            found = true;
+        }
+        krb5_free_cred_contents(ctx, &creds);
+    }
+    krb5_cc_end_seq_get(ctx, cc, &cursor);
+    return found;
+}
+
+bool spool_meta_not_newer(const struct spool_meta& incoming,
+                          const struct spool_meta& current) {
+    if (incoming.ticket_hash == current.ticket_hash) {
+        return true;
+    }
+    return incoming.endtime <= current.endtime &&
+           incoming.renew_till <= current.renew_till;
+}
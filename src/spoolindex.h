@@ -0,0 +1,136 @@
+#ifndef _SPOOL_INDEX_H
+#define _SPOOL_INDEX_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+
+#include <functional>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+extern "C" {
+    #include <krb5.h>
+}
+
+// What is known about the TGT in a spool file.
+struct spool_meta {
+    krb5_timestamp endtime;
+    krb5_timestamp renew_till;
+    uint64_t ticket_hash;
+
+    // spool file the metadata was recorded for, a file replaced behind
+    // our back invalidates the entry
+    ino_t ino;
+    struct timespec mtime;
+
+    // last forward of the principal, written or not
+    time_t last_forward;
+    struct sockaddr_in last_peer;
+
+    // time of the entry's pending expiry queue slot, 0 - not queued
+    time_t queued_expire;
+};
+
+// Spool file can be removed once both TGT and renewal have lapsed.
+inline time_t spool_meta_expire(const struct spool_meta& meta) {
+    return meta.renew_till > meta.endtime ? meta.renew_till : meta.endtime;
+}
+
+// Principal -> spool file metadata, kept up to date by every store and
+// shared by all credential managers. Keys are spool file names, the file
+// path is <spool dir>/<name>.
+//
+// The index is saved to a flat snapshot file and mapped back in on start,
+// so a restart does not rescan and parse the spool. Snapshot entries are
+// trusted only as long as the file's inode and mtime match.
+class SpoolIndex {
+public:
+    // Called after every update(), outside the index lock.
+    typedef void (*update_fn)(void *arg,
+                              const std::string& name,
+                              const struct spool_meta& meta);
+
+    // snapshot_path_ - empty, index is not persisted
+    SpoolIndex(const std::string& snapshot_path_);
+    ~SpoolIndex();
+
+    // Set before the index is shared between threads.
+    void set_listener(update_fn fn, void *arg);
+
+    bool lookup(const std::string& name, struct spool_meta *meta) const;
+    void update(const std::string& name, const struct spool_meta& meta);
+    void remove(const std::string& name);
+
+    // Record forward that did not change the spool file.
+    void touch(const std::string& name,
+               time_t when,
+               const struct sockaddr_in& peer);
+
+    size_t size() const;
+
+    // Take up to max entries expired by now out of the expiry queue. The
+    // entries stay in the index until removed.
+    void expired(time_t now,
+                 size_t max,
+                 std::vector<std::pair<std::string, struct spool_meta> >& out);
+
+    // Put an entry taken by expired() back in the expiry queue, to come
+    // out again at when. Ignored if name no longer describes spool file ino
+    // or is queued again already.
+    void requeue(const std::string& name, ino_t ino, time_t when);
+
+    // Remove name if it still describes spool file ino.
+    void remove_if(const std::string& name, ino_t ino);
+
+    // Copy of all entries.
+    void list(std::vector<std::pair<std::string, struct spool_meta> >& out)
+        const;
+
+    // Load snapshot, returns number of entries loaded.
+    size_t load();
+    // Index the TGT of every spool file in dir owned by us, for a start
+    // without a snapshot. Returns number of entries added.
+    size_t scan(const std::string& dir);
+    // Write snapshot if the index changed since the last save.
+    bool save();
+
+private:
+    std::string snapshot_path;
+
+    mutable pthread_mutex_t lock;
+    std::unordered_map<std::string, struct spool_meta> entries;
+    uint64_t generation;
+    uint64_t saved_generation;
+
+    // Min-heap of (expire, name), at most one live slot per entry. Slots
+    // are not removed on update; a slot popped early is requeued with the
+    // entry's current expiry.
+    typedef std::pair<time_t, std::string> expiry_slot;
+    std::priority_queue<expiry_slot,
+                        std::vector<expiry_slot>,
+                        std::greater<expiry_slot> > expiry_queue;
+
+    update_fn listener;
+    void *listener_arg;
+
+    // serializes save()
+    pthread_mutex_t save_lock;
+};
+
+// Fill in TGT metadata of the credentials in cc, returns false if there is
+// no TGT.
+bool spool_meta_from_ccache(krb5_context ctx,
+                            krb5_ccache cc,
+                            struct spool_meta *meta);
+
+// True if storing incoming over current would not give the client a newer
+// or longer lived TGT.
+bool spool_meta_not_newer(const struct spool_meta& incoming,
+                          const struct spool_meta& current);
+
+#endif  // _SPOOL_INDEX_H
@@ -0,0 +1,290 @@
+#include "statsegment.h"
+#include "tktrecv.h"
+#include "workpool.h"
+#include "spoolindex.h"
+#include "sweeper.h"
+#include "renewer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <easylogging/easylogging++.h>
+
+static int64_t wall_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Copy counters the loops keep updating, one STAT_READ per counter.
+static void copy_counters(void *dst, const void *src, size_t len) {
+    uint64_t *to = (uint64_t *)dst;
+    const uint64_t *from = (const uint64_t *)src;
+    for (size_t i = 0; i < len / sizeof(uint64_t); ++i) {
+        to[i] = STAT_READ(from[i]);
+    }
+}
+
+StatsSegment::StatsSegment(const std::string& name_,
+                           struct server_loop *loops_,
+                           int nloops_,
+                           unsigned nforwards_,
+                           unsigned publish_ms_):
+        name(name_),
+        loops(loops_),
+        nloops(nloops_),
+        nforwards(nforwards_ ? nforwards_ : 1),
+        publish_ms(publish_ms_ ? publish_ms_ : 1),
+        spool_index(NULL),
+        sweeper(NULL),
+        renewer(NULL),
+        hdr(NULL),
+        size(0),
+        stopping(false),
+        started(false) {
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+StatsSegment::~StatsSegment() {
+    if (started) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(thread, NULL);
+    }
+
+    if (hdr) {
+        for (int i = 0; i < nloops; ++i) {
+            loops[i].shm = NULL;
+            loops[i].shm_forwards = NULL;
+        }
+        shm_unlink(name.c_str());
+        munmap(hdr, size);
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+void StatsSegment::set_spool_index(SpoolIndex *spool_index_) {
+    spool_index = spool_index_;
+}
+
+void StatsSegment::set_sweeper(SpoolSweeper *sweeper_) {
+    sweeper = sweeper_;
+}
+
+void StatsSegment::set_renewer(Renewer *renewer_) {
+    renewer = renewer_;
+}
+
+// Remove a segment left behind by a server that did not exit cleanly.
+// Returns false if its server is still running, or it can't be checked.
+bool StatsSegment::unlink_stale() {
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        // gone in the meantime
+        return errno == ENOENT;
+    }
+
+    pid_t pid = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= sizeof(struct statshm_header)) {
+        void *addr = mmap(NULL, sizeof(struct statshm_header), PROT_READ,
+                          MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            pid = ((const struct statshm_header *)addr)->pid;
+            munmap(addr, sizeof(struct statshm_header));
+        }
+    }
+    close(fd);
+
+    // A segment without a pid may be one that is being created.
+    if (pid <= 0) {
+        LOG(ERROR) << "Stats segment " << name << " already in use.";
+        return false;
+    }
+    if (kill(pid, 0) == 0 || errno != ESRCH) {
+        LOG(ERROR) << "Stats segment " << name << " already in use by pid "
+                   << pid << ".";
+        return false;
+    }
+
+    LOG(WARNING) << "Removing stats segment " << name
+                 << " left behind by pid " << pid;
+    return shm_unlink(name.c_str()) == 0 || errno == ENOENT;
+}
+
+bool StatsSegment::start() {
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0640);
+    if (fd < 0 && errno == EEXIST) {
+        if (!unlink_stale()) {
+            return false;
+        }
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0640);
+    }
+    if (fd < 0) {
+        LOG(ERROR) << "Unable to create stats segment " << name << ": "
+                   << strerror(errno);
+        return false;
+    }
+
+    size = statshm_size(nloops, nforwards);
+    if (ftruncate(fd, size) != 0) {
+        LOG(ERROR) << "Unable to size stats segment " << name << ": "
+                   << strerror(errno);
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOG(ERROR) << "Unable to map stats segment " << name << ": "
+                   << strerror(errno);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // New segment is zero filled, readers wait for the magic.
+    hdr = (struct statshm_header *)addr;
+    hdr->version = STATSHM_VERSION;
+    hdr->size = size;
+    hdr->pid = getpid();
+    hdr->nloops = nloops;
+    hdr->nforwards = nforwards;
+    hdr->publish_ms = publish_ms;
+    hdr->started_us = wall_us();
+
+    for (int i = 0; i < nloops; ++i) {
+        loops[i].shm = &statshm_loops(hdr)[i];
+        loops[i].shm_forwards = statshm_forwards(hdr, i);
+        loops[i].shm_nforwards = nforwards;
+    }
+
+    publish();
+    __atomic_store_n(&hdr->magic, STATSHM_MAGIC, __ATOMIC_RELEASE);
+
+    int rc = pthread_create(&thread, NULL, thread_main, this);
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to start stats thread: " << strerror(rc);
+        return false;
+    }
+    started = true;
+
+    LOG(INFO) << "Publishing stats in shared memory " << name;
+    return true;
+}
+
+void *StatsSegment::thread_main(void *arg) {
+    StatsSegment *ss = (StatsSegment *)arg;
+
+    pthread_mutex_lock(&ss->lock);
+    while (!ss->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ss->publish_ms / 1000;
+        deadline.tv_nsec += (long)(ss->publish_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int wait_rc = 0;
+        while (!ss->stopping && wait_rc != ETIMEDOUT) {
+            wait_rc = pthread_cond_timedwait(&ss->cond, &ss->lock, &deadline);
+        }
+
+        if (ss->stopping) {
+            break;
+        }
+
+        pthread_mutex_unlock(&ss->lock);
+        ss->publish();
+        pthread_mutex_lock(&ss->lock);
+    }
+    pthread_mutex_unlock(&ss->lock);
+    return NULL;
+}
+
+void StatsSegment::publish() {
+    // Gathered before the section is opened, the spool index takes a lock.
+    uint64_t spool_entries = spool_index ? spool_index->size() : 0;
+
+    statshm_write_begin(&hdr->seq);
+    hdr->published_us = wall_us();
+    hdr->live_workers = loops[0].load->live_workers.load();
+    hdr->token_bytes = loops[0].load->token_bytes.load();
+    hdr->pending_stores =
+        loops[0].store_pool ? loops[0].store_pool->queued() : 0;
+    hdr->spool_entries = spool_entries;
+    hdr->expired_swept = sweeper ? sweeper->swept() : 0;
+    hdr->renewals = renewer ? renewer->renewed() : 0;
+    hdr->renewal_failures = renewer ? renewer->failed() : 0;
+    statshm_write_end(&hdr->seq);
+
+    uint64_t now_us = monotonic_us();
+    for (int i = 0; i < nloops; ++i) {
+        struct server_loop *loop = &loops[i];
+        struct loop_activity *activity = &loop->activity;
+        struct statshm_loop *out = &statshm_loops(hdr)[i];
+
+        uint32_t callback = __atomic_load_n(&activity->callback,
+                                            __ATOMIC_ACQUIRE);
+        uint64_t start_us = __atomic_load_n(&activity->start_us,
+                                            __ATOMIC_RELAXED);
+
+        statshm_write_begin(&out->seq);
+        copy_counters(&out->stats, &loop->stats, sizeof(out->stats));
+        copy_counters(out->hist, loop->hist, sizeof(out->hist));
+        copy_counters(out->stalls, activity->stalls, sizeof(out->stalls));
+        copy_counters(out->stall_max_us, activity->stall_max_us,
+                      sizeof(out->stall_max_us));
+        out->callback = callback;
+        out->busy_us = callback != LOOP_CB_IDLE && now_us > start_us ?
+                       now_us - start_us : 0;
+        out->accept_paused = __atomic_load_n(&loop->accept_paused,
+                                             __ATOMIC_RELAXED);
+        out->lag_ms = __atomic_load_n(&loop->lag_ms, __ATOMIC_RELAXED);
+        statshm_write_end(&out->seq);
+    }
+}
+
+void stats_record_forward(const struct worker *w) {
+    struct server_loop *loop = w->loop;
+    if (loop->shm == NULL) {
+        return;
+    }
+
+    uint64_t n = loop->shm->forward_count;
+    struct statshm_forward *f = &loop->shm_forwards[n % loop->shm_nforwards];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+    statshm_write_begin(&f->seq);
+    f->closed_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    f->fd = w->network_fd;
+    f->result = w->result;
+    f->peer_addr = w->peeraddr.sin_addr.s_addr;
+    f->peer_port = w->peeraddr.sin_port;
+    f->gss_major = w->accept_maj;
+    memcpy(f->phase_us, w->phase_us, sizeof(f->phase_us));
+    memcpy(f->principal, w->principal, sizeof(f->principal));
+    statshm_write_end(&f->seq);
+
+    __atomic_store_n(&loop->shm->forward_count, n + 1, __ATOMIC_RELEASE);
+}
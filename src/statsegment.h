@@ -0,0 +1,66 @@
+#ifndef _STATSEGMENT_H
+#define _STATSEGMENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "statshm.h"
+
+struct server_loop;
+struct worker;
+class SpoolIndex;
+class SpoolSweeper;
+class Renewer;
+
+// Publishes the stats segment (statshm.h) from its own thread. Counters
+// and loop state are copied from the loops every publish_ms, the loops
+// only write their own forward rings, see stats_record_forward().
+class StatsSegment {
+public:
+    StatsSegment(const std::string& name_,
+                 struct server_loop *loops_,
+                 int nloops_,
+                 unsigned nforwards_,
+                 unsigned publish_ms_);
+    ~StatsSegment();
+
+    // Optional sources, set before start().
+    void set_spool_index(SpoolIndex *spool_index_);
+    void set_sweeper(SpoolSweeper *sweeper_);
+    void set_renewer(Renewer *renewer_);
+
+    // Create the segment and attach the loops to it, before they run.
+    bool start();
+
+private:
+    static void *thread_main(void *arg);
+    bool unlink_stale();
+    void publish();
+
+    std::string name;
+    struct server_loop *loops;
+    int nloops;
+    unsigned nforwards;
+    unsigned publish_ms;
+    SpoolIndex *spool_index;
+    SpoolSweeper *sweeper;
+    Renewer *renewer;
+
+    struct statshm_header *hdr;
+    size_t size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+
+    bool started;
+    pthread_t thread;
+};
+
+// Append the worker's forward to its loop's ring, on the loop thread when
+// the worker is freed.
+void stats_record_forward(const struct worker *w);
+
+#endif  // _STATSEGMENT_H
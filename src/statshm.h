@@ -0,0 +1,167 @@
+#ifndef _STATSHM_H
+#define _STATSHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "watchdog.h"
+
+// Live statistics segment. tkt-recv publishes its counters, the state of
+// every loop and the most recent forwards of every loop into POSIX shared
+// memory, tkt-stat reads them. Readers never lock or talk to the server,
+// so a node that is overloaded or wedged can be watched without adding to
+// its load.
+//
+// Layout: header, nloops statshm_loop, then nforwards statshm_forward per
+// loop. Every section is a seqlock with a single writer, seq is odd while
+// it is written.
+
+#define STATSHM_MAGIC   0x544b5453
+#define STATSHM_VERSION 2
+
+// Longer principals are truncated.
+#define STATSHM_PRINCIPAL 128
+
+// Segment name used by default, followed by the port.
+#define STATSHM_PREFIX "/tkt-recv."
+
+// How a forward ended.
+enum forward_result {
+    // closed before there was a result
+    FORWARD_INCOMPLETE,
+    FORWARD_STORED,
+    // spool already had the tickets
+    FORWARD_SKIPPED,
+    // merged into another store of the principal
+    FORWARD_COALESCED,
+    FORWARD_STORE_FAILED,
+    FORWARD_GSS_FAILED,
+    FORWARD_REPLAY,
+    FORWARD_TIMEOUT,
+    // replay cache had no room for the authenticator
+    FORWARD_RCACHE_FULL,
+    FORWARD_RESULTS
+};
+
+inline const char *forward_result_name(int result) {
+    static const char *names[FORWARD_RESULTS] = {
+        "incomplete",
+        "stored",
+        "skipped",
+        "coalesced",
+        "store_failed",
+        "gss_failed",
+        "replay",
+        "timeout",
+        "rcache_full",
+    };
+    if (result < 0 || result >= FORWARD_RESULTS) {
+        return "unknown";
+    }
+    return names[result];
+}
+
+struct statshm_header {
+    // set once before magic is written
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    int32_t pid;
+    uint32_t nloops;
+    uint32_t nforwards;
+    uint32_t publish_ms;
+    // wall clock, microseconds
+    int64_t started_us;
+
+    // written by the publisher thread
+    uint64_t seq;
+    int64_t published_us;
+    int64_t live_workers;
+    int64_t token_bytes;
+    uint64_t pending_stores;
+    uint64_t spool_entries;
+    uint64_t expired_swept;
+    uint64_t renewals;
+    uint64_t renewal_failures;
+} __attribute__((aligned(64)));
+
+struct statshm_loop {
+    // written by the publisher thread
+    uint64_t seq;
+    struct server_stats stats;
+    struct latency_hist hist[PHASE_COUNT];
+    uint64_t stalls[LOOP_CB_COUNT];
+    uint64_t stall_max_us[LOOP_CB_COUNT];
+    // loop_callback running and for how long
+    uint32_t callback;
+    uint32_t accept_paused;
+    uint64_t busy_us;
+    uint64_t lag_ms;
+
+    // written by the loop thread: forwards recorded so far, the last
+    // nforwards of them are in the loop's ring
+    uint64_t forward_count __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct statshm_forward {
+    // written by the loop thread
+    uint64_t seq;
+    // wall clock when the connection was closed, microseconds
+    int64_t closed_us;
+    int32_t fd;
+    int32_t result;
+    // network byte order
+    uint32_t peer_addr;
+    uint32_t peer_port;
+    uint32_t gss_major;
+    uint32_t phase_us[PHASE_COUNT];
+    char principal[STATSHM_PRINCIPAL];
+};
+
+inline size_t statshm_size(uint32_t nloops, uint32_t nforwards) {
+    return sizeof(struct statshm_header) +
+           nloops * sizeof(struct statshm_loop) +
+           (size_t)nloops * nforwards * sizeof(struct statshm_forward);
+}
+
+inline struct statshm_loop *statshm_loops(struct statshm_header *hdr) {
+    return (struct statshm_loop *)(hdr + 1);
+}
+
+inline struct statshm_forward *statshm_forwards(struct statshm_header *hdr,
+                                                uint32_t loop) {
+    struct statshm_forward *first =
+        (struct statshm_forward *)(statshm_loops(hdr) + hdr->nloops);
+    return first + (size_t)loop * hdr->nforwards;
+}
+
+inline void statshm_write_begin(uint64_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+inline void statshm_write_end(uint64_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+// Copy a section, starting with its seq. Gives up if the writer keeps it
+// busy, a writer that died mid update must not hang the reader.
+inline bool statshm_read(void *dst, const void *section, size_t len) {
+    const uint64_t *seq = (const uint64_t *)section;
+    for (int tries = 0; tries < 1000; ++tries) {
+        uint64_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(dst, section, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif  // _STATSHM_H
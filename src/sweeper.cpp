@@ -0,0 +1,253 @@
+#include "sweeper.h"
+#include "spoolindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <easylogging/easylogging++.h>
+
+#define SPOOL_EXPIRED_DIR ".tkt-expired"
+
+// Keep files this long past expiry, tickets are still accepted by services
+// within the clock skew.
+#define SWEEP_GRACE 300
+
+// Files that could not be swept are retried after SWEEP_RETRY seconds,
+// doubling with every failure up to SWEEP_RETRY_MAX.
+#define SWEEP_RETRY     10
+#define SWEEP_RETRY_MAX 3600
+
+SpoolSweeper::SpoolSweeper(const std::string& spool_dir,
+                           SpoolIndex *index_,
+                           expired_mode mode_,
+                           unsigned interval_ms_,
+                           unsigned batch_):
+        dir(spool_dir),
+        dir_fd(-1),
+        expired_fd(-1),
+        index(index_),
+        mode(mode_),
+        interval_ms(interval_ms_),
+        batch(batch_),
+        nswept(0),
+        stopping(false),
+        started(false) {
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+SpoolSweeper::~SpoolSweeper() {
+    if (started) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(thread, NULL);
+    }
+
+    if (expired_fd >= 0) {
+        close(expired_fd);
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+bool SpoolSweeper::start() {
+    dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        LOG(ERROR) << "Unable to open spool dir: " << dir
+                   << ", " << strerror(errno);
+        return false;
+    }
+
+    // Files are moved here before they are checked and removed, so it has
+    // to be on the spool filesystem.
+    if (mkdirat(dir_fd, SPOOL_EXPIRED_DIR, 0700) != 0 && errno != EEXIST) {
+        LOG(ERROR) << "Unable to create " << dir << "/" << SPOOL_EXPIRED_DIR
+                   << ", " << strerror(errno);
+        return false;
+    }
+    expired_fd = openat(dir_fd, SPOOL_EXPIRED_DIR,
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if (expired_fd < 0) {
+        LOG(ERROR) << "Unable to open " << dir << "/" << SPOOL_EXPIRED_DIR
+                   << ", " << strerror(errno);
+        return false;
+    }
+    // Someone else's directory would let them swap files being checked.
+    struct stat st;
+    if (fstat(expired_fd, &st) != 0 || st.st_uid != geteuid() ||
+        (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        LOG(ERROR) << "Refusing " << dir << "/" << SPOOL_EXPIRED_DIR
+                   << ", not a private directory of uid " << geteuid();
+        return false;
+    }
+
+    int rc = pthread_create(&thread, NULL, thread_main, this);
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to start sweeper thread: " << strerror(rc);
+        return false;
+    }
+    started = true;
+
+    LOG(INFO) << "Spool sweeper: "
+              << (mode == EXPIRED_QUARANTINE ? "quarantine" : "delete")
+              << ", interval: " << interval_ms << "ms"
+              << ", batch: " << batch;
+    return true;
+}
+
+uint64_t SpoolSweeper::swept() const {
+    return __atomic_load_n(&nswept, __ATOMIC_RELAXED);
+}
+
+// Remove spool file name if it is still the expired file described by meta.
+// The file is renamed out of the spool first and checked afterwards, so a
+// store that replaces it concurrently is never lost.
+SpoolSweeper::sweep_result SpoolSweeper::sweep_one(
+        const std::string& name,
+        const struct spool_meta& meta) {
+    if (name.empty() || name[0] == '.' || name.find('/') != std::string::npos) {
+        return SWEEP_SKIPPED;
+    }
+
+    const char *file = name.c_str();
+
+    struct stat st;
+    if (fstatat(dir_fd, file, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno != ENOENT) {
+            LOG(ERROR) << "Unable to stat: " << name
+                       << ", " << strerror(errno);
+            return SWEEP_FAILED;
+        }
+        index->remove_if(name, meta.ino);
+        return SWEEP_SKIPPED;
+    }
+    if (st.st_ino != meta.ino ||
+        st.st_mtim.tv_sec != meta.mtime.tv_sec ||
+        st.st_mtim.tv_nsec != meta.mtime.tv_nsec) {
+        // Replaced since indexed, leave it to the next store.
+        index->remove_if(name, meta.ino);
+        return SWEEP_SKIPPED;
+    }
+
+    if (renameat(dir_fd, file, expired_fd, file) != 0) {
+        if (errno == ENOENT) {
+            return SWEEP_SKIPPED;
+        }
+        LOG(ERROR) << "Rename: " << name << " " << SPOOL_EXPIRED_DIR
+                   << ", " << strerror(errno);
+        return SWEEP_FAILED;
+    }
+
+    if (fstatat(expired_fd, file, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        st.st_ino != meta.ino ||
+        st.st_mtim.tv_sec != meta.mtime.tv_sec ||
+        st.st_mtim.tv_nsec != meta.mtime.tv_nsec) {
+        // A store replaced the file between the check and the rename, put
+        // it back unless an even newer one is already there.
+        if (linkat(expired_fd, file, dir_fd, file, 0) != 0 &&
+            errno != EEXIST) {
+            LOG(ERROR) << "Unable to restore: " << name
+                       << ", " << strerror(errno);
+            return SWEEP_SKIPPED;
+        }
+        unlinkat(expired_fd, file, 0);
+        return SWEEP_SKIPPED;
+    }
+
+    if (mode == EXPIRED_DELETE && unlinkat(expired_fd, file, 0) != 0) {
+        LOG(ERROR) << "Unable to unlink: " << SPOOL_EXPIRED_DIR << "/" << name
+                   << ", " << strerror(errno);
+    }
+
+    index->remove_if(name, meta.ino);
+    return SWEEP_REMOVED;
+}
+
+void SpoolSweeper::sweep() {
+    time_t now = time(NULL) - SWEEP_GRACE;
+    std::vector<std::pair<std::string, struct spool_meta> > expired;
+    index->expired(now, batch, expired);
+
+    unsigned removed = 0;
+    for (size_t i = 0; i < expired.size(); ++i) {
+        const std::string& name = expired[i].first;
+        sweep_result result = sweep_one(name, expired[i].second);
+        if (result != SWEEP_FAILED) {
+            failures.erase(name);
+            if (result == SWEEP_REMOVED) {
+                ++removed;
+            }
+            continue;
+        }
+
+        // expired() took the entry off the queue, put it back or it is
+        // never looked at again.
+        unsigned attempt = failures[name]++;
+        time_t delay = SWEEP_RETRY;
+        while (attempt-- > 0 && delay < SWEEP_RETRY_MAX) {
+            delay *= 2;
+        }
+        if (delay > SWEEP_RETRY_MAX) {
+            delay = SWEEP_RETRY_MAX;
+        }
+        index->requeue(name, expired[i].second.ino, now + delay);
+    }
+
+    if (removed) {
+        __atomic_add_fetch(&nswept, removed, __ATOMIC_RELAXED);
+        LOG(INFO) << (mode == EXPIRED_QUARANTINE ? "Quarantined " : "Deleted ")
+                  << removed << " expired ticket cache(s).";
+    }
+}
+
+void *SpoolSweeper::thread_main(void *arg) {
+    SpoolSweeper *sw = (SpoolSweeper *)arg;
+
+    // Only use cpu nobody else wants.
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    int rc = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    if (rc != 0) {
+        LOG(WARNING) << "Unable to lower sweeper priority: " << strerror(rc);
+    }
+
+    pthread_mutex_lock(&sw->lock);
+    while (!sw->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += sw->interval_ms / 1000;
+        deadline.tv_nsec += (long)(sw->interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int wait_rc = 0;
+        while (!sw->stopping && wait_rc != ETIMEDOUT) {
+            wait_rc = pthread_cond_timedwait(&sw->cond, &sw->lock, &deadline);
+        }
+
+        if (sw->stopping) {
+            break;
+        }
+
+        pthread_mutex_unlock(&sw->lock);
+        sw->sweep();
+        pthread_mutex_lock(&sw->lock);
+    }
+    pthread_mutex_unlock(&sw->lock);
+    return NULL;
+}
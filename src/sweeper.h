@@ -0,0 +1,66 @@
+#ifndef _SWEEPER_H
+#define _SWEEPER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "tktrecv.h"
+
+struct spool_meta;
+
+// Removes expired ccaches from the spool in the background. Candidates come
+// from the spool index expiry queue, so the spool directory is never
+// scanned. Every tick handles at most batch files, and the thread runs
+// with idle priority to stay out of the way of the event loops.
+class SpoolSweeper {
+public:
+    SpoolSweeper(const std::string& spool_dir,
+                 SpoolIndex *index_,
+                 expired_mode mode_,
+                 unsigned interval_ms_,
+                 unsigned batch_);
+    ~SpoolSweeper();
+
+    bool start();
+
+    uint64_t swept() const;
+
+private:
+    enum sweep_result {
+        SWEEP_REMOVED,
+        // gone, replaced or not a spool file, nothing to retry
+        SWEEP_SKIPPED,
+        // could not be moved, retried later
+        SWEEP_FAILED
+    };
+
+    static void *thread_main(void *arg);
+    void sweep();
+    sweep_result sweep_one(const std::string& name,
+                           const struct spool_meta& meta);
+
+    std::string dir;
+    int dir_fd;
+    int expired_fd;
+    SpoolIndex *index;
+    expired_mode mode;
+    unsigned interval_ms;
+    unsigned batch;
+
+    uint64_t nswept;
+    // failed attempts per file, sweeper thread only
+    std::unordered_map<std::string, unsigned> failures;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+
+    bool started;
+    pthread_t thread;
+};
+
+#endif  // _SWEEPER_H
@@ -0,0 +1,110 @@
+#include "timerwheel.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+// Every slot is a circular list with the slot itself as the list head.
+static void slot_init(struct tw_timer *slot) {
+    slot->prev = slot;
+    slot->next = slot;
+}
+
+static void list_unlink(struct tw_timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+void tw_init(struct timer_wheel *tw, size_t nslots, unsigned tick_ms) {
+    assert(nslots > 0);
+    assert(tick_ms > 0);
+
+    tw->slots = (struct tw_timer *)calloc(nslots, sizeof(struct tw_timer));
+    assert(tw->slots);
+    for (size_t i = 0; i < nslots; ++i) {
+        slot_init(&tw->slots[i]);
+    }
+
+    tw->nslots = nslots;
+    tw->now = 0;
+    tw->tick_ms = tick_ms;
+    tw->active = 0;
+}
+
+void tw_free(struct timer_wheel *tw) {
+    free(tw->slots);
+    tw->slots = NULL;
+    tw->nslots = 0;
+}
+
+void tw_timer_init(struct tw_timer *timer,
+                   void (*cb)(struct tw_timer *, void *),
+                   void *arg) {
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->expires = 0;
+    timer->cb = cb;
+    timer->arg = arg;
+}
+
+void tw_timer_add(struct timer_wheel *tw,
+                  struct tw_timer *timer,
+                  unsigned timeout_ms) {
+    if (tw_timer_pending(timer)) {
+        tw_timer_del(tw, timer);
+    }
+
+    uint64_t ticks = (timeout_ms + tw->tick_ms - 1) / tw->tick_ms;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    timer->expires = tw->now + ticks;
+
+    struct tw_timer *slot = &tw->slots[timer->expires % tw->nslots];
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
+
+    ++tw->active;
+}
+
+void tw_timer_del(struct timer_wheel *tw, struct tw_timer *timer) {
+    if (!tw_timer_pending(timer)) {
+        return;
+    }
+    list_unlink(timer);
+    --tw->active;
+}
+
+void tw_tick(struct timer_wheel *tw) {
+    ++tw->now;
+
+    struct tw_timer *slot = &tw->slots[tw->now % tw->nslots];
+
+    // Move expired timers to a private list first, callbacks are free to
+    // add and delete timers, including the ones in this slot.
+    struct tw_timer expired;
+    slot_init(&expired);
+
+    struct tw_timer *timer = slot->next;
+    while (timer != slot) {
+        struct tw_timer *next = timer->next;
+        if (timer->expires <= tw->now) {
+            list_unlink(timer);
+            timer->prev = expired.prev;
+            timer->next = &expired;
+            expired.prev->next = timer;
+            expired.prev = timer;
+        }
+        timer = next;
+    }
+
+    while (expired.next != &expired) {
+        timer = expired.next;
+        list_unlink(timer);
+        --tw->active;
+        timer->cb(timer, timer->arg);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Timer linked into one of the wheel slots. Embedded into the object
+// owning the deadline, the wheel never allocates.
+struct tw_timer {
+    struct tw_timer *prev;
+    struct tw_timer *next;
+
+    // absolute expiry, in wheel ticks
+    uint64_t expires;
+
+    void (*cb)(struct tw_timer *timer, void *arg);
+    void *arg;
+};
+
+// Hashed timer wheel. Timers are hashed into slots by expiry tick, every
+// tick only the current slot is scanned. Timers further away than one
+// revolution stay in their slot until their round comes up.
+//
+// Not thread safe, every loop owns its own wheel.
+struct timer_wheel {
+    struct tw_timer *slots;
+    size_t nslots;
+
+    uint64_t now;
+    unsigned tick_ms;
+
+    size_t active;
+};
+
+void tw_init(struct timer_wheel *tw, size_t nslots, unsigned tick_ms);
+void tw_free(struct timer_wheel *tw);
+
+void tw_timer_init(struct tw_timer *timer,
+                   void (*cb)(struct tw_timer *, void *),
+                   void *arg);
+
+// (Re)arm timer to fire timeout_ms from now, rounded up to whole ticks.
+void tw_timer_add(struct timer_wheel *tw,
+                  struct tw_timer *timer,
+                  unsigned timeout_ms);
+void tw_timer_del(struct timer_wheel *tw, struct tw_timer *timer);
+
+inline bool tw_timer_pending(const struct tw_timer *timer) {
+    return timer->next != NULL;
+}
+
+// Advance the wheel by one tick and run expired timers.
+void tw_tick(struct timer_wheel *tw);
+
+#endif  // _TIMER_WHEEL_H
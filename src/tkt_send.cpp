@@ -45,6 +45,9 @@
     #include <netdb.h>
     #include <unistd.h>
     #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/socket.h>
+    #include <sys/uio.h>
     #include <errno.h>
 
     #define INVALID_SOCKET -1
@@ -62,11 +65,17 @@
 
 #include <string.h>
 #include <string>
+#include <vector>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 
 #include <easylogging/easylogging++.h>
 #include <optionparser/optionparser.h>
 
+#include "frame.h"
+#include "probes.h"
+
 _INITIALIZE_EASYLOGGINGPP
 
 #define ASSERT(cond) \
@@ -104,6 +113,51 @@ static int sendbytes(int sock, const char *buf, int buflen) {
     return buflen;
 }
 
+// Send length prefix and token in a single write, so the frame does not
+// get split into two segments waiting on the peer's delayed ack.
+static bool sendframe(int sock, const unsigned char *hdr,
+                      const char *value, OM_uint32 len) {
+#ifdef _WIN32
+    std::vector<char> frame(FRAME_HDR_LEN + len);
+    memcpy(&frame[0], hdr, FRAME_HDR_LEN);
+    memcpy(&frame[FRAME_HDR_LEN], value, len);
+    return sendbytes(sock, &frame[0], frame.size()) == (int)frame.size();
+#else
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)hdr;
+    iov[0].iov_len = FRAME_HDR_LEN;
+    iov[1].iov_base = (void *)value;
+    iov[1].iov_len = len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t count = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (count == SOCKET_ERROR) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        // skip what was sent, partial writes continue mid iovec
+        while (msg.msg_iovlen > 0 && (size_t)count >= msg.msg_iov->iov_len) {
+            count -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + count;
+            msg.msg_iov->iov_len -= count;
+        }
+    }
+    return true;
+#endif
+}
+
 static int readbytes(int sock, char *buf, int buflen) {
     int bytes_read = 0;
     int bytes_remaining = buflen;
@@ -128,35 +182,25 @@ static bool buffer_write(int sock, const char *value, OM_uint32 len) {
 
     ASSERT(value);
 
-    OM_uint32 network_order_len = htonl(len);
-    int bytes_sent = sendbytes(
-        sock,
-        (const char *)&network_order_len,
-        sizeof(network_order_len)
-    );
-
-    if (bytes_sent != sizeof(len)) {
-        return false;
-    }
-
-    bytes_sent = sendbytes(sock, value, len);
-    if (bytes_sent != len) {
-        return false;
-    }
-
-    return true;
+    unsigned char hdr[FRAME_HDR_LEN];
+    frame_encode_hdr(len, hdr);
+    return sendframe(sock, hdr, value, len);
 }
 
 static bool buffer_read(int sock, void **buf_value, size_t *buf_size) {
 
-    OM_uint32 len;
-    int bytes_read = readbytes(sock, (char *)&len, sizeof(len));
+    unsigned char hdr[FRAME_HDR_LEN];
+    int bytes_read = readbytes(sock, (char *)hdr, sizeof(hdr));
     if (bytes_read <= 0) {
         return false;
     }
 
-    ASSERT(bytes_read == sizeof(len));
-    len = ntohl(len);
+    ASSERT(bytes_read == sizeof(hdr));
+    size_t len = frame_decode_hdr(hdr);
+    if (len > FRAME_MAX_LEN) {
+        LOG(ERROR) << "Token too large: " << len;
+        return false;
+    }
 
     char *value = (char *)malloc(len);
     bytes_read = readbytes(sock, value, len);
@@ -175,11 +219,12 @@ static bool buffer_read(int sock, void **buf_value, size_t *buf_size) {
 struct TktClient {
 
     TktClient(const std::string& hostname_, int port_,
-              const std::string& service_):
+              const std::string& service_, bool low_latency_ = false):
         hostname(hostname_),
         port(port_),
         service(service_),
-        socket(INVALID_SOCKET)
+        socket(INVALID_SOCKET),
+        low_latency(low_latency_)
     {
     }
 
@@ -218,20 +263,27 @@ struct TktClient {
     socket_t socket;
     std::string service;
     std::string sprinc;
+
+    // disable Nagle/delayed ack, use TCP fast open where available
+    bool low_latency;
 };
 
 bool TktClient::success() {
     OM_uint32 ack;
     int bytes_read = readbytes(socket, (char *)&ack, sizeof(ack));
     if (bytes_read <= 0) {
+        TKT_PROBE2(tkt_send, ack, socket, -1);
         return false;
     }
 
     ack = ntohl(ack);
+    TKT_PROBE2(tkt_send, ack, socket, ack);
     return ack == 0;
 }
 
 bool TktClient::connect(int timeout) {
+    TKT_PROBE2(tkt_send, connect_start, hostname.c_str(), port);
+
     // tbd: need to randomize search
     struct sockaddr_in addressconnect;
     socket = ::socket(AF_INET, SOCK_STREAM, 0);
@@ -251,12 +303,27 @@ bool TktClient::connect(int timeout) {
                (size_t)he->h_length);
     }
 
+    if (low_latency) {
+        int on = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY,
+                   (const char *)&on, sizeof(on));
+#ifdef TCP_QUICKACK
+        setsockopt(socket, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+        // First token goes out with the SYN if the server has a cookie.
+        setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+#endif
+    }
+
     if (::connect(socket,
                   (struct sockaddr *)&addressconnect,
                   sizeof(addressconnect)) != 0) {
+        TKT_PROBE2(tkt_send, connect_done, socket, 0);
         closesocket();
         return false;
     }
+    TKT_PROBE2(tkt_send, connect_done, socket, 1);
 
 #ifndef _WIN32
     struct timeval tv = {timeout, 0};
@@ -314,6 +381,7 @@ bool TktClient::handshake() {
     gss_name_t peer_name;
 
     ASSERT(sprinc.size() > 0);
+    TKT_PROBE2(tkt_send, handshake_start, this->socket, sprinc.c_str());
 
     name.value  = (void *)sprinc.c_str();
     name.length = sprinc.size();
@@ -357,11 +425,14 @@ bool TktClient::handshake() {
         if (GSS_ERROR(maj) && ctx == GSS_C_NO_CONTEXT) {
             gss_delete_sec_context(&min, &ctx, GSS_C_NO_BUFFER);
             ctx = GSS_C_NO_CONTEXT;
+            TKT_PROBE2(tkt_send, handshake_done, this->socket, 0);
             return false;
         }
 
         if (maj & GSS_S_CONTINUE_NEEDED) {
             bool rc = gss_buffer_write(this->socket, &gss_buf_out);
+            TKT_PROBE2(tkt_send, token_sent, this->socket,
+                       gss_buf_out.length);
 
             OM_uint32 min;
             gss_release_buffer(&min, &gss_buf_out);
@@ -373,6 +444,8 @@ bool TktClient::handshake() {
             if (!gss_buffer_read(this->socket, &gss_buf_in)) {
                 break;
             }
+            TKT_PROBE2(tkt_send, token_received, this->socket,
+                       gss_buf_in.length);
         }
         else {
             status = true;
@@ -383,6 +456,7 @@ bool TktClient::handshake() {
 
     gss_buffer_free(&gss_buf_in);
     gss_delete_sec_context(&min, &ctx, GSS_C_NO_BUFFER);
+    TKT_PROBE2(tkt_send, handshake_done, this->socket, status);
     return status;
 }
 #endif  // USE_GSSAPI
@@ -591,7 +665,9 @@ enum optionIndex {
     HOST,
     PORT,
     TIMEOUT,
-    PURGE
+    PURGE,
+    LOW_LATENCY,
+    REPEAT
 };
 
 const option::Descriptor usage[] = {
@@ -611,6 +687,11 @@ const option::Descriptor usage[] = {
     {TIMEOUT, 0, "t", "timeout", option::Arg::Optional,
         "  -t<sec>, --timeout=<sec>"
         "  \tSocket recv timeout, defaults 60s." },
+    {LOW_LATENCY, 0, "" , "low-latency", option::Arg::None,
+        "  --low-latency  \tSet TCP_NODELAY/TCP_QUICKACK, use TCP fast open." },
+    {REPEAT, 0, "" , "repeat", option::Arg::Optional,
+        "  --repeat=<n>"
+        "  \tForward tickets <n> times and report per forward latency." },
 #ifdef _WIN32
     {PURGE, 0, "" , "purge", option::Arg::None,
         "  --purge                     \tPurge tickets, forcing renew." },
@@ -621,6 +702,48 @@ const option::Descriptor usage[] = {
     {0, 0, 0, 0, 0, 0}
 };
 
+// Connect, run GSS handshake and wait for the server ack, returns process
+// exit code.
+static int forward_tickets(TktClient& tkt_client, int timeout) {
+    if(!tkt_client.connect(timeout)) {
+        LOG(ERROR) << "Connect failed.";
+        return 1;
+    }
+
+    if (!tkt_client.handshake()) {
+        LOG(ERROR) << "Handshake failed.";
+        return 2;
+    }
+
+    if (!tkt_client.success()) {
+        LOG(ERROR) << "Failed to forward tickets.";
+        return 3;
+    }
+
+    return 0;
+}
+
+static void report_latency(std::vector<double>& latency_ms) {
+    if (latency_ms.empty()) {
+        return;
+    }
+
+    std::sort(latency_ms.begin(), latency_ms.end());
+
+    double total = 0;
+    for (size_t i = 0; i < latency_ms.size(); ++i) {
+        total += latency_ms[i];
+    }
+
+    size_t n = latency_ms.size();
+    LOG(INFO) << "Forwards: " << n
+              << ", min: " << latency_ms[0] << "ms"
+              << ", avg: " << total / n << "ms"
+              << ", p50: " << latency_ms[n / 2] << "ms"
+              << ", p99: " << latency_ms[(n * 99) / 100] << "ms"
+              << ", max: " << latency_ms[n - 1] << "ms";
+}
+
 int main(int argc, char **argv) {
     init_log();
 
@@ -676,6 +799,17 @@ int main(int argc, char **argv) {
         timeout = atoi(options[TIMEOUT].arg);
     }
 
+    bool low_latency = options[LOW_LATENCY];
+
+    int repeat = 1;
+    if (options[REPEAT] && options[REPEAT].arg) {
+        repeat = atoi(options[REPEAT].arg);
+        if (repeat < 1) {
+            LOG(ERROR) << "--repeat must be at least 1.";
+            return -1;
+        }
+    }
+
 #ifdef _WIN32
     if (options[PURGE]) {
         purge_tickets();
@@ -688,26 +822,29 @@ int main(int argc, char **argv) {
     delete[] buffer;
     buffer = NULL;
 
-    TktClient tkt_client(host, port, service);
-
-    if (tkt_client.service.size() == 0) {
+    if (service.size() == 0) {
         option::printUsage(std::cout, usage);
         return -1;
     }
 
-    if(!tkt_client.connect(timeout)) {
-        LOG(ERROR) << "Connect failed.";
-        return 1;
-    }
+    std::vector<double> latency_ms;
+    for (int i = 0; i < repeat; ++i) {
+        TktClient tkt_client(host, port, service, low_latency);
 
-    if (!tkt_client.handshake()) {
-        LOG(ERROR) << "Handshake failed.";
-        return 2;
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        int rc = forward_tickets(tkt_client, timeout);
+        if (rc != 0) {
+            report_latency(latency_ms);
+            return rc;
+        }
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        latency_ms.push_back(elapsed.count());
     }
 
-    if (!tkt_client.success()) {
-        LOG(ERROR) << "Failed to forward tickets.";
-        return 3;
+    if (repeat > 1) {
+        report_latency(latency_ms);
     }
 
     LOG(INFO) << "Tickets forwarded succesfully.";
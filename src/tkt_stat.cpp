@@ -0,0 +1,338 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <easylogging/easylogging++.h>
+#include <optionparser/optionparser.h>
+
+#include "statshm.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+namespace el = easyloggingpp;
+
+void init_log() {
+    el::Configurations log_conf;
+    log_conf.setToDefault();
+    log_conf.setAll(el::ConfigurationType::ToFile, "false");
+    log_conf.setAll(el::ConfigurationType::ToStandardOutput, "true");
+    el::Loggers::reconfigureAllLoggers(log_conf);
+    log_conf.clear();
+}
+
+enum optionIndex {
+    UNKNOWN,
+    HELP,
+    PORT,
+    NAME,
+    INTERVAL,
+    FORWARDS
+};
+const option::Descriptor usage[] = {
+    {UNKNOWN, 0, "" , "" , option::Arg::None,
+        "USAGE: tkt-stat [options]\n\n"
+        "Show live tkt-recv statistics from its shared memory segment.\n\n"
+        "Options:" },
+    {HELP, 0, "" , "help", option::Arg::None,
+        "  --help  \tPrint usage and exit." },
+    {PORT, 0, "p", "port", option::Arg::Optional,
+        "  -p<port>, \t--port=<port>  \ttkt-recv listening on this port." },
+    {NAME, 0, "" , "name", option::Arg::Optional,
+        "  --name=<name>  \tSegment name given to tkt-recv --stats-shm." },
+    {INTERVAL, 0, "i", "interval", option::Arg::Optional,
+        "  -i<sec>, \t--interval=<sec>  \tRepeat every sec seconds." },
+    {FORWARDS, 0, "" , "forwards", option::Arg::Optional,
+        "  --forwards=<n>  \tRecent forwards shown, defaults 10." },
+    {UNKNOWN, 0, "", "", option::Arg::None,
+        "\nExamples:\n"
+        "  tkt-stat --port=<port>\n"
+        "  tkt-stat --port=<port> --interval=1\n" },
+    {0, 0, 0, 0, 0, 0}
+};
+
+static int64_t wall_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double ms(uint64_t us) {
+    return us / 1000.0;
+}
+
+static double hist_avg_ms(const struct latency_hist *hist) {
+    return hist->count ? ms(hist->sum_us / hist->count) : 0;
+}
+
+static void print_forwards(struct statshm_header *hdr, int nshow) {
+    std::vector<struct statshm_forward> recent;
+    std::vector<int> loop_of;
+
+    for (uint32_t l = 0; l < hdr->nloops; ++l) {
+        const struct statshm_loop *loop = &statshm_loops(hdr)[l];
+        const struct statshm_forward *ring = statshm_forwards(hdr, l);
+
+        uint64_t count = __atomic_load_n(&loop->forward_count,
+                                         __ATOMIC_ACQUIRE);
+        uint64_t n = std::min(count, (uint64_t)hdr->nforwards);
+        n = std::min(n, (uint64_t)nshow);
+        for (uint64_t i = 0; i < n; ++i) {
+            struct statshm_forward f;
+            if (!statshm_read(&f, &ring[(count - 1 - i) % hdr->nforwards],
+                              sizeof(f)) || f.seq == 0) {
+                continue;
+            }
+            f.principal[sizeof(f.principal) - 1] = '\0';
+            recent.push_back(f);
+            loop_of.push_back(l);
+        }
+    }
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < recent.size(); ++i) {
+        order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return recent[a].closed_us > recent[b].closed_us;
+    });
+    if (order.size() > (size_t)nshow) {
+        order.resize(nshow);
+    }
+
+    printf("\n%-12s %4s %5s %-12s %8s %8s %8s %8s %8s  %-21s %s\n",
+           "closed", "loop", "fd", "result", "first_ms", "token_ms",
+           "gss_ms", "store_ms", "ack_ms", "peer", "principal");
+    for (size_t i = 0; i < order.size(); ++i) {
+        const struct statshm_forward *f = &recent[order[i]];
+
+        time_t sec = f->closed_us / 1000000;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        char when[16];
+        strftime(when, sizeof(when), "%H:%M:%S", &tm);
+
+        struct in_addr addr;
+        addr.s_addr = f->peer_addr;
+        char peer[32];
+        snprintf(peer, sizeof(peer), "%s:%u", inet_ntoa(addr),
+                 ntohs(f->peer_port));
+
+        printf("%s.%03d %4d %5d %-12s %8.1f %8.1f %8.1f %8.1f %8.1f  "
+               "%-21s %s\n",
+               when, (int)(f->closed_us / 1000 % 1000),
+               loop_of[order[i]], f->fd, forward_result_name(f->result),
+               ms(f->phase_us[PHASE_FIRST_BYTE]),
+               ms(f->phase_us[PHASE_TOKEN_RECV]),
+               ms(f->phase_us[PHASE_GSS_ACCEPT]),
+               ms(f->phase_us[PHASE_STORE]),
+               ms(f->phase_us[PHASE_ACK_DRAIN]),
+               peer, f->principal[0] ? f->principal : "-");
+    }
+}
+
+static void print_loops(struct statshm_header *hdr) {
+    printf("\n%4s %10s %10s %10s %8s %7s %8s %8s %6s %6s %7s %8s  %s\n",
+           "loop", "accepted", "handshakes", "stored", "skipped", "failed",
+           "timeouts", "rejected", "lag_ms", "stalls", "gss_ms", "store_ms",
+           "state");
+    for (uint32_t l = 0; l < hdr->nloops; ++l) {
+        struct statshm_loop loop;
+        if (!statshm_read(&loop, &statshm_loops(hdr)[l], sizeof(loop))) {
+            printf("%4u  (being updated)\n", l);
+            continue;
+        }
+
+        uint64_t stalls = 0;
+        for (int cb = 0; cb < LOOP_CB_COUNT; ++cb) {
+            stalls += loop.stalls[cb];
+        }
+
+        char state[64];
+        if (loop.callback != LOOP_CB_IDLE) {
+            snprintf(state, sizeof(state), "%s %.1f ms",
+                     loop_callback_name(loop.callback), ms(loop.busy_us));
+        }
+        else {
+            snprintf(state, sizeof(state), "idle");
+        }
+        if (loop.accept_paused) {
+            strncat(state, ", accept paused",
+                    sizeof(state) - strlen(state) - 1);
+        }
+
+        printf("%4u %10llu %10llu %10llu %8llu %7llu %8llu %8llu %6llu "
+               "%6llu %7.1f %8.1f  %s\n",
+               l,
+               (unsigned long long)loop.stats.accepted,
+               (unsigned long long)loop.stats.handshakes_ok,
+               (unsigned long long)loop.stats.stores_written,
+               (unsigned long long)loop.stats.stores_skipped,
+               (unsigned long long)loop.stats.store_failures,
+               (unsigned long long)loop.stats.timeouts,
+               (unsigned long long)loop.stats.rejected,
+               (unsigned long long)loop.lag_ms,
+               (unsigned long long)stalls,
+               hist_avg_ms(&loop.hist[PHASE_GSS_ACCEPT]),
+               hist_avg_ms(&loop.hist[PHASE_STORE]),
+               state);
+    }
+}
+
+// Map the segment and print it, false if it can't be read.
+static bool show(const std::string& name, int nforwards) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        LOG(ERROR) << "Unable to open " << name << ": " << strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(struct statshm_header)) {
+        LOG(ERROR) << name << " is not a stats segment.";
+        close(fd);
+        return false;
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOG(ERROR) << "Unable to map " << name << ": " << strerror(errno);
+        return false;
+    }
+    struct statshm_header *hdr = (struct statshm_header *)addr;
+
+    bool ok = false;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != STATSHM_MAGIC) {
+        LOG(ERROR) << name << " is not ready or not a stats segment.";
+    }
+    else if (hdr->version != STATSHM_VERSION) {
+        LOG(ERROR) << name << " has version " << hdr->version
+                   << ", expected " << STATSHM_VERSION;
+    }
+    else if ((size_t)st.st_size < statshm_size(hdr->nloops, hdr->nforwards)) {
+        LOG(ERROR) << name << " is truncated.";
+    }
+    else {
+        ok = true;
+    }
+
+    struct statshm_header h;
+    memcpy(&h, hdr, offsetof(struct statshm_header, seq));
+    if (ok && !statshm_read(&h.seq, &hdr->seq,
+                            sizeof(h) - offsetof(struct statshm_header, seq))) {
+        LOG(ERROR) << name << " header is being updated, try again.";
+        ok = false;
+    }
+
+    if (ok) {
+        int64_t now_us = wall_us();
+        int64_t up = (now_us - h.started_us) / 1000000;
+        printf("tkt-recv pid %d, %s, up %lldd %02lld:%02lld:%02lld, "
+               "published %.1f s ago\n",
+               h.pid, name.c_str(),
+               (long long)(up / 86400), (long long)(up / 3600 % 24),
+               (long long)(up / 60 % 60), (long long)(up % 60),
+               (now_us - h.published_us) / 1e6);
+
+        // The publisher has its own thread, if it is behind the whole
+        // process is stopped or gone.
+        int64_t stale_us = std::max(3 * (int64_t)h.publish_ms * 1000,
+                                    (int64_t)1000000);
+        if (kill(h.pid, 0) != 0 && errno == ESRCH) {
+            printf("WARNING: tkt-recv is not running, stats are stale.\n");
+        }
+        else if (now_us - h.published_us > stale_us) {
+            printf("WARNING: stats not published for %.1f s, tkt-recv is"
+                   " stopped or wedged.\n",
+                   (now_us - h.published_us) / 1e6);
+        }
+
+        printf("workers %lld, token bytes %lld, pending stores %llu, "
+               "spool entries %llu, swept %llu, renewed %llu (%llu failed)\n",
+               (long long)h.live_workers,
+               (long long)h.token_bytes,
+               (unsigned long long)h.pending_stores,
+               (unsigned long long)h.spool_entries,
+               (unsigned long long)h.expired_swept,
+               (unsigned long long)h.renewals,
+               (unsigned long long)h.renewal_failures);
+
+        print_loops(hdr);
+        if (nforwards > 0) {
+            print_forwards(hdr, nforwards);
+        }
+    }
+
+    munmap(addr, st.st_size);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    init_log();
+
+    // skip program name argv[0] if present
+    argc -= (argc > 0);
+    argv += (argc > 0);
+
+    option::Stats  stats(usage, argc, argv);
+    option::Option* options = new option::Option[stats.options_max];
+    option::Option* buffer  = new option::Option[stats.buffer_max];
+
+    option::Parser parse(usage, argc, argv, options, buffer);
+
+    if (parse.error()) {
+        return -1;
+    }
+
+    if (options[HELP] || argc == 0) {
+        option::printUsage(std::cout, usage);
+        return -1;
+    }
+
+    std::string name;
+    if (options[PORT] && options[PORT].arg) {
+        name = STATSHM_PREFIX + std::string(options[PORT].arg);
+    }
+    if (options[NAME] && options[NAME].arg) {
+        name = options[NAME].arg;
+    }
+    if (name.empty()) {
+        LOG(ERROR) << "Either --port or --name is required.";
+        return -1;
+    }
+
+    int interval = 0;
+    if (options[INTERVAL] && options[INTERVAL].arg) {
+        interval = atoi(options[INTERVAL].arg);
+    }
+
+    int nforwards = 10;
+    if (options[FORWARDS] && options[FORWARDS].arg) {
+        nforwards = atoi(options[FORWARDS].arg);
+    }
+
+    // Segment is mapped again every time, tkt-recv may have restarted.
+    for (;;) {
+        bool ok = show(name, nforwards);
+        if (interval <= 0) {
+            return ok ? 0 : 1;
+        }
+        fflush(stdout);
+        sleep(interval);
+        printf("\n");
+    }
+}
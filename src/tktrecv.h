@@ -7,58 +7,342 @@
 
 #include <gssapi/gssapi_generic.h>
 
+#include <pthread.h>
+
+#include <atomic>
 #include <string>
 
+#include "timerwheel.h"
+#include "metrics.h"
+#include "hotlog.h"
+#include "watchdog.h"
+#include "statshm.h"
+
 // libevent
 #include <event.h>
 
+class AcceptorCred;
+class ReplayCache;
 class CredMgr;
+class GroupCommit;
+class Renewer;
+class SpoolIndex;
+class SpoolSweeper;
+class WorkPool;
+struct work_job;
+struct store_coalescer;
+
+// When spool writes are made durable before the client is acked.
+enum durability_mode {
+    // never fsync, a crash can lose recently acked tickets
+    DURABILITY_NONE,
+    // fsync every ccache and the spool directory
+    DURABILITY_FILE,
+    // sync spool filesystem once per batch of stores
+    DURABILITY_GROUP
+};
+
+// Whether a credential manager fsyncs the ccaches it writes. With group
+// durability, writers whose results go through GroupCommit leave it the
+// sync, writers outside it (renewals) sync their own.
+inline bool durability_sync_writes(durability_mode mode,
+                                   bool group_committed) {
+    return mode == DURABILITY_FILE ||
+           (mode == DURABILITY_GROUP && !group_committed);
+}
+
+// What happens to spool files whose TGT and renewal have lapsed.
+enum expired_mode {
+    // leave them in the spool, no sweeper
+    EXPIRED_KEEP,
+    EXPIRED_DELETE,
+    // move them to <spool dir>/.tkt-expired
+    EXPIRED_QUARANTINE
+};
+
+struct server_config {
+    server_config();
+
+    int port;
+    std::string tkt_spool_dir;
+
+    // number of independent event loops, each with own listener
+    int threads;
+    // pin loop N to cpu N (modulo number of online cpus)
+    bool pin_cpus;
+
+    // threads running CredMgr::store_creds, 0 - store on the loop thread
+    int store_threads;
+    // stores queued to the pool before new stores are rejected
+    int max_pending_stores;
+
+    // threads running gss_accept_sec_context, 0 - accept on the loop thread
+    int crypto_threads;
+    // handshakes queued to the crypto pool before accepting inline
+    int max_pending_accepts;
+
+    // listen(2) backlog of every loop's listener
+    int listen_backlog;
+    // connections accepted per listener wakeup
+    int accept_batch;
+
+    // seconds between loop stats log lines, 0 - disabled
+    int stats_interval;
+
+    // max time without progress from the peer, 0 - no limit
+    unsigned idle_timeout_ms;
+    // max time from accept to ack, 0 - no limit
+    unsigned handshake_timeout_ms;
+
+    // largest GSS token accepted from the peer
+    size_t max_token_size;
+
+    // TCP_NODELAY/TCP_QUICKACK on connections, TCP_DEFER_ACCEPT and
+    // TCP_FASTOPEN on listeners
+    bool low_latency;
+
+    // max time to wait for the peer's FIN after the ack is sent
+    unsigned close_drain_ms;
+
+    // admission control, 0 - no limit
+    int max_handshakes;
+    size_t max_token_memory;
+    unsigned max_loop_lag_ms;
+    // when overloaded reset new connections instead of pausing accept
+    bool overload_reject;
+
+    // acquire acceptor credential from in-memory copy of the keytab
+    bool preload_keytab;
+    // keytab name, empty - krb5 default keytab
+    std::string keytab;
+    // load only this principal's keys, empty - all principals
+    std::string acceptor_principal;
+    // seconds between keytab change checks, 0 - never reload
+    int keytab_check_interval;
+
+    // check authenticators in tkt-recv's own replay cache instead of the
+    // krb5 file replay cache
+    bool builtin_rcache;
+    // file backing the replay cache, empty - memory only
+    std::string rcache_path;
+    size_t rcache_slots;
+    // seconds an authenticator is remembered, should cover clock skew
+    unsigned rcache_lifetime;
+
+    // serialize ccaches in memory and write them in one go, false - write
+    // through the krb5 FILE ccache backend
+    bool native_ccache_writer;
+
+    durability_mode durability;
+    // how long the commit thread waits for more stores before syncing
+    unsigned group_commit_ms;
+
+    // don't rewrite spool files with the same or older TGT
+    bool skip_unchanged;
+
+    // collapse concurrent stores of the same principal into one write
+    bool coalesce_stores;
+
+    // spool index snapshot, empty - don't persist the index
+    std::string index_snapshot;
+    // seconds between snapshot saves, 0 - only on exit
+    int index_snapshot_interval;
+
+    expired_mode expired;
+    // sweeper tick and number of files removed per tick at most
+    unsigned sweep_interval_ms;
+    unsigned sweep_batch;
+
+    // local metrics listener, port 0 - disabled
+    std::string metrics_addr;
+    int metrics_port;
+
+    // renew renewable TGTs in the spool with the KDC before they expire
+    bool renew;
+    // seconds before TGT expiry to renew, plus up to renew_jitter seconds
+    int renew_before;
+    int renew_jitter;
+    // renewals running at the same time at most
+    int renew_concurrency;
+
+    // loop callbacks running longer are logged and counted as stalls,
+    // 0 - no stall tracking
+    unsigned stall_ms;
+
+    // shared memory stats segment name, empty - not published
+    std::string stats_shm;
+    // recent forwards kept per loop
+    unsigned stats_forwards;
+    unsigned stats_publish_ms;
+};
+
+// Accepting resumes once load drops below this share of every limit.
+#define ADMISSION_RESUME_PCT 75
+
+// Listener is left alone this long after accept fails with anything but
+// an empty queue, e.g. out of file descriptors.
+#define ACCEPT_RETRY_MS 100
+
+// Server wide load, shared by all loops.
+struct server_load {
+    std::atomic<long> live_workers;
+    std::atomic<long> token_bytes;
+    int nloops;
+    // loops whose listener is open, see pause_accept()
+    std::atomic<int> listening;
+    // set on SIGTERM or SIGINT, loops exit on their next wheel tick
+    std::atomic<bool> stopping;
+};
+
+// Cached workers kept by every loop.
+#define MAX_FREE_WORKERS  1024
+
+struct worker;
+
+// Per loop free list of workers, only used on the loop thread.
+struct worker_pool {
+    struct worker *free_workers;
+    size_t nfree_workers;
+};
+
+// Connection deadlines are kept in per loop timer wheel.
+#define WHEEL_SLOTS   512
+#define WHEEL_TICK_MS 100
+
+// Event loop state, owned by a single thread. Every loop has its own
+// SO_REUSEPORT listener, event base and credential manager (krb5 context),
+// so loops never share state on the connection path.
+struct server_loop {
+    int id;
+    int cpu;
+    // -1 while a paused loop has handed its share to the other loops
+    int listen_fd;
+
+    struct event_base *evbase;
+    struct event *accept_event;
+    int accept_paused;
+    // re-arms the listener after an accept error, see on_accept()
+    struct event *accept_retry_event;
+    int accept_backoff;
+
+    struct server_stats stats;
+    struct latency_hist hist[PHASE_COUNT];
+    struct loop_activity activity;
+    // stats segment, NULL - not published
+    struct statshm_loop *shm;
+    struct statshm_forward *shm_forwards;
+    unsigned shm_nforwards;
+    struct server_load *load;
+    // how late the last wheel tick fired
+    uint64_t lag_ms;
+
+    struct timer_wheel wheel;
+    uint64_t wheel_ms;
+
+    struct worker_pool pool;
+
+    CredMgr *cred_mgr;
+    WorkPool *store_pool;
+    WorkPool *crypto_pool;
+    GroupCommit *group_commit;
+    SpoolIndex *spool_index;
+    struct store_coalescer *coalescer;
+    AcceptorCred *acceptor;
+    // keytab reload job queued, first loop only
+    int keytab_reloading;
+    ReplayCache *rcache;
+    const server_config *config;
+
+    // completions posted back from pool threads
+    pthread_mutex_t mailbox_lock;
+    struct work_job *mailbox_head;
+    struct work_job *mailbox_tail;
+    int mailbox_fd;
+    struct event *mailbox_event;
+
+    pthread_t thread;
+};
 
 struct worker {
-    // used to schedule handshake callbacks
+    // owning loop, all worker callbacks run on loop's thread
     //
-    const CredMgr *cred_mgr;
-
-    struct event *ev;
+    struct server_loop *loop;
 
     struct bufferevent *buf_network;
 
     int network_fd;
 
+    // idle/handshake deadline, wheel tick of accept
+    struct tw_timer deadline;
+    uint64_t started_tick;
+
     // for server
     struct sockaddr_in peeraddr;
 
+    // phase start times for latency histograms, monotonic_us(), 0 - not
+    // started or already recorded
+    uint64_t accepted_us;
+    uint64_t token_start_us;
+    uint64_t ack_start_us;
+    // gss_accept_sec_context duration, measured where it ran
+    uint64_t gss_accept_us;
+
+    // forward summary for the stats segment: time spent in every phase,
+    // forward_result and the client principal once authenticated
+    uint32_t phase_us[PHASE_COUNT];
+    int result;
+    char principal[STATSHM_PRINCIPAL];
+
+    // input token, points into the bufferevent's input buffer
     gss_buffer_desc gss_buf_in;
-    void  *gss_buf_in_value;
-    size_t gss_buf_in_read;
 
-    size_t gss_buf_in_len;
-    size_t gss_buf_in_len_read;
-    char gss_buf_len_buf[4];
+    // length of the frame being received, valid once header is read
+    size_t frame_len;
+    int frame_hdr_read;
 
     gss_name_t peer_name;
 	gss_ctx_id_t ctx;
+
+    // gss_accept_sec_context result, filled in by accept_sec_context()
+    OM_uint32 accept_maj;
+    OM_uint32 accept_min;
+    gss_buffer_desc gss_buf_out;
+    gss_cred_id_t client_creds;
+    // replay cache entry of the initial token, dropped if accept fails
+    uint64_t rcache_key;
+    // initial token was replayed or could not be checked
+    int rcache_reject;
+    // replay cache had no room for the initial token
+    int rcache_full;
+
+    // number of jobs in flight on pool threads, worker can't be freed
+    // until they complete
+    int pending;
+    // connection failed while job was in flight, free on completion
+    int closing;
+
+    // link in the loop's free list
+    struct worker *next_free;
 };
 
-struct worker *alloc_worker();
+struct worker *alloc_worker(struct server_loop *loop);
 void free_worker(struct worker *w);
 void release_worker(struct worker *w);
 void worker_bufferevent_free(struct worker *w, struct bufferevent *buf);
 void worker_fd_close(struct worker *w, int fd);
+void worker_pool_free(struct server_loop *loop);
 
-int  set_so_linger(int socket);
+int  set_low_latency(int socket);
 void gss_buffer_write(struct bufferevent *bev, gss_buffer_t gss_buf);
-void gss_buffer_read(struct bufferevent *bev, struct worker *w);
+int  gss_buffer_read(struct bufferevent *bev, struct worker *w);
+void gss_buffer_consume(struct bufferevent *bev, struct worker *w);
 void ack_write(struct bufferevent *bev, uint32_t ack);
-int run_server(int port, const std::string& tkt_spool_dir);
+int run_server(const server_config& config);
 void display_status(const char *msg, OM_uint32 maj_stat, OM_uint32 min_stat);
 
-extern struct event_base *g_evbase;
-
 #define HANDSHAKE_OK(major, minor, h) \
     if (GSS_ERROR(major)) {     \
-        LOG(INFO) << "major: " << major << ", minor: " << minor; \
-        close(h->network_fd);   \
+        HLOG(INFO) << "major: " << major << ", minor: " << minor; \
         free_worker(h);      \
         return;                 \
     }
@@ -1,28 +1,58 @@
 #include "tktrecv.h"
+#include "frame.h"
+#include "probes.h"
+#include "statsegment.h"
 
 #include <assert.h>
+#include <string.h>
+#include <netinet/tcp.h>
 
 #include <gssapi/gssapi_krb5.h>
 #include <easylogging/easylogging++.h>
 
-int set_so_linger(int socket) {
-    struct linger so_linger;
-
-    so_linger.l_onoff = 1;
-    so_linger.l_linger = 30;
-    return setsockopt(socket,
-            SOL_SOCKET,
-            SO_LINGER,
-            (const char *)&so_linger,
-            sizeof so_linger
-            );
+// Disable Nagle and delayed ack, token and ack frames are written as a
+// single buffer and must go out immediately.
+int set_low_latency(int socket) {
+    int on = 1;
+    int rc = setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (rc == 0) {
+        rc = setsockopt(socket, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+    return rc;
 }
 
-struct worker *alloc_worker() {
-    struct worker *h = (struct worker *)calloc(1, sizeof(struct worker));
+struct worker *alloc_worker(struct server_loop *loop) {
+    struct worker_pool *pool = &loop->pool;
+
+    struct worker *h = pool->free_workers;
+    if (h) {
+        pool->free_workers = h->next_free;
+        --pool->nfree_workers;
+        h->next_free = NULL;
+    }
+    else {
+        h = (struct worker *)calloc(1, sizeof(struct worker));
+        if (h == NULL) {
+            return NULL;
+        }
+    }
+
+    h->loop = loop;
+    h->network_fd = -1;
     return h;
 }
 
+void worker_pool_free(struct server_loop *loop) {
+    struct worker_pool *pool = &loop->pool;
+
+    while (pool->free_workers) {
+        struct worker *h = pool->free_workers;
+        pool->free_workers = h->next_free;
+        free(h);
+    }
+    pool->nfree_workers = 0;
+}
+
 void display_status_1(const char *m, OM_uint32 code, int type) {
     OM_uint32 maj_stat, min_stat;
     gss_buffer_desc msg;
@@ -34,7 +64,7 @@ void display_status_1(const char *m, OM_uint32 code, int type) {
                 &min_stat, code,
                 type, GSS_C_NULL_OID,
                 &msg_ctx, &msg);
-        LOG(INFO) << "GSS-API error " << m << ": " << (const char *)msg.value;
+        HLOG(INFO) << "GSS-API error " << m << ": " << (const char *)msg.value;
         gss_release_buffer(&min_stat, &msg);
 
         if (!msg_ctx)
@@ -50,18 +80,18 @@ void display_status(const char *msg, OM_uint32 maj_stat, OM_uint32 min_stat) {
 void release_worker(struct worker *w) {
 
     OM_uint32 min;
-    if (w->ev) {
-        event_free(w->ev);
+
+    if (w->loop) {
+        tw_timer_del(&w->loop->wheel, &w->deadline);
+        if (w->frame_hdr_read) {
+            w->loop->load->token_bytes -= w->frame_len;
+            w->frame_hdr_read = 0;
+        }
     }
 
     worker_bufferevent_free(w, w->buf_network);
     worker_fd_close(w, w->network_fd);
 
-    if (w->gss_buf_in_value) {
-        free(w->gss_buf_in_value);
-        w->gss_buf_in_value = NULL;
-    }
-
     if (w->peer_name) {
         gss_release_name(&min, &(w->peer_name));
     }
@@ -69,11 +99,36 @@ void release_worker(struct worker *w) {
     if (w->ctx) {
         gss_delete_sec_context(&min, &(w->ctx), GSS_C_NO_BUFFER);
     }
+
+    if (w->gss_buf_out.value) {
+        gss_release_buffer(&min, &(w->gss_buf_out));
+    }
+
+    if (w->client_creds) {
+        gss_release_cred(&min, &(w->client_creds));
+    }
 }
 
+// Release worker resources and return it to the loop's free list.
 void free_worker(struct worker *w) {
+    LoopActivity busy(&w->loop->activity, LOOP_CB_CLOSE);
+    TKT_PROBE1(tkt_recv, close, w->network_fd);
+    stats_record_forward(w);
     release_worker(w);
-    free(w);
+
+    struct server_loop *loop = w->loop;
+    --loop->load->live_workers;
+
+    struct worker_pool *pool = &loop->pool;
+    if (pool->nfree_workers >= MAX_FREE_WORKERS) {
+        free(w);
+        return;
+    }
+
+    memset(w, 0, sizeof(*w));
+    w->next_free = pool->free_workers;
+    pool->free_workers = w;
+    ++pool->nfree_workers;
 }
 
 void worker_bufferevent_free(struct worker *w, struct bufferevent *buf) {
@@ -83,6 +138,8 @@ void worker_bufferevent_free(struct worker *w, struct bufferevent *buf) {
     assert(w);
     if(buf == w->buf_network) {
         w->buf_network = NULL;
+        // socket is closed together with the bufferevent
+        w->network_fd = -1;
     }
     else {
         assert("invalid argument");
@@ -105,77 +162,101 @@ void worker_fd_close(struct worker *w, int fd) {
     close(fd);
 }
 
-void gss_buffer_read(struct bufferevent *bev, struct worker *w) {
+// Frame length prefixed token. The read watermark is set to the exact
+// frame length, so the callback runs once the whole token is buffered, and
+// GSS gets a contiguous view of the token inside the input evbuffer.
+// Returns -1 if the peer sent an empty token or one larger than the
+// configured limit, the caller must close the connection.
+int gss_buffer_read(struct bufferevent *bev, struct worker *w) {
     struct evbuffer *input  = bufferevent_get_input(bev);
-    size_t input_len;
+    size_t input_len = evbuffer_get_length(input);
 
-    gss_buffer_t gss_buf = &(w->gss_buf_in);
-    if (gss_buf->length == 0) {
+    if (w->gss_buf_in.value != NULL) {
+        return -1;
+    }
+
+    if (!w->frame_hdr_read) {
+        if (input_len < FRAME_HDR_LEN) {
+            return 0;
+        }
 
-        size_t in_buffer_len = evbuffer_get_length(input);
-        if (in_buffer_len >= 4 - w->gss_buf_in_len_read) {
-            evbuffer_remove(input,
-                            w->gss_buf_len_buf + w->gss_buf_in_len_read,
-                            4 - w->gss_buf_in_len_read);
-            w->gss_buf_in_len_read = 4;
+        unsigned char hdr[FRAME_HDR_LEN];
+        evbuffer_copyout(input, hdr, FRAME_HDR_LEN);
+        size_t len = frame_decode_hdr(hdr);
+        // There is no empty GSS token, and it would leave gss_buf_in
+        // NULL with the header consumed.
+        if (len == 0) {
+            HLOG(ERROR) << "Empty token.";
+            return -1;
         }
-        else {
-            evbuffer_remove(input,
-                            w->gss_buf_len_buf + w->gss_buf_in_len_read,
-                            in_buffer_len);
-            w->gss_buf_in_len_read += in_buffer_len;
-            return;
+        if (len > w->loop->config->max_token_size) {
+            HLOG(ERROR) << "Token too large: " << len;
+            STAT_INC(w->loop->stats.oversized_tokens);
+            return -1;
         }
 
-        if (w->gss_buf_in_len_read == 4) {
+        size_t budget = w->loop->config->max_token_memory;
+        long token_bytes = (w->loop->load->token_bytes += len);
+        if (budget > 0 && (size_t)token_bytes > budget) {
+            w->loop->load->token_bytes -= len;
+            HLOG(ERROR) << "Token memory budget exceeded: " << token_bytes;
+            STAT_INC(w->loop->stats.token_memory_rejects);
+            return -1;
+        }
 
-            w->gss_buf_in_read = 0;
-            w->gss_buf_in_len_read = 0;
-            gss_buf->length = ntohl(*(OM_uint32 *)(w->gss_buf_len_buf));
+        evbuffer_drain(input, FRAME_HDR_LEN);
+        input_len -= FRAME_HDR_LEN;
 
-            // allocate memory to receive the buffer
-            if (w->gss_buf_in_len < gss_buf->length) {
-                w->gss_buf_in_value = realloc(w->gss_buf_in_value,
-                                              gss_buf->length);
-                ASSERT(w->gss_buf_in_value, w);
-                w->gss_buf_in_len = gss_buf->length;
-            }
-        }
+        w->frame_len = len;
+        w->frame_hdr_read = 1;
+        bufferevent_setwatermark(bev, EV_READ, len, 0);
     }
 
-    // at this point memory is allocated for the buffer to be received
-    ASSERT(gss_buf->value == NULL, w);
-    while(input_len = evbuffer_get_length(input)) {
-        size_t bytes_to_remove  = input_len;
-        if (input_len > gss_buf->length - w->gss_buf_in_read) {
-            bytes_to_remove = gss_buf->length - w->gss_buf_in_read;
-        }
+    if (input_len < w->frame_len) {
+        return 0;
+    }
 
-        w->gss_buf_in_read += evbuffer_remove(
-                input,
-                (char *)w->gss_buf_in_value + w->gss_buf_in_read,
-                bytes_to_remove
-                );
+    w->gss_buf_in.value = evbuffer_pullup(input, w->frame_len);
+    w->gss_buf_in.length = w->frame_len;
+    if (w->gss_buf_in.value == NULL) {
+        return -1;
+    }
+    return 0;
+}
 
-        if (gss_buf->length == w->gss_buf_in_read) {
-            gss_buf->value = w->gss_buf_in_value;
-            bufferevent_setwatermark(bev, EV_READ, 4, 0);
-            break;
-        }
+// Drop the token handed out by gss_buffer_read() and wait for the next
+// frame header.
+void gss_buffer_consume(struct bufferevent *bev, struct worker *w) {
+    struct evbuffer *input  = bufferevent_get_input(bev);
+
+    if (w->gss_buf_in.value) {
+        // Tokens carry Kerberos AP-REQs, don't leave them around in
+        // free memory.
+        explicit_bzero(w->gss_buf_in.value, w->gss_buf_in.length);
     }
+    evbuffer_drain(input, w->frame_len);
+    if (w->frame_hdr_read) {
+        w->loop->load->token_bytes -= w->frame_len;
+    }
+
+    w->gss_buf_in.value = NULL;
+    w->gss_buf_in.length = 0;
+    w->frame_len = 0;
+    w->frame_hdr_read = 0;
+    bufferevent_setwatermark(bev, EV_READ, FRAME_HDR_LEN, 0);
 }
 
 void gss_buffer_write(struct bufferevent *bev, gss_buffer_t gss_buf) {
     struct evbuffer *output = bufferevent_get_output(bev);
-    uint32_t len = gss_buf->length;
+    unsigned char hdr[FRAME_HDR_LEN];
     OM_uint32 min;
     int res;
 
     assert(gss_buf->value);
 
-    len = htonl(len);
+    frame_encode_hdr(gss_buf->length, hdr);
 
-    res = evbuffer_add(output, (void *)&len, sizeof(len));
+    res = evbuffer_add(output, hdr, sizeof(hdr));
     res = evbuffer_add(output, gss_buf->value, gss_buf->length);
 
     gss_release_buffer(&min, gss_buf);
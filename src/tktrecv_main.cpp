@@ -1,5 +1,7 @@
 #include "tktrecv.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <easylogging/easylogging++.h>
 #include <optionparser/optionparser.h>
@@ -17,9 +19,60 @@ void init_log() {
     log_conf.clear();
 }
 
-struct event_base* g_evbase = NULL;
-
-enum optionIndex {UNKNOWN, HELP, PORT, SPOOL_DIR};
+enum optionIndex {
+    UNKNOWN,
+    HELP,
+    PORT,
+    SPOOL_DIR,
+    THREADS,
+    PIN_CPUS,
+    STORE_THREADS,
+    MAX_PENDING_STORES,
+    CRYPTO_THREADS,
+    MAX_PENDING_ACCEPTS,
+    BACKLOG,
+    ACCEPT_BATCH,
+    STATS_INTERVAL,
+    IDLE_TIMEOUT,
+    HANDSHAKE_TIMEOUT,
+    MAX_TOKEN_SIZE,
+    LOW_LATENCY,
+    CLOSE_DRAIN,
+    MAX_HANDSHAKES,
+    MAX_TOKEN_MEMORY,
+    MAX_LOOP_LAG,
+    OVERLOAD_REJECT,
+    KEYTAB,
+    PRINCIPAL,
+    NO_PRELOAD_KEYTAB,
+    KEYTAB_CHECK_INTERVAL,
+    REPLAY_CACHE,
+    REPLAY_CACHE_SLOTS,
+    REPLAY_LIFETIME,
+    CCACHE_WRITER,
+    DURABILITY,
+    GROUP_COMMIT_WINDOW,
+    ALWAYS_REWRITE,
+    NO_COALESCE_STORES,
+    INDEX_SNAPSHOT,
+    INDEX_SNAPSHOT_INTERVAL,
+    EXPIRED,
+    SWEEP_INTERVAL,
+    SWEEP_BATCH,
+    METRICS,
+    LOG_MODE,
+    LOG_RATE,
+    LOG_SAMPLE,
+    LOG_BUFFER,
+    RENEW,
+    RENEW_BEFORE,
+    RENEW_JITTER,
+    RENEW_CONCURRENCY,
+    STALL_THRESHOLD,
+    STATS_SHM,
+    STATS_FORWARDS,
+    STATS_PUBLISH_INTERVAL
+};
 const option::Descriptor usage[] = {
     {UNKNOWN, 0, "" , "" , option::Arg::None,
         "USAGE: tkt-send [options] <host:port> <user/host>@<host-realm>\n\n"
@@ -30,6 +83,159 @@ const option::Descriptor usage[] = {
         "  -p<port>, --port=<port>  \tServer port." },
     {SPOOL_DIR, 0, "d", "dir", option::Arg::Optional,
         "  -d<dir>, --dir=<dir>  \tTicket spool directory." },
+    {THREADS, 0, "t", "threads", option::Arg::Optional,
+        "  -t<n>, --threads=<n>  \tNumber of event loops, 0 - one per cpu,"
+        " defaults 1." },
+    {PIN_CPUS, 0, "" , "pin-cpus", option::Arg::None,
+        "  --pin-cpus  \tPin each event loop thread to its own cpu." },
+    {STORE_THREADS, 0, "" , "store-threads", option::Arg::Optional,
+        "  --store-threads=<n>  \tThreads writing ticket caches, 0 - write"
+        " on the event loop, defaults 2." },
+    {MAX_PENDING_STORES, 0, "" , "max-pending-stores", option::Arg::Optional,
+        "  --max-pending-stores=<n>  \tQueued stores before new forwards are"
+        " rejected, defaults 1024." },
+    {CRYPTO_THREADS, 0, "" , "crypto-threads", option::Arg::Optional,
+        "  --crypto-threads=<n>  \tThreads accepting GSS handshakes, 0 -"
+        " accept on the event loop, defaults 2." },
+    {MAX_PENDING_ACCEPTS, 0, "" , "max-pending-accepts", option::Arg::Optional,
+        "  --max-pending-accepts=<n>  \tQueued handshakes before accepting"
+        " on the event loop, defaults 1024." },
+    {BACKLOG, 0, "" , "backlog", option::Arg::Optional,
+        "  --backlog=<n>  \tListen backlog of every event loop, defaults"
+        " 1024." },
+    {ACCEPT_BATCH, 0, "" , "accept-batch", option::Arg::Optional,
+        "  --accept-batch=<n>  \tConnections accepted per wakeup, defaults"
+        " 64." },
+    {STATS_INTERVAL, 0, "" , "stats-interval", option::Arg::Optional,
+        "  --stats-interval=<sec>  \tLog event loop stats every <sec>"
+        " seconds." },
+    {IDLE_TIMEOUT, 0, "" , "idle-timeout", option::Arg::Optional,
+        "  --idle-timeout=<ms>  \tClose connections idle for <ms>, 0 - no"
+        " limit, defaults 10000." },
+    {HANDSHAKE_TIMEOUT, 0, "" , "handshake-timeout", option::Arg::Optional,
+        "  --handshake-timeout=<ms>  \tClose connections not done within"
+        " <ms>, 0 - no limit, defaults 30000." },
+    {MAX_TOKEN_SIZE, 0, "" , "max-token-size", option::Arg::Optional,
+        "  --max-token-size=<bytes>  \tLargest GSS token accepted, defaults"
+        " 65536." },
+    {LOW_LATENCY, 0, "" , "low-latency", option::Arg::None,
+        "  --low-latency  \tSet TCP_NODELAY/TCP_QUICKACK on connections,"
+        " TCP_DEFER_ACCEPT/TCP_FASTOPEN on listeners." },
+    {CLOSE_DRAIN, 0, "" , "close-drain", option::Arg::Optional,
+        "  --close-drain=<ms>  \tTime to wait for the client to close after"
+        " the ack, defaults 2000." },
+    {MAX_HANDSHAKES, 0, "" , "max-handshakes", option::Arg::Optional,
+        "  --max-handshakes=<n>  \tConcurrent connections before accepting"
+        " stops, 0 - no limit, defaults 10000." },
+    {MAX_TOKEN_MEMORY, 0, "" , "max-token-memory", option::Arg::Optional,
+        "  --max-token-memory=<bytes>  \tMemory for received tokens, 0 - no"
+        " limit, defaults 64MB." },
+    {MAX_LOOP_LAG, 0, "" , "max-loop-lag", option::Arg::Optional,
+        "  --max-loop-lag=<ms>  \tEvent loop lag before accepting stops,"
+        " 0 - no limit, defaults 1000." },
+    {OVERLOAD_REJECT, 0, "" , "overload-reject", option::Arg::None,
+        "  --overload-reject  \tReset new connections when overloaded"
+        " instead of pausing accept." },
+    {KEYTAB, 0, "k", "keytab", option::Arg::Optional,
+        "  -k<keytab>, --keytab=<keytab>  \tAcceptor keytab, defaults to the"
+        " krb5 default keytab." },
+    {PRINCIPAL, 0, "" , "principal", option::Arg::Optional,
+        "  --principal=<princ>  \tAccept only for this service principal." },
+    {NO_PRELOAD_KEYTAB, 0, "" , "no-preload-keytab", option::Arg::None,
+        "  --no-preload-keytab  \tRead the keytab on every handshake." },
+    {KEYTAB_CHECK_INTERVAL, 0, "" , "keytab-check-interval",
+        option::Arg::Optional,
+        "  --keytab-check-interval=<sec>  \tReload keytab if changed, 0 -"
+        " never, defaults 10." },
+    {REPLAY_CACHE, 0, "" , "replay-cache", option::Arg::Optional,
+        "  --replay-cache=<type>  \tkrb5 - krb5 replay cache, memory -"
+        " built-in cache, file:<path> - built-in cache persisted in <path>,"
+        " defaults krb5." },
+    {REPLAY_CACHE_SLOTS, 0, "" , "replay-cache-slots", option::Arg::Optional,
+        "  --replay-cache-slots=<n>  \tAuthenticators kept by the built-in"
+        " replay cache, defaults 1048576." },
+    {REPLAY_LIFETIME, 0, "" , "replay-lifetime", option::Arg::Optional,
+        "  --replay-lifetime=<sec>  \tTime authenticators are kept by the"
+        " built-in replay cache, defaults 600." },
+    {CCACHE_WRITER, 0, "" , "ccache-writer", option::Arg::Optional,
+        "  --ccache-writer=<type>  \tnative - serialize ticket caches in"
+        " memory and write them at once, krb5 - write through the krb5 FILE"
+        " ccache, defaults native." },
+    {DURABILITY, 0, "" , "durability", option::Arg::Optional,
+        "  --durability=<mode>  \tnone - never fsync, file - fsync every"
+        " ticket cache before the ack, group - sync stores in batches before"
+        " their acks, a failed batch sync nacks stores that are already in"
+        " the spool, defaults none." },
+    {GROUP_COMMIT_WINDOW, 0, "" , "group-commit-window",
+        option::Arg::Optional,
+        "  --group-commit-window=<ms>  \tTime to collect stores into one"
+        " sync, defaults 2." },
+    {ALWAYS_REWRITE, 0, "" , "always-rewrite", option::Arg::None,
+        "  --always-rewrite  \tRewrite ticket caches even if the spool"
+        " already has the same or newer tickets." },
+    {NO_COALESCE_STORES, 0, "" , "no-coalesce-stores", option::Arg::None,
+        "  --no-coalesce-stores  \tWrite every forward, even if another"
+        " forward of the same principal is pending." },
+    {INDEX_SNAPSHOT, 0, "" , "index-snapshot", option::Arg::Optional,
+        "  --index-snapshot=<path>  \tSpool index snapshot, loaded on start,"
+        " not persisted by default. Keep it out of world writable"
+        " directories." },
+    {INDEX_SNAPSHOT_INTERVAL, 0, "" , "index-snapshot-interval",
+        option::Arg::Optional,
+        "  --index-snapshot-interval=<sec>  \tSave spool index snapshot, 0 -"
+        " only on exit, defaults 60." },
+    {EXPIRED, 0, "" , "expired", option::Arg::Optional,
+        "  --expired=<action>  \tdelete - remove ticket caches past their"
+        " renewal time, quarantine - move them to <dir>/.tkt-expired,"
+        " keep - leave them, defaults keep." },
+    {SWEEP_INTERVAL, 0, "" , "sweep-interval", option::Arg::Optional,
+        "  --sweep-interval=<ms>  \tTime between expired ticket cache sweeps,"
+        " defaults 1000." },
+    {SWEEP_BATCH, 0, "" , "sweep-batch", option::Arg::Optional,
+        "  --sweep-batch=<n>  \tExpired ticket caches removed per sweep at"
+        " most, defaults 64." },
+    {METRICS, 0, "" , "metrics", option::Arg::Optional,
+        "  --metrics=<[addr:]port>  \tServe Prometheus metrics on"
+        " http://<addr>:<port>/metrics, addr defaults 127.0.0.1." },
+    {LOG_MODE, 0, "" , "log", option::Arg::Optional,
+        "  --log=<mode>  \tsync - connection logs are written by the thread"
+        " handling the connection, async - queued to a writer thread and"
+        " dropped if the queue is full, defaults sync." },
+    {LOG_RATE, 0, "" , "log-rate", option::Arg::Optional,
+        "  --log-rate=<n>  \tConnection log lines per second from each"
+        " log statement, 0 - unlimited, defaults 0." },
+    {LOG_SAMPLE, 0, "" , "log-sample", option::Arg::Optional,
+        "  --log-sample=<n>  \tOver the rate, log one in every n lines, 0 -"
+        " none, defaults 0." },
+    {LOG_BUFFER, 0, "" , "log-buffer", option::Arg::Optional,
+        "  --log-buffer=<n>  \tLines queued for the async log writer,"
+        " defaults 8192." },
+    {RENEW, 0, "" , "renew", option::Arg::None,
+        "  --renew  \tRenew renewable tickets in the spool with the KDC"
+        " before they expire." },
+    {RENEW_BEFORE, 0, "" , "renew-before", option::Arg::Optional,
+        "  --renew-before=<sec>  \tRenew tickets this long before they"
+        " expire, defaults 3600." },
+    {RENEW_JITTER, 0, "" , "renew-jitter", option::Arg::Optional,
+        "  --renew-jitter=<sec>  \tSpread renewals over this many extra"
+        " seconds, defaults 600." },
+    {RENEW_CONCURRENCY, 0, "" , "renew-concurrency", option::Arg::Optional,
+        "  --renew-concurrency=<n>  \tRenewals in flight at most, defaults"
+        " 4." },
+    {STALL_THRESHOLD, 0, "" , "stall-threshold", option::Arg::Optional,
+        "  --stall-threshold=<ms>  \tLog and count event loop callbacks"
+        " running longer, 0 - disabled, defaults 200." },
+    {STATS_SHM, 0, "" , "stats-shm", option::Arg::Optional,
+        "  --stats-shm=<name>  \tShared memory segment the stats for"
+        " tkt-stat are published in, none - disabled, defaults"
+        " " STATSHM_PREFIX "<port>." },
+    {STATS_FORWARDS, 0, "" , "stats-forwards", option::Arg::Optional,
+        "  --stats-forwards=<n>  \tRecent forwards kept per event loop in"
+        " the stats segment, defaults 64." },
+    {STATS_PUBLISH_INTERVAL, 0, "" , "stats-publish-interval",
+        option::Arg::Optional,
+        "  --stats-publish-interval=<ms>  \tHow often counters are copied to"
+        " the stats segment, defaults 250." },
     {UNKNOWN, 0, "", "", option::Arg::None,
         "\nExamples:\n"
         "  tkt-recv --port=<port>\n" },
@@ -61,20 +267,301 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    int port = 0;
+    server_config config;
     if (options[PORT] && options[PORT].arg) {
-        port = atoi(options[PORT].arg);
+        config.port = atoi(options[PORT].arg);
     }
 
-    std::string tkt_spool_dir("/tmp");
     if (options[SPOOL_DIR] && options[SPOOL_DIR].arg) {
-        tkt_spool_dir = options[SPOOL_DIR].arg;
+        config.tkt_spool_dir = options[SPOOL_DIR].arg;
+    }
+
+    if (options[THREADS] && options[THREADS].arg) {
+        config.threads = atoi(options[THREADS].arg);
+    }
+
+    if (options[PIN_CPUS]) {
+        config.pin_cpus = true;
+    }
+
+    if (options[STORE_THREADS] && options[STORE_THREADS].arg) {
+        config.store_threads = atoi(options[STORE_THREADS].arg);
+    }
+
+    if (options[MAX_PENDING_STORES] && options[MAX_PENDING_STORES].arg) {
+        config.max_pending_stores = atoi(options[MAX_PENDING_STORES].arg);
+    }
+
+    if (options[CRYPTO_THREADS] && options[CRYPTO_THREADS].arg) {
+        config.crypto_threads = atoi(options[CRYPTO_THREADS].arg);
+    }
+
+    if (options[MAX_PENDING_ACCEPTS] && options[MAX_PENDING_ACCEPTS].arg) {
+        config.max_pending_accepts = atoi(options[MAX_PENDING_ACCEPTS].arg);
+    }
+
+    if (options[BACKLOG] && options[BACKLOG].arg) {
+        config.listen_backlog = atoi(options[BACKLOG].arg);
+    }
+
+    if (options[ACCEPT_BATCH] && options[ACCEPT_BATCH].arg) {
+        config.accept_batch = atoi(options[ACCEPT_BATCH].arg);
+        if (config.accept_batch < 1) {
+            LOG(ERROR) << "--accept-batch must be at least 1.";
+            return -1;
+        }
+    }
+
+    if (options[STATS_INTERVAL] && options[STATS_INTERVAL].arg) {
+        config.stats_interval = atoi(options[STATS_INTERVAL].arg);
+    }
+
+    if (options[IDLE_TIMEOUT] && options[IDLE_TIMEOUT].arg) {
+        config.idle_timeout_ms = atoi(options[IDLE_TIMEOUT].arg);
+    }
+
+    if (options[HANDSHAKE_TIMEOUT] && options[HANDSHAKE_TIMEOUT].arg) {
+        config.handshake_timeout_ms = atoi(options[HANDSHAKE_TIMEOUT].arg);
+    }
+
+    if (options[MAX_TOKEN_SIZE] && options[MAX_TOKEN_SIZE].arg) {
+        config.max_token_size = atoi(options[MAX_TOKEN_SIZE].arg);
+    }
+
+    if (options[LOW_LATENCY]) {
+        config.low_latency = true;
+    }
+
+    if (options[CLOSE_DRAIN] && options[CLOSE_DRAIN].arg) {
+        config.close_drain_ms = atoi(options[CLOSE_DRAIN].arg);
+    }
+
+    if (options[MAX_HANDSHAKES] && options[MAX_HANDSHAKES].arg) {
+        config.max_handshakes = atoi(options[MAX_HANDSHAKES].arg);
+    }
+
+    if (options[MAX_TOKEN_MEMORY] && options[MAX_TOKEN_MEMORY].arg) {
+        config.max_token_memory = atol(options[MAX_TOKEN_MEMORY].arg);
+    }
+
+    if (options[MAX_LOOP_LAG] && options[MAX_LOOP_LAG].arg) {
+        config.max_loop_lag_ms = atoi(options[MAX_LOOP_LAG].arg);
+    }
+
+    if (options[OVERLOAD_REJECT]) {
+        config.overload_reject = true;
+    }
+
+    if (options[KEYTAB] && options[KEYTAB].arg) {
+        config.keytab = options[KEYTAB].arg;
+    }
+
+    if (options[PRINCIPAL] && options[PRINCIPAL].arg) {
+        config.acceptor_principal = options[PRINCIPAL].arg;
+    }
+
+    if (options[NO_PRELOAD_KEYTAB]) {
+        config.preload_keytab = false;
+    }
+
+    if (options[KEYTAB_CHECK_INTERVAL] && options[KEYTAB_CHECK_INTERVAL].arg) {
+        config.keytab_check_interval =
+            atoi(options[KEYTAB_CHECK_INTERVAL].arg);
+    }
+
+    if (options[REPLAY_CACHE] && options[REPLAY_CACHE].arg) {
+        std::string type(options[REPLAY_CACHE].arg);
+        if (type == "memory") {
+            config.builtin_rcache = true;
+        }
+        else if (type.find("file:") == 0) {
+            config.builtin_rcache = true;
+            config.rcache_path = type.substr(strlen("file:"));
+        }
+        else if (type != "krb5") {
+            LOG(ERROR) << "Unknown replay cache type: " << type;
+            return -1;
+        }
+    }
+
+    if (options[REPLAY_CACHE_SLOTS] && options[REPLAY_CACHE_SLOTS].arg) {
+        config.rcache_slots = atol(options[REPLAY_CACHE_SLOTS].arg);
+    }
+
+    if (options[REPLAY_LIFETIME] && options[REPLAY_LIFETIME].arg) {
+        config.rcache_lifetime = atoi(options[REPLAY_LIFETIME].arg);
     }
 
-    g_evbase = event_base_new();
+    if (options[CCACHE_WRITER] && options[CCACHE_WRITER].arg) {
+        std::string type(options[CCACHE_WRITER].arg);
+        if (type == "krb5") {
+            config.native_ccache_writer = false;
+        }
+        else if (type != "native") {
+            LOG(ERROR) << "Unknown ccache writer: " << type;
+            return -1;
+        }
+    }
+
+    if (options[DURABILITY] && options[DURABILITY].arg) {
+        std::string mode(options[DURABILITY].arg);
+        if (mode == "none") {
+            config.durability = DURABILITY_NONE;
+        }
+        else if (mode == "file") {
+            config.durability = DURABILITY_FILE;
+        }
+        else if (mode == "group") {
+            config.durability = DURABILITY_GROUP;
+        }
+        else {
+            LOG(ERROR) << "Unknown durability mode: " << mode;
+            return -1;
+        }
+    }
+
+    if (options[GROUP_COMMIT_WINDOW] && options[GROUP_COMMIT_WINDOW].arg) {
+        config.group_commit_ms = atoi(options[GROUP_COMMIT_WINDOW].arg);
+    }
+
+    if (options[ALWAYS_REWRITE]) {
+        config.skip_unchanged = false;
+    }
+
+    if (options[NO_COALESCE_STORES]) {
+        config.coalesce_stores = false;
+    }
+
+    if (options[INDEX_SNAPSHOT] && options[INDEX_SNAPSHOT].arg) {
+        config.index_snapshot = options[INDEX_SNAPSHOT].arg;
+    }
+
+    if (options[INDEX_SNAPSHOT_INTERVAL] &&
+        options[INDEX_SNAPSHOT_INTERVAL].arg) {
+        config.index_snapshot_interval =
+            atoi(options[INDEX_SNAPSHOT_INTERVAL].arg);
+    }
+
+    if (options[EXPIRED] && options[EXPIRED].arg) {
+        std::string action(options[EXPIRED].arg);
+        if (action == "delete") {
+            config.expired = EXPIRED_DELETE;
+        }
+        else if (action == "quarantine") {
+            config.expired = EXPIRED_QUARANTINE;
+        }
+        else if (action == "keep") {
+            config.expired = EXPIRED_KEEP;
+        }
+        else {
+            LOG(ERROR) << "Unknown expired ticket action: " << action;
+            return -1;
+        }
+    }
+
+    if (options[SWEEP_INTERVAL] && options[SWEEP_INTERVAL].arg) {
+        int interval_ms = atoi(options[SWEEP_INTERVAL].arg);
+        if (interval_ms < 1) {
+            LOG(ERROR) << "--sweep-interval must be at least 1.";
+            return -1;
+        }
+        config.sweep_interval_ms = interval_ms;
+    }
+
+    if (options[SWEEP_BATCH] && options[SWEEP_BATCH].arg) {
+        config.sweep_batch = atoi(options[SWEEP_BATCH].arg);
+    }
+
+    if (options[METRICS] && options[METRICS].arg) {
+        std::string listen(options[METRICS].arg);
+        size_t colon = listen.rfind(':');
+        if (colon != std::string::npos) {
+            config.metrics_addr = listen.substr(0, colon);
+            listen = listen.substr(colon + 1);
+        }
+        config.metrics_port = atoi(listen.c_str());
+    }
+
+    struct hotlog_config log_config;
+    log_config.async = false;
+    log_config.rate = 0;
+    log_config.sample = 0;
+    log_config.ring_lines = 8192;
+
+    if (options[LOG_MODE] && options[LOG_MODE].arg) {
+        std::string mode(options[LOG_MODE].arg);
+        if (mode == "async") {
+            log_config.async = true;
+        }
+        else if (mode != "sync") {
+            LOG(ERROR) << "Unknown log mode: " << mode;
+            return -1;
+        }
+    }
+
+    if (options[LOG_RATE] && options[LOG_RATE].arg) {
+        log_config.rate = atoi(options[LOG_RATE].arg);
+    }
+
+    if (options[LOG_SAMPLE] && options[LOG_SAMPLE].arg) {
+        log_config.sample = atoi(options[LOG_SAMPLE].arg);
+    }
+
+    if (options[LOG_BUFFER] && options[LOG_BUFFER].arg) {
+        log_config.ring_lines = atol(options[LOG_BUFFER].arg);
+    }
+
+    if (options[RENEW]) {
+        config.renew = true;
+    }
+
+    if (options[RENEW_BEFORE] && options[RENEW_BEFORE].arg) {
+        config.renew_before = atoi(options[RENEW_BEFORE].arg);
+    }
+
+    if (options[RENEW_JITTER] && options[RENEW_JITTER].arg) {
+        config.renew_jitter = atoi(options[RENEW_JITTER].arg);
+    }
+
+    if (options[RENEW_CONCURRENCY] && options[RENEW_CONCURRENCY].arg) {
+        config.renew_concurrency = atoi(options[RENEW_CONCURRENCY].arg);
+    }
+
+    if (options[STALL_THRESHOLD] && options[STALL_THRESHOLD].arg) {
+        config.stall_ms = atoi(options[STALL_THRESHOLD].arg);
+    }
+
+    config.stats_shm = STATSHM_PREFIX +
+                       std::to_string((long long)config.port);
+    if (options[STATS_SHM] && options[STATS_SHM].arg) {
+        config.stats_shm = options[STATS_SHM].arg;
+        if (config.stats_shm == "none") {
+            config.stats_shm.clear();
+        }
+    }
+
+    if (options[STATS_FORWARDS] && options[STATS_FORWARDS].arg) {
+        config.stats_forwards = atoi(options[STATS_FORWARDS].arg);
+    }
+
+    if (options[STATS_PUBLISH_INTERVAL] &&
+        options[STATS_PUBLISH_INTERVAL].arg) {
+        config.stats_publish_ms = atoi(options[STATS_PUBLISH_INTERVAL].arg);
+    }
+
+    if (config.builtin_rcache) {
+        // Authenticators are checked by tkt-recv, turn off the krb5 file
+        // replay cache before any krb5 context is created.
+        setenv("KRB5RCACHETYPE", "none", 1);
+    }
+
+    if (!hotlog_start(log_config)) {
+        return -1;
+    }
 
-    LOG(INFO) << "Running tkt-recv server on port: " << port;
+    LOG(INFO) << "Running tkt-recv server on port: " << config.port;
 
-    run_server(port, tkt_spool_dir);
-    event_base_free(g_evbase);
+    int rc = run_server(config);
+    hotlog_stop();
+    return rc;
 }
@@ -1,193 +1,1074 @@
 #include "tktrecv.h"
 #include "creds.h"
 #include "credmgr.h"
+#include "workpool.h"
+#include "groupcommit.h"
+#include "spoolindex.h"
+#include "sweeper.h"
+#include "renewer.h"
+#include "metrics.h"
+#include "watchdog.h"
+#include "statsegment.h"
+#include "probes.h"
+#include "frame.h"
+#include "acceptor.h"
+#include "rcache.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/tcp.h>
+
+#include <unordered_map>
+#include <vector>
 
 #include <gssapi/gssapi_krb5.h>
 #include <easylogging/easylogging++.h>
 
-// Close connection and free all resources.
-void on_server_handshake_complete(int fd, short ev, void *arg) {
-    LOG(INFO) << "Closing connection, fd: " << fd;
+// Close connection and free worker. If a job is still running on a pool
+// thread, the worker is released when the job completes.
+static void worker_close(struct worker *h) {
+    if (h->pending) {
+        h->closing = 1;
+        bufferevent_disable(h->buf_network, EV_READ|EV_WRITE);
+        return;
+    }
+    free_worker(h);
+}
 
+void server_handshake_err_cb(struct bufferevent *bev, short error, void *arg) {
     struct worker *h = (struct worker *)arg;
-    close(h->network_fd);
-    free_worker(h);
+    LoopActivity busy(&h->loop->activity, LOOP_CB_CLOSE);
+
+    HLOG(ERROR) << "Handshake error.";
+    worker_close(h);
 }
 
-// The callback is invoked when buffer state changes. If there is nothing
-// to send, it will remove itself from the callback list and schedule
-// connection shutdown.
-void schedule_handshake_complete_cb(struct evbuffer *buffer,
-                                    const struct evbuffer_cb_info *info,
-                                    void *arg) {
+// Connection missed its idle or handshake deadline.
+static void on_worker_deadline(struct tw_timer *timer, void *arg) {
     struct worker *h = (struct worker *)arg;
-    size_t len = evbuffer_get_length(buffer);
 
-    if (len == 0) {
-        evbuffer_remove_cb(buffer, schedule_handshake_complete_cb, h);
+    STAT_INC(h->loop->stats.timeouts);
+    TKT_PROBE1(tkt_recv, timeout, h->network_fd);
+    if (h->result == FORWARD_INCOMPLETE) {
+        h->result = FORWARD_TIMEOUT;
+    }
+    HLOG(INFO) << "Handshake timed out, fd: " << h->network_fd;
+    worker_close(h);
+}
 
-        assert(h->ev);
-        evtimer_assign(
-                h->ev,
-                g_evbase,
-                on_server_handshake_complete,
-                h
-                );
+// Arm the worker's deadline: the earlier of the idle timeout, counted
+// from now, and the total handshake timeout, counted from accept.
+static void worker_arm_deadline(struct worker *h) {
+    struct server_loop *loop = h->loop;
+    const server_config *config = loop->config;
 
-        struct timeval t0 = {0, 0};
-        evtimer_add(h->ev, &t0);
+    if (config->idle_timeout_ms == 0 && config->handshake_timeout_ms == 0) {
+        return;
     }
+
+    unsigned timeout_ms = config->idle_timeout_ms;
+    if (config->handshake_timeout_ms) {
+        uint64_t elapsed_ms =
+            (loop->wheel.now - h->started_tick) * loop->wheel.tick_ms;
+        unsigned remaining_ms = 0;
+        if (elapsed_ms < config->handshake_timeout_ms) {
+            remaining_ms = config->handshake_timeout_ms - elapsed_ms;
+        }
+        if (timeout_ms == 0 || remaining_ms < timeout_ms) {
+            timeout_ms = remaining_ms;
+        }
+    }
+    tw_timer_add(&loop->wheel, &h->deadline, timeout_ms);
 }
 
-void server_read_handshake_cb(struct bufferevent *bev, void *arg) {
+// Graceful close. Once the ack is written, the write side is shut down
+// and whatever the peer still sends is discarded until it closes its side
+// or the drain deadline expires. Sockets don't linger, close() never
+// blocks the loop.
+
+static void on_drain_deadline(struct tw_timer *timer, void *arg) {
     struct worker *h = (struct worker *)arg;
+    LoopActivity busy(&h->loop->activity, LOOP_CB_CLOSE);
 
-    gss_buffer_read(bev, h);
-    if (h->gss_buf_in.value) {
+    STAT_INC(h->loop->stats.close_timeouts);
+    HLOG(INFO) << "Closing connection, peer did not close, fd: "
+              << h->network_fd;
+    free_worker(h);
+}
 
-        OM_uint32 maj, min;
-        gss_buffer_desc gss_buf_out;
-        gss_cred_id_t client_creds;
-
-	    maj = gss_accept_sec_context(
-                &min,
-                &(h->ctx),
-                GSS_C_NO_CREDENTIAL,
-                &(h->gss_buf_in),
-                GSS_C_NO_CHANNEL_BINDINGS,
-                &(h->peer_name),
-                NULL,
-                &gss_buf_out,
-                NULL,
-                NULL,
-                &client_creds
-                );
-        display_status("gss_accept_sec_context: ", maj, min);
-        LOG(INFO) << "client_creds: " << client_creds;
+static void server_drain_read_cb(struct bufferevent *bev, void *arg) {
+    struct worker *h = (struct worker *)arg;
+    LoopActivity busy(&h->loop->activity, LOOP_CB_CLOSE);
 
-        HANDSHAKE_OK(maj, min, h);
-        gss_buffer_write(bev, &gss_buf_out);
-        gss_release_buffer(&min, &gss_buf_out);
+    struct evbuffer *input = bufferevent_get_input(bev);
+    evbuffer_drain(input, evbuffer_get_length(input));
+}
+
+static void server_drain_event_cb(struct bufferevent *bev,
+                                  short events,
+                                  void *arg) {
+    struct worker *h = (struct worker *)arg;
+    LoopActivity busy(&h->loop->activity, LOOP_CB_CLOSE);
+
+    HLOG(INFO) << "Closing connection, fd: " << h->network_fd;
+    free_worker(h);
+}
+
+// Output is flushed, half close and wait for the peer's FIN.
+static void server_ack_written_cb(struct bufferevent *bev, void *arg) {
+    struct worker *h = (struct worker *)arg;
+    struct server_loop *loop = h->loop;
+    LoopActivity busy(&loop->activity, LOOP_CB_CLOSE);
+
+    if (evbuffer_get_length(bufferevent_get_output(bev)) != 0) {
+        return;
+    }
+
+    h->phase_us[PHASE_ACK_DRAIN] =
+        hist_since(&loop->hist[PHASE_ACK_DRAIN], h->ack_start_us);
+    h->ack_start_us = 0;
+
+    shutdown(h->network_fd, SHUT_WR);
+
+    bufferevent_disable(bev, EV_WRITE);
+    bufferevent_setcb(bev,
+                      server_drain_read_cb,
+                      NULL,
+                      server_drain_event_cb,
+                      h);
+    bufferevent_setwatermark(bev, EV_READ, 0, 0);
+    bufferevent_enable(bev, EV_READ);
+
+    tw_timer_del(&loop->wheel, &h->deadline);
+    tw_timer_init(&h->deadline, on_drain_deadline, h);
+    tw_timer_add(&loop->wheel, &h->deadline, loop->config->close_drain_ms);
+}
+
+// Store job, runs CredMgr::store_creds on store pool thread.
+struct store_job {
+    struct work_job job;
+    struct worker *h;
+    std::string accepted_princ;
+    gss_cred_id_t client_creds;
+    struct sockaddr_in peer;
+    uint64_t queued_us;
+    bool stored;
+    // spool already had these tickets, nothing was written
+    bool skipped;
+
+    // Coalescing: the job carrying the freshest creds for a principal is
+    // written, the others wait on it and get its result.
+    time_t creds_expire;
+    struct store_job *waiters;
+    struct store_job *next_waiter;
+    bool coalesced;
+};
+
+// Stores of one principal. At most one is written at a time, stores
+// arriving meanwhile are merged into the next one.
+struct princ_stores {
+    struct store_job *running;
+    struct store_job *next;
+};
+
+struct store_coalescer {
+    pthread_mutex_t lock;
+    std::unordered_map<std::string, struct princ_stores> princs;
+};
+
+static void on_store_complete(struct worker *h, bool stored) {
+    struct bufferevent *bev = h->buf_network;
+
+    h->ack_start_us = monotonic_us();
+    TKT_PROBE2(tkt_recv, ack_sent, h->network_fd, stored ? 0 : 1);
+    if (stored) {
+        ack_write(bev, 0);
+    }
+    else {
+        ack_write(bev, 1);
+    }
 
-        if (maj & GSS_S_CONTINUE_NEEDED) {
-            LOG(INFO) << "Handshake got GSS_S_CONTINUE_NEEDED.";
+    // Ack is flushed by the write callback, the handshake deadline stays
+    // armed in case the peer stops reading.
+    bufferevent_setcb(bev,
+                      NULL,
+                      server_ack_written_cb,
+                      server_handshake_err_cb,
+                      h);
+}
+
+// Shared state handed to every store thread's credential manager.
+struct store_init {
+    const server_config *config;
+    SpoolIndex *spool_index;
+};
+
+static void *store_thread_init(void *arg) {
+    const struct store_init *init = (const struct store_init *)arg;
+    return new CredMgr(init->config->tkt_spool_dir,
+                       init->config->native_ccache_writer,
+                       durability_sync_writes(init->config->durability,
+                                              true),
+                       init->spool_index,
+                       init->config->skip_unchanged);
+}
+
+static void store_thread_fini(void *thread_ctx) {
+    delete (CredMgr *)thread_ctx;
+}
+
+static void store_job_run(struct work_job *job, void *thread_ctx) {
+    struct store_job *sj = (struct store_job *)job;
+    const CredMgr *cred_mgr = (const CredMgr *)thread_ctx;
+    OM_uint32 min;
+
+    // Connection's fd does not change while the job is in flight.
+    TKT_PROBE2(tkt_recv, store_start, sj->h->network_fd,
+               sj->accepted_princ.c_str());
+    sj->stored = cred_mgr->store_creds(sj->accepted_princ,
+                                       sj->client_creds,
+                                       sj->peer,
+                                       &sj->skipped);
+    gss_release_cred(&min, &sj->client_creds);
+    TKT_PROBE4(tkt_recv, store_end, sj->h->network_fd,
+               sj->accepted_princ.c_str(), sj->stored, sj->skipped);
+}
+
+static void store_job_done(struct work_job *job) {
+    struct store_job *sj = (struct store_job *)job;
+    struct worker *h = sj->h;
+    LoopActivity busy(&h->loop->activity, LOOP_CB_STORE);
+    bool stored = sj->stored;
+    struct server_stats *stats = &h->loop->stats;
+    h->phase_us[PHASE_STORE] =
+        hist_since(&h->loop->hist[PHASE_STORE], sj->queued_us);
+    if (!stored) {
+        STAT_INC(stats->store_failures);
+        h->result = FORWARD_STORE_FAILED;
+    }
+    else if (sj->coalesced) {
+        STAT_INC(stats->stores_coalesced);
+        h->result = FORWARD_COALESCED;
+    }
+    else if (sj->skipped) {
+        STAT_INC(stats->stores_skipped);
+        h->result = FORWARD_SKIPPED;
+    }
+    else {
+        STAT_INC(stats->stores_written);
+        h->result = FORWARD_STORED;
+    }
+    delete sj;
+
+    --h->pending;
+    if (h->closing) {
+        worker_close(h);
+        return;
+    }
+    on_store_complete(h, stored);
+}
+
+// Successful stores wait for the next group commit before they are acked,
+// failed ones have nothing to sync.
+static void store_job_post(struct work_job *job) {
+    struct store_job *sj = (struct store_job *)job;
+    if (sj->stored) {
+        job->loop->group_commit->add(job);
+    }
+    else {
+        loop_post(job->loop, job);
+    }
+}
+
+// The ticket cache is in the spool already, the nack tells the client it
+// may not survive a crash.
+static void store_job_sync_failed(struct work_job *job) {
+    struct store_job *sj = (struct store_job *)job;
+    sj->stored = false;
+}
+
+// Hand finished store to its loop, through group commit if enabled.
+static void store_job_deliver(struct store_job *sj) {
+    if (sj->job.loop->group_commit) {
+        store_job_post(&sj->job);
+    }
+    else {
+        loop_post(sj->job.loop, &sj->job);
+    }
+}
+
+static time_t creds_expire(gss_cred_id_t creds) {
+    OM_uint32 min;
+    OM_uint32 lifetime = 0;
+    if (GSS_ERROR(gss_inquire_cred(&min, creds, NULL, &lifetime,
+                                   NULL, NULL))) {
+        return 0;
+    }
+    if (lifetime == GSS_C_INDEFINITE) {
+        return (time_t)-1 >> 1;
+    }
+    return time(NULL) + lifetime;
+}
+
+// Leader sj of a principal is done or could not be queued. Start the
+// principal's next store and give sj's result to everyone waiting on it.
+static void store_group_finish(struct store_job *sj) {
+    struct store_coalescer *coalescer = sj->job.loop->coalescer;
+
+    for (;;) {
+        pthread_mutex_lock(&coalescer->lock);
+        std::unordered_map<std::string, struct princ_stores>::iterator it =
+            coalescer->princs.find(sj->accepted_princ);
+        struct store_job *next = it->second.next;
+        it->second.running = next;
+        it->second.next = NULL;
+        if (next == NULL) {
+            coalescer->princs.erase(it);
+        }
+        pthread_mutex_unlock(&coalescer->lock);
+
+        struct store_job *waiter = sj->waiters;
+        while (waiter) {
+            struct store_job *next_waiter = waiter->next_waiter;
+            waiter->stored = sj->stored;
+            waiter->skipped = sj->skipped;
+            store_job_deliver(waiter);
+            waiter = next_waiter;
+        }
+        store_job_deliver(sj);
+
+        if (next == NULL || next->job.loop->store_pool->submit(&next->job)) {
+            return;
+        }
+
+        HLOG(ERROR) << "Store queue full, rejecting: " << next->accepted_princ;
+        OM_uint32 min;
+        gss_release_cred(&min, &next->client_creds);
+        next->stored = false;
+        sj = next;
+    }
+}
+
+static void store_job_finished(struct work_job *job) {
+    store_group_finish((struct store_job *)job);
+}
+
+// Queue store behind the one running for the same principal. Returns
+// true if sj should be submitted now.
+static bool store_coalesce(struct store_job *sj) {
+    struct store_coalescer *coalescer = sj->job.loop->coalescer;
+    OM_uint32 min;
+
+    sj->creds_expire = creds_expire(sj->client_creds);
+
+    pthread_mutex_lock(&coalescer->lock);
+    struct princ_stores& ps = coalescer->princs[sj->accepted_princ];
+    if (ps.running == NULL) {
+        ps.running = sj;
+        pthread_mutex_unlock(&coalescer->lock);
+        return true;
+    }
+
+    if (ps.next == NULL) {
+        ps.next = sj;
+        pthread_mutex_unlock(&coalescer->lock);
+        return false;
+    }
+
+    // Keep the freshest creds in the queued store, later arrivals win
+    // ties.
+    struct store_job *next = ps.next;
+    if (sj->creds_expire >= next->creds_expire) {
+        std::swap(sj->client_creds, next->client_creds);
+        std::swap(sj->creds_expire, next->creds_expire);
+    }
+    sj->coalesced = true;
+    sj->next_waiter = next->waiters;
+    next->waiters = sj;
+    pthread_mutex_unlock(&coalescer->lock);
+
+    gss_release_cred(&min, &sj->client_creds);
+    return false;
+}
+
+// Store delegated credentials and ack the client. With store pool
+// configured, the store runs on the pool thread and ack is written when
+// the job is posted back to the worker's loop. With group commit, the ack
+// waits until the store is synced.
+//
+// Stores of the same principal are coalesced: while one is written, later
+// ones collapse into a single store of the freshest creds, and all of them
+// are acked with its result.
+static void store_creds(struct worker *h,
+                        const std::string& accepted_princ,
+                        gss_cred_id_t client_creds) {
+    OM_uint32 min;
+    struct server_loop *loop = h->loop;
+
+    struct store_job *sj = new store_job;
+    sj->job.run = store_job_run;
+    sj->job.done = store_job_done;
+    sj->job.post = loop->group_commit ? store_job_post : NULL;
+    sj->job.loop = loop;
+    sj->h = h;
+    sj->accepted_princ = accepted_princ;
+    sj->client_creds = client_creds;
+    sj->peer = h->peeraddr;
+    sj->queued_us = monotonic_us();
+    sj->stored = false;
+    sj->skipped = false;
+    sj->creds_expire = 0;
+    sj->waiters = NULL;
+    sj->next_waiter = NULL;
+    sj->coalesced = false;
+
+    ++h->pending;
+    if (loop->store_pool == NULL) {
+        LoopActivity busy(&loop->activity, LOOP_CB_STORE);
+        store_job_run(&sj->job, loop->cred_mgr);
+        if (sj->job.post) {
+            sj->job.post(&sj->job);
         }
         else {
-            gss_buffer_desc	buf;
-	        maj = gss_display_name(&min, h->peer_name, &buf, NULL);
-            HANDSHAKE_OK(maj, min, h);
+            store_job_done(&sj->job);
+        }
+        return;
+    }
 
-            std::string accepted_princ;
+    if (loop->coalescer) {
+        sj->job.post = store_job_finished;
+        if (!store_coalesce(sj)) {
+            return;
+        }
+        if (!loop->store_pool->submit(&sj->job)) {
+            HLOG(ERROR) << "Store queue full, rejecting: " << accepted_princ;
+            gss_release_cred(&min, &sj->client_creds);
+            store_group_finish(sj);
+        }
+        return;
+    }
+
+    if (!loop->store_pool->submit(&sj->job)) {
+        HLOG(ERROR) << "Store queue full, rejecting: " << accepted_princ;
+        STAT_INC(loop->stats.store_failures);
+        h->result = FORWARD_STORE_FAILED;
+        --h->pending;
+        gss_release_cred(&min, &sj->client_creds);
+        delete sj;
+        on_store_complete(h, false);
+    }
+}
 
-            accepted_princ.assign((const char *)buf.value);
+// Run gss_accept_sec_context on the worker's input token. Called on the
+// loop thread or on a crypto pool thread; the result is kept in the worker
+// until on_accept_complete() runs on the loop thread.
+static void accept_sec_context(struct worker *h) {
+    // Initial token carries the AP-REQ, check its authenticator before
+    // spending time on decryption.
+    ReplayCache *rcache = h->loop->rcache;
+    bool fresh = false;
+    if (rcache && h->ctx == GSS_C_NO_CONTEXT) {
+        switch (rcache->check_token(h->gss_buf_in.value,
+                                    h->gss_buf_in.length,
+                                    &h->rcache_key)) {
+        case ReplayCache::FRESH:
+            fresh = true;
+            break;
+        case ReplayCache::REPLAY:
+            h->accept_maj = GSS_S_FAILURE | GSS_S_DUPLICATE_TOKEN;
+            h->accept_min = 0;
+            h->rcache_reject = 1;
+            return;
+        case ReplayCache::MALFORMED:
+            h->accept_maj = GSS_S_DEFECTIVE_TOKEN;
+            h->accept_min = 0;
+            h->rcache_reject = 1;
+            return;
+        case ReplayCache::FULL:
+            h->accept_maj = GSS_S_FAILURE;
+            h->accept_min = 0;
+            h->rcache_full = 1;
+            return;
+        }
+    }
 
-            socklen_t len = sizeof(h->peeraddr);
-            getpeername(h->network_fd,(struct sockaddr *)&(h->peeraddr), &len);
-            LOG(INFO) << "Accepted connection from: "
-                      << accepted_princ
-                      << " on " << inet_ntoa(h->peeraddr.sin_addr)
-                      << ":" << ntohs(h->peeraddr.sin_port);
+    AcceptorCred *acceptor = h->loop->acceptor;
+    struct acceptor_ref *ref = acceptor ? acceptor->get() : NULL;
 
-		    gss_release_buffer(&min, &buf);
-            gss_release_name(&min, &(h->peer_name));
-            h->peer_name = NULL;
+    TKT_PROBE2(tkt_recv, gss_accept_entry, h->network_fd,
+               h->gss_buf_in.length);
+    uint64_t start_us = monotonic_us();
+    h->accept_maj = gss_accept_sec_context(
+            &(h->accept_min),
+            &(h->ctx),
+            ref ? ref->cred : GSS_C_NO_CREDENTIAL,
+            &(h->gss_buf_in),
+            GSS_C_NO_CHANNEL_BINDINGS,
+            &(h->peer_name),
+            NULL,
+            &(h->gss_buf_out),
+            NULL,
+            NULL,
+            &(h->client_creds)
+            );
 
-            if (h->cred_mgr->store_creds(accepted_princ, client_creds)) {
-                ack_write(bev, 0);
-            }
-            else {
-                ack_write(bev, 1);
-            }
+    h->gss_accept_us = monotonic_us() - start_us;
+    TKT_PROBE4(tkt_recv, gss_accept_return, h->network_fd,
+               h->accept_maj, h->accept_min, h->gss_buf_out.length);
 
-            bufferevent_disable(bev, EV_READ);
-            struct evbuffer *output = bufferevent_get_output(bev);
-            evbuffer_add_cb(output, schedule_handshake_complete_cb, h);
+    if (ref) {
+        acceptor->put(ref);
+    }
+
+    if (fresh && GSS_ERROR(h->accept_maj)) {
+        rcache->forget(h->rcache_key);
+    }
+}
+
+static void on_accept_complete(struct worker *h) {
+    struct bufferevent *bev = h->buf_network;
+    OM_uint32 maj = h->accept_maj;
+    OM_uint32 min = h->accept_min;
+
+    gss_buffer_consume(bev, h);
+
+    struct server_loop *loop = h->loop;
+    if (h->rcache_reject) {
+        h->rcache_reject = 0;
+        STAT_INC(loop->stats.replays);
+        h->result = FORWARD_REPLAY;
+        HLOG(INFO) << "Rejected replayed or unrecognized initial token.";
+    }
+    else if (h->rcache_full) {
+        h->rcache_full = 0;
+        STAT_INC(loop->stats.rcache_full);
+        h->result = FORWARD_RCACHE_FULL;
+        HLOG(WARNING) << "Replay cache full, rejecting handshake.";
+    }
+    else {
+        hist_record(&loop->hist[PHASE_GSS_ACCEPT], h->gss_accept_us);
+        h->phase_us[PHASE_GSS_ACCEPT] += h->gss_accept_us;
+    }
+    if (GSS_ERROR(maj)) {
+        OM_uint32 code = GSS_ROUTINE_ERROR(maj) >> GSS_C_ROUTINE_ERROR_OFFSET;
+        STAT_INC(loop->stats.gss_failures[
+                code < GSS_ROUTINE_ERRORS ? code : 0]);
+        if (h->result == FORWARD_INCOMPLETE) {
+            h->result = FORWARD_GSS_FAILED;
         }
+    }
+
+    // Status strings are only looked up for failures.
+    if (GSS_ERROR(maj)) {
+        display_status("gss_accept_sec_context: ", maj, min);
+    }
+
+    HANDSHAKE_OK(maj, min, h);
+    gss_buffer_write(bev, &(h->gss_buf_out));
+    gss_release_buffer(&min, &(h->gss_buf_out));
+
+    if (maj & GSS_S_CONTINUE_NEEDED) {
+        HLOG(INFO) << "Handshake got GSS_S_CONTINUE_NEEDED.";
+        bufferevent_enable(bev, EV_READ);
+    }
+    else {
+        STAT_INC(loop->stats.handshakes_ok);
+
+        gss_buffer_desc	buf;
+        maj = gss_display_name(&min, h->peer_name, &buf, NULL);
+        HANDSHAKE_OK(maj, min, h);
 
-        h->gss_buf_in_read = 0;
-        h->gss_buf_in.length = 0;
-        h->gss_buf_in.value = NULL;
+        std::string accepted_princ;
+
+        accepted_princ.assign((const char *)buf.value);
+        strncpy(h->principal, accepted_princ.c_str(),
+                sizeof(h->principal) - 1);
+
+        TKT_PROBE2(tkt_recv, authenticated, h->network_fd,
+                   accepted_princ.c_str());
+        HLOG(INFO) << "Accepted connection from: "
+                  << accepted_princ
+                  << " on " << inet_ntoa(h->peeraddr.sin_addr)
+                  << ":" << ntohs(h->peeraddr.sin_port);
+
+        gss_release_buffer(&min, &buf);
+        gss_release_name(&min, &(h->peer_name));
+        h->peer_name = NULL;
+
+        gss_cred_id_t client_creds = h->client_creds;
+        h->client_creds = GSS_C_NO_CREDENTIAL;
+        store_creds(h, accepted_princ, client_creds);
     }
 }
 
-void server_write_handshake_cb(struct bufferevent *bev, void *arg) {
-    struct worker *h = (struct worker *)arg;
+// Accept job, runs gss_accept_sec_context on crypto pool thread.
+struct accept_job {
+    struct work_job job;
+    struct worker *h;
+};
+
+static void accept_job_run(struct work_job *job, void *thread_ctx) {
+    struct accept_job *aj = (struct accept_job *)job;
+    accept_sec_context(aj->h);
 }
 
-void server_handshake_err_cb(struct bufferevent *bev, short error, void *arg) {
-    LOG(ERROR) << "Handshake error.";
+static void accept_job_done(struct work_job *job) {
+    struct accept_job *aj = (struct accept_job *)job;
+    struct worker *h = aj->h;
+    LoopActivity busy(&h->loop->activity, LOOP_CB_READ_HANDSHAKE);
+    delete aj;
 
-    struct worker *h = (struct worker *)arg;
-    close(h->network_fd);
-    free_worker(h);
+    --h->pending;
+    if (h->closing) {
+        worker_close(h);
+        return;
+    }
+    on_accept_complete(h);
 }
 
-void on_server_handshake_begin(int fd, short ev, void *arg) {
+void server_read_handshake_cb(struct bufferevent *bev, void *arg) {
+    struct worker *h = (struct worker *)arg;
+    struct server_loop *loop = h->loop;
+    LoopActivity busy(&loop->activity, LOOP_CB_READ_HANDSHAKE);
+
+    uint64_t now_us = monotonic_us();
+    if (h->accepted_us) {
+        h->phase_us[PHASE_FIRST_BYTE] = now_us - h->accepted_us;
+        hist_record(&loop->hist[PHASE_FIRST_BYTE], now_us - h->accepted_us);
+        h->accepted_us = 0;
+    }
+    if (h->token_start_us == 0) {
+        h->token_start_us = now_us;
+    }
+
+    worker_arm_deadline(h);
+    if (gss_buffer_read(bev, h) < 0) {
+        worker_close(h);
+        return;
+    }
+    if (h->gss_buf_in.value) {
+        h->phase_us[PHASE_TOKEN_RECV] +=
+            hist_since(&loop->hist[PHASE_TOKEN_RECV], h->token_start_us);
+        h->token_start_us = 0;
+        TKT_PROBE2(tkt_recv, frame_received, h->network_fd,
+                   h->gss_buf_in.length);
+
+        // Input token must stay intact until accept completes, no more
+        // reads until the reply is written.
+        bufferevent_disable(bev, EV_READ);
+
+        if (loop->crypto_pool) {
+            struct accept_job *aj = new accept_job;
+            aj->job.run = accept_job_run;
+            aj->job.done = accept_job_done;
+            aj->job.post = NULL;
+            aj->job.loop = loop;
+            aj->h = h;
+
+            ++h->pending;
+            if (loop->crypto_pool->submit(&aj->job)) {
+                return;
+            }
+
+            // Crypto queue is full, accept on the loop thread.
+            --h->pending;
+            delete aj;
+        }
 
-    LOG(INFO) << "Begin handshake, fd: " << fd;
+        {
+            LoopActivity gss(&loop->activity, LOOP_CB_GSS_ACCEPT);
+            accept_sec_context(h);
+        }
+        on_accept_complete(h);
+    }
+}
 
+void server_write_handshake_cb(struct bufferevent *bev, void *arg) {
     struct worker *h = (struct worker *)arg;
+}
+
+// Set up connection buffers and start GSS handshake.
+static void server_handshake_begin(struct server_loop *loop,
+                                   int client_fd,
+                                   const struct sockaddr_in *client_addr) {
 
-    OM_uint32 maj, min;
+    HLOG(INFO) << "Begin handshake, fd: " << client_fd;
+
+    struct worker *h = alloc_worker(loop);
+    if (h == NULL) {
+        HLOG(ERROR) << "Unable to allocate worker, fd: " << client_fd;
+        close(client_fd);
+        return;
+    }
+    h->network_fd = client_fd;
+    h->peeraddr = *client_addr;
+    h->accepted_us = monotonic_us();
+    ++loop->load->live_workers;
 
     h->ctx = GSS_C_NO_CONTEXT;
     h->gss_buf_in.length  = 0;
 
+    tw_timer_init(&h->deadline, on_worker_deadline, h);
+    h->started_tick = loop->wheel.now;
+    worker_arm_deadline(h);
+
     h->buf_network = bufferevent_socket_new(
-        g_evbase, h->network_fd, BEV_OPT_CLOSE_ON_FREE);
-    assert(h->buf_network);
+        loop->evbase, h->network_fd, BEV_OPT_CLOSE_ON_FREE);
+    if (h->buf_network == NULL) {
+        HLOG(ERROR) << "bufferevent_socket_new failed, fd: " << client_fd;
+        free_worker(h);
+        return;
+    }
     bufferevent_setcb(
         h->buf_network,
         server_read_handshake_cb,
         server_write_handshake_cb,
         server_handshake_err_cb, h
     );
-    bufferevent_setwatermark(h->buf_network, EV_READ, 4, 0);
+    bufferevent_setwatermark(h->buf_network, EV_READ, FRAME_HDR_LEN, 0);
     bufferevent_enable(h->buf_network, EV_READ|EV_WRITE);
 }
 
-// Accept connection and schedule callback to start GSS handshake.
-void on_accept(int fd, short ev, void *arg) {
+// Check load against configured limits, scaled by percent. Accepting
+// stops at 100% and resumes below ADMISSION_RESUME_PCT, so the listener
+// does not flap around the threshold.
+static bool overloaded(struct server_loop *loop, int percent) {
+    const server_config *config = loop->config;
+
+    if (config->max_handshakes > 0 &&
+        loop->load->live_workers.load() * 100 >=
+            (long)config->max_handshakes * percent) {
+        return true;
+    }
+
+    if (loop->store_pool && config->max_pending_stores > 0 &&
+        loop->store_pool->queued() * 100 >=
+            (size_t)config->max_pending_stores * percent) {
+        return true;
+    }
+
+    if (config->max_token_memory > 0 &&
+        loop->load->token_bytes.load() * 100 >=
+            (long)config->max_token_memory * percent) {
+        return true;
+    }
+
+    if (config->max_loop_lag_ms > 0 &&
+        loop->lag_ms * 100 >= (uint64_t)config->max_loop_lag_ms * percent) {
+        return true;
+    }
+
+    return false;
+}
+
+static int open_listener(const server_config& config, int nloops);
+void on_accept(int fd, short ev, void *arg);
+
+// Reset the connection without waiting for anything, the client retries
+// with another server or later.
+static void reject_connection(struct server_loop *loop, int client_fd) {
+    struct linger so_linger;
+    so_linger.l_onoff = 1;
+    so_linger.l_linger = 0;
+    setsockopt(client_fd, SOL_SOCKET, SO_LINGER,
+               &so_linger, sizeof(so_linger));
+    close(client_fd);
+    STAT_INC(loop->stats.rejected);
+}
 
-    LOG(INFO) << "Accepted connection, fd: " << fd;
+// With SO_REUSEPORT the kernel keeps hashing new connections to a socket
+// nobody accepts from, so they would sit in its backlog until the loop
+// resumes. Leave the group instead: connections already queued are reset,
+// the client retries, and new ones go to the loops still listening. The
+// last listening loop keeps its socket.
+static bool close_listener(struct server_loop *loop) {
+    int listening = loop->load->listening.load();
+    do {
+        if (listening <= 1) {
+            return false;
+        }
+    } while (!loop->load->listening.compare_exchange_weak(listening,
+                                                          listening - 1));
 
     int client_fd;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    while ((client_fd = accept4(loop->listen_fd, NULL, NULL,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        reject_connection(loop, client_fd);
+    }
+
+    event_free(loop->accept_event);
+    loop->accept_event = NULL;
+    close(loop->listen_fd);
+    loop->listen_fd = -1;
+    return true;
+}
 
-    client_fd = accept(fd, (struct sockaddr *)&client_addr,  &client_len);
-    if (client_fd < 0) {
-        perror("client: accept() failed");
+static bool reopen_listener(struct server_loop *loop) {
+    int fd = open_listener(*loop->config, loop->load->nloops);
+    if (fd < 0) {
+        return false;
+    }
+
+    loop->listen_fd = fd;
+    loop->accept_event = event_new(
+            loop->evbase,
+            loop->listen_fd,
+            EV_READ|EV_PERSIST,
+            on_accept,
+            (void *)loop
+            );
+    ++loop->load->listening;
+    return true;
+}
+
+// Stop accepting until the load drops. A single listener is only unwatched,
+// connections wait in the kernel backlog.
+static void pause_accept(struct server_loop *loop) {
+    if (loop->accept_paused) {
         return;
     }
 
-    evutil_make_socket_nonblocking(client_fd);
-    set_so_linger(client_fd);
-    fcntl(client_fd, FD_CLOEXEC);
+    event_del(loop->accept_event);
+    loop->accept_paused = 1;
+    STAT_INC(loop->stats.accept_pauses);
+    if (loop->load->nloops > 1 && close_listener(loop)) {
+        HLOG(INFO) << "Loop " << loop->id
+                   << " overloaded, listener closed.";
+    }
+    else {
+        HLOG(INFO) << "Loop " << loop->id << " overloaded, accept paused.";
+    }
+}
 
-    struct worker *h = alloc_worker();
-    h->network_fd = client_fd;
+static void resume_accept(struct server_loop *loop) {
+    // Retried on the next wheel tick if the port can't be bound again.
+    if (loop->listen_fd < 0 && !reopen_listener(loop)) {
+        return;
+    }
+
+    // Backoff timer re-arms the listener when it fires.
+    if (!loop->accept_backoff) {
+        event_add(loop->accept_event, NULL);
+    }
+    loop->accept_paused = 0;
+    HLOG(INFO) << "Loop " << loop->id << " accept resumed.";
+}
+
+// Accept failed for a reason that does not go away by retrying right
+// away, such as EMFILE or ENFILE. The pending connection keeps the
+// listener readable, so stop watching it for a while instead of spinning.
+static void backoff_accept(struct server_loop *loop) {
+    if (loop->accept_backoff) {
+        return;
+    }
+
+    event_del(loop->accept_event);
+    loop->accept_backoff = 1;
+    struct timeval retry = {0, ACCEPT_RETRY_MS * 1000};
+    event_add(loop->accept_retry_event, &retry);
+}
+
+static void on_accept_retry(int fd, short ev, void *arg) {
+    struct server_loop *loop = (struct server_loop *)arg;
+    LoopActivity busy(&loop->activity, LOOP_CB_TIMER);
+
+    loop->accept_backoff = 0;
+    if (!loop->accept_paused) {
+        event_add(loop->accept_event, NULL);
+    }
+}
+
+// Drain the accept queue, at most accept_batch connections per wakeup so
+// a connection storm does not starve handshakes already in progress.
+void on_accept(int fd, short ev, void *arg) {
+
+    struct server_loop *loop = (struct server_loop *)arg;
+    LoopActivity busy(&loop->activity, LOOP_CB_ACCEPT);
+    STAT_INC(loop->stats.accept_wakeups);
+
+    for (int i = 0; i < loop->config->accept_batch; ++i) {
+        bool reject = false;
+        if (overloaded(loop, 100)) {
+            if (loop->config->overload_reject) {
+                reject = true;
+            }
+            else {
+                pause_accept(loop);
+                break;
+            }
+        }
+
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(fd,
+                                (struct sockaddr *)&client_addr,
+                                &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                STAT_INC(loop->stats.accept_errors);
+                HLOG(ERROR) << "accept4 failed: " << strerror(errno)
+                            << ", retrying in " << ACCEPT_RETRY_MS << " ms";
+                backoff_accept(loop);
+            }
+            break;
+        }
+
+        if (reject) {
+            reject_connection(loop, client_fd);
+            continue;
+        }
+
+        STAT_INC(loop->stats.accepted);
+        TKT_PROBE4(tkt_recv, accept, client_fd, loop->id,
+                   ntohl(client_addr.sin_addr.s_addr),
+                   ntohs(client_addr.sin_port));
+        if (loop->config->low_latency) {
+            set_low_latency(client_fd);
+        }
+
+        server_handshake_begin(loop, client_fd, &client_addr);
+    }
+}
+
+// Log loop counters, used to compare accept and handshake throughput
+// between configurations.
+static void on_stats_timer(int fd, short ev, void *arg) {
+    struct server_loop *loop = (struct server_loop *)arg;
+    LoopActivity busy(&loop->activity, LOOP_CB_TIMER);
 
-    assert(h->ev == NULL);
-    h->ev = evtimer_new(g_evbase, on_server_handshake_begin, h);
+    uint64_t stalls = 0;
+    for (int i = 0; i < LOOP_CB_COUNT; ++i) {
+        stalls += loop->activity.stalls[i];
+    }
 
-    h->cred_mgr = (const CredMgr *)(arg);
+    LOG(INFO) << "Loop " << loop->id << " stats:"
+              << " accept_wakeups: " << loop->stats.accept_wakeups
+              << ", accepted: " << loop->stats.accepted
+              << ", accept_errors: " << loop->stats.accept_errors
+              << ", timeouts: " << loop->stats.timeouts
+              << ", close_timeouts: " << loop->stats.close_timeouts
+              << ", oversized_tokens: " << loop->stats.oversized_tokens
+              << ", rejected: " << loop->stats.rejected
+              << ", accept_pauses: " << loop->stats.accept_pauses
+              << ", replays: " << loop->stats.replays
+              << ", rcache_full: " << loop->stats.rcache_full
+              << ", stores_written: " << loop->stats.stores_written
+              << ", stores_skipped: " << loop->stats.stores_skipped
+              << ", stores_coalesced: " << loop->stats.stores_coalesced
+              << ", store_failures: " << loop->stats.store_failures
+              << ", max_lag_ms: " << loop->stats.max_lag_ms
+              << ", stalls: " << stalls
+              << ", live_workers: " << loop->load->live_workers.load()
+              << ", token_bytes: " << loop->load->token_bytes.load()
+              << ", free_workers: " << loop->pool.nfree_workers
+              << ", deadlines: " << loop->wheel.active;
+}
 
-    struct timeval t0 = {0, 0};
-    evtimer_add(h->ev, &t0);
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int run_server(int port, const std::string& tkt_spool_dir) {
+// Advance the loop's timer wheel. Ticks missed while the loop was busy
+// are caught up, so deadlines don't drift under load. How late the tick
+// fired is the loop's lag, used by admission control.
+static void on_wheel_tick(int fd, short ev, void *arg) {
+    struct server_loop *loop = (struct server_loop *)arg;
+    LoopActivity busy(&loop->activity, LOOP_CB_TIMER);
+
+    uint64_t now_ms = monotonic_ms();
+    uint64_t due_ms = loop->wheel_ms + loop->wheel.tick_ms;
+    loop->lag_ms = now_ms > due_ms ? now_ms - due_ms : 0;
+    if (loop->lag_ms > loop->stats.max_lag_ms) {
+        __atomic_store_n(&loop->stats.max_lag_ms, loop->lag_ms,
+                         __ATOMIC_RELAXED);
+    }
+
+    while (now_ms - loop->wheel_ms >= loop->wheel.tick_ms) {
+        loop->wheel_ms += loop->wheel.tick_ms;
+        tw_tick(&loop->wheel);
+    }
+
+    if (loop->accept_paused && !overloaded(loop, ADMISSION_RESUME_PCT)) {
+        resume_accept(loop);
+    }
+
+    if (loop->load->stopping.load()) {
+        event_base_loopexit(loop->evbase, NULL);
+    }
+}
+
+// Let every loop return so run_server() saves the index and cleans up.
+static void on_stop_signal(int sig, short ev, void *arg) {
+    struct server_loop *loop = (struct server_loop *)arg;
+    LOG(INFO) << "Caught signal " << sig << ", stopping.";
+    loop->load->stopping = true;
+}
+
+server_config::server_config():
+        port(0),
+        tkt_spool_dir("/tmp"),
+        threads(1),
+        pin_cpus(false),
+        store_threads(2),
+        max_pending_stores(1024),
+        crypto_threads(2),
+        max_pending_accepts(1024),
+        listen_backlog(1024),
+        accept_batch(64),
+        stats_interval(0),
+        idle_timeout_ms(10000),
+        handshake_timeout_ms(30000),
+        max_token_size(64 * 1024),
+        low_latency(false),
+        close_drain_ms(2000),
+        max_handshakes(10000),
+        max_token_memory(64 * 1024 * 1024),
+        max_loop_lag_ms(1000),
+        overload_reject(false),
+        preload_keytab(true),
+        keytab_check_interval(10),
+        builtin_rcache(false),
+        rcache_slots(1024 * 1024),
+        rcache_lifetime(600),
+        native_ccache_writer(true),
+        durability(DURABILITY_NONE),
+        group_commit_ms(2),
+        skip_unchanged(true),
+        coalesce_stores(true),
+        index_snapshot_interval(60),
+        expired(EXPIRED_KEEP),
+        sweep_interval_ms(1000),
+        sweep_batch(64),
+        metrics_addr("127.0.0.1"),
+        metrics_port(0),
+        renew(false),
+        renew_before(3600),
+        renew_jitter(600),
+        renew_concurrency(4),
+        stall_ms(200),
+        stats_forwards(64),
+        stats_publish_ms(250) {
+}
+
+// Create listen socket for the loop. With more than one loop every loop
+// binds its own socket with SO_REUSEPORT and the kernel shards incoming
+// connections between them. nloops is the resolved loop count, --threads=0
+// means one loop per CPU.
+static int open_listener(const server_config& config, int nloops) {
 
     int socketlisten;
     struct sockaddr_in addresslisten;
-    struct event *accept_event;
-    struct event *gc_event;
     int reuse = 1;
 
-    socketlisten = socket(AF_INET, SOCK_STREAM, 0);
+    socketlisten = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
     if (socketlisten < 0) {
         perror("Failed to create listen socket");
@@ -198,36 +1079,526 @@ int run_server(int port, const std::string& tkt_spool_dir) {
 
     addresslisten.sin_family = AF_INET;
     addresslisten.sin_addr.s_addr = INADDR_ANY;
-    addresslisten.sin_port = htons(port);
+    addresslisten.sin_port = htons(config.port);
 
     setsockopt(socketlisten, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    fcntl(socketlisten, FD_CLOEXEC);
+    if (nloops > 1 &&
+        setsockopt(socketlisten, SOL_SOCKET, SO_REUSEPORT,
+                   &reuse, sizeof(reuse)) < 0) {
+        perror("Failed to set SO_REUSEPORT");
+        close(socketlisten);
+        return -1;
+    }
 
     if (bind(socketlisten,
              (struct sockaddr *)&addresslisten,
              sizeof(addresslisten)) < 0) {
         perror("Failed to bind");
+        close(socketlisten);
         return -1;
     }
 
-    if (listen(socketlisten, 20) < 0) {
+    if (config.low_latency) {
+        // Don't wake up until the client's first token has arrived, and
+        // let clients send it with the SYN.
+        int defer_sec = 5;
+        setsockopt(socketlisten, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   &defer_sec, sizeof(defer_sec));
+        int fastopen_qlen = 256;
+        setsockopt(socketlisten, IPPROTO_TCP, TCP_FASTOPEN,
+                   &fastopen_qlen, sizeof(fastopen_qlen));
+    }
+
+    if (listen(socketlisten, config.listen_backlog) < 0) {
         perror("Failed to listen to socket");
+        close(socketlisten);
         return -1;
     }
 
     evutil_make_socket_nonblocking(socketlisten);
+    return socketlisten;
+}
+
+static void pin_loop(struct server_loop *loop) {
+    if (loop->cpu < 0) {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(loop->cpu, &cpus);
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to pin loop " << loop->id
+                   << " to cpu " << loop->cpu << ": " << strerror(rc);
+    }
+}
+
+// Keytab reload job, the keytab is read on a store thread and the new
+// credential is swapped in on the loop.
+struct keytab_job {
+    struct work_job job;
+    struct acceptor_ref *ref;
+};
+
+static void keytab_job_run(struct work_job *job, void *thread_ctx) {
+    struct keytab_job *kj = (struct keytab_job *)job;
+    kj->ref = job->loop->acceptor->reload_if_changed();
+}
+
+static void keytab_job_done(struct work_job *job) {
+    struct keytab_job *kj = (struct keytab_job *)job;
+    struct server_loop *loop = job->loop;
+
+    if (kj->ref) {
+        loop->acceptor->install(kj->ref);
+    }
+    loop->keytab_reloading = 0;
+    delete kj;
+}
+
+static void on_keytab_timer(int fd, short ev, void *arg) {
+    struct server_loop *loop = (struct server_loop *)arg;
+    LoopActivity busy(&loop->activity, LOOP_CB_TIMER);
+
+    if (loop->keytab_reloading) {
+        return;
+    }
+
+    // Without a store pool the reload runs here, as before.
+    if (loop->store_pool) {
+        struct keytab_job *kj = new keytab_job;
+        kj->job.run = keytab_job_run;
+        kj->job.done = keytab_job_done;
+        kj->job.post = NULL;
+        kj->job.loop = loop;
+        kj->ref = NULL;
+        if (loop->store_pool->submit(&kj->job)) {
+            loop->keytab_reloading = 1;
+            return;
+        }
+        delete kj;
+    }
+
+    struct acceptor_ref *ref = loop->acceptor->reload_if_changed();
+    if (ref) {
+        loop->acceptor->install(ref);
+    }
+}
+
+// Index snapshot job, written on a store thread so the loop is not held up.
+static void snapshot_job_run(struct work_job *job, void *thread_ctx) {
+    job->loop->spool_index->save();
+}
+
+static void snapshot_job_done(struct work_job *job) {
+    delete job;
+}
 
-    CredMgr cred_mgr(tkt_spool_dir);
+// Save spool index snapshot, runs on the first loop only.
+static void on_snapshot_timer(int fd, short ev, void *arg) {
+    struct server_loop *loop = (struct server_loop *)arg;
+    LoopActivity busy(&loop->activity, LOOP_CB_TIMER);
 
-    accept_event = event_new(
-            g_evbase,
-            socketlisten,
+    if (loop->store_pool) {
+        struct work_job *job = new work_job;
+        job->run = snapshot_job_run;
+        job->done = snapshot_job_done;
+        job->post = NULL;
+        job->loop = loop;
+        if (loop->store_pool->submit(job)) {
+            return;
+        }
+        delete job;
+    }
+    loop->spool_index->save();
+}
+
+// Loop thread entry point. Event base and credential manager are created
+// on the loop thread and never touched by other threads.
+static void *run_loop(void *arg) {
+    struct server_loop *loop = (struct server_loop *)arg;
+
+    pin_loop(loop);
+
+    loop->evbase = event_base_new();
+    assert(loop->evbase);
+
+    if (!loop_mailbox_init(loop)) {
+        exit(-1);
+    }
+
+    CredMgr cred_mgr(loop->config->tkt_spool_dir,
+                     loop->config->native_ccache_writer,
+                     durability_sync_writes(loop->config->durability,
+                                            true),
+                     loop->spool_index,
+                     loop->config->skip_unchanged);
+    loop->cred_mgr = &cred_mgr;
+
+    loop->accept_event = event_new(
+            loop->evbase,
+            loop->listen_fd,
             EV_READ|EV_PERSIST,
             on_accept,
-            (void *)&cred_mgr
+            (void *)loop
+            );
+    loop->accept_retry_event = event_new(
+            loop->evbase,
+            -1,
+            0,
+            on_accept_retry,
+            (void *)loop
+            );
+
+    tw_init(&loop->wheel, WHEEL_SLOTS, WHEEL_TICK_MS);
+    loop->wheel_ms = monotonic_ms();
+    struct event *wheel_event = event_new(
+            loop->evbase,
+            -1,
+            EV_PERSIST,
+            on_wheel_tick,
+            (void *)loop
             );
+    struct timeval tick = {0, WHEEL_TICK_MS * 1000};
+    event_add(wheel_event, &tick);
+
+    struct event *keytab_event = NULL;
+    if (loop->id == 0 && loop->acceptor &&
+        loop->config->keytab_check_interval > 0) {
+        keytab_event = event_new(
+                loop->evbase,
+                -1,
+                EV_PERSIST,
+                on_keytab_timer,
+                (void *)loop
+                );
+        struct timeval interval = {loop->config->keytab_check_interval, 0};
+        event_add(keytab_event, &interval);
+    }
+
+    struct event *snapshot_event = NULL;
+    if (loop->id == 0 && !loop->config->index_snapshot.empty() &&
+        loop->config->index_snapshot_interval > 0) {
+        snapshot_event = event_new(
+                loop->evbase,
+                -1,
+                EV_PERSIST,
+                on_snapshot_timer,
+                (void *)loop
+                );
+        struct timeval interval = {loop->config->index_snapshot_interval, 0};
+        event_add(snapshot_event, &interval);
+    }
+
+    struct event *stats_event = NULL;
+    if (loop->config->stats_interval > 0) {
+        stats_event = event_new(
+                loop->evbase,
+                -1,
+                EV_PERSIST,
+                on_stats_timer,
+                (void *)loop
+                );
+        struct timeval interval = {loop->config->stats_interval, 0};
+        event_add(stats_event, &interval);
+    }
+
+    // Signals are handled by a single event base.
+    struct event *sigterm_event = NULL;
+    struct event *sigint_event = NULL;
+    if (loop->id == 0) {
+        sigterm_event = evsignal_new(loop->evbase, SIGTERM,
+                                     on_stop_signal, (void *)loop);
+        sigint_event = evsignal_new(loop->evbase, SIGINT,
+                                    on_stop_signal, (void *)loop);
+        evsignal_add(sigterm_event, NULL);
+        evsignal_add(sigint_event, NULL);
+    }
+
+    LOG(INFO) << "Loop " << loop->id << " running, cpu: " << loop->cpu;
+
+    event_add(loop->accept_event, NULL);
+    event_base_dispatch(loop->evbase);
+
+    if (stats_event) {
+        event_free(stats_event);
+    }
+    if (keytab_event) {
+        event_free(keytab_event);
+    }
+    if (snapshot_event) {
+        event_free(snapshot_event);
+    }
+    if (sigterm_event) {
+        event_free(sigterm_event);
+        event_free(sigint_event);
+    }
+    event_free(wheel_event);
+    tw_free(&loop->wheel);
+    event_free(loop->accept_retry_event);
+    loop->accept_retry_event = NULL;
+    if (loop->accept_event) {
+        event_free(loop->accept_event);
+        loop->accept_event = NULL;
+    }
+    loop->cred_mgr = NULL;
+    worker_pool_free(loop);
+    // Mailbox and event base outlive the loop thread, pools and group
+    // commit may still post completions, see loop_free().
+    return NULL;
+}
+
+// Release what the pools post to, once they are stopped.
+static void loop_free(struct server_loop *loop) {
+    loop_mailbox_free(loop);
+    event_base_free(loop->evbase);
+    loop->evbase = NULL;
+}
+
+int run_server(const server_config& config) {
+
+    int nloops = config.threads;
+    if (nloops <= 0) {
+        nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nloops <= 0) {
+        nloops = 1;
+    }
+
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    struct server_load load;
+    load.live_workers = 0;
+    load.token_bytes = 0;
+    load.nloops = nloops;
+    load.listening = nloops;
+    load.stopping = false;
+
+    std::vector<struct server_loop> loops(nloops);
+    for (int i = 0; i < nloops; ++i) {
+        struct server_loop *loop = &loops[i];
+        memset(loop, 0, sizeof(*loop));
+
+        loop->id = i;
+        loop->load = &load;
+        loop->cpu = (config.pin_cpus && ncpus > 0) ? i % ncpus : -1;
+        loop->config = &config;
+        loop_activity_init(&loop->activity, i, config.stall_ms);
+        loop->listen_fd = open_listener(config, nloops);
+        if (loop->listen_fd < 0) {
+            for (int j = 0; j < i; ++j) {
+                close(loops[j].listen_fd);
+            }
+            return -1;
+        }
+    }
+
+    // Acquire acceptor credential once, if keytab can't be loaded fall back
+    // to the default GSS credential resolved on every handshake.
+    AcceptorCred *acceptor = NULL;
+    if (config.preload_keytab) {
+        acceptor = new AcceptorCred(config.keytab, config.acceptor_principal);
+        if (!acceptor->load()) {
+            LOG(ERROR) << "Unable to preload keytab, using default acceptor.";
+            delete acceptor;
+            acceptor = NULL;
+        }
+    }
 
-    event_add(accept_event, NULL);
-    event_base_dispatch(g_evbase);
+    // Built-in replay cache, shared by all loops and crypto threads.
+    ReplayCache *rcache = NULL;
+    if (config.builtin_rcache) {
+        rcache = new ReplayCache(config.rcache_slots, config.rcache_lifetime);
+        if (!rcache->open(config.rcache_path)) {
+            delete rcache;
+            delete acceptor;
+            for (int i = 0; i < nloops; ++i) {
+                close(loops[i].listen_fd);
+            }
+            return -1;
+        }
+    }
+
+    // Spool metadata, shared by all credential managers.
+    SpoolIndex *spool_index = new SpoolIndex(config.index_snapshot);
+    // Sweeper and renewer only see indexed files, without a snapshot the
+    // spool is read once.
+    if (spool_index->load() == 0) {
+        spool_index->scan(config.tkt_spool_dir);
+    }
+    struct store_init init = {&config, spool_index};
+
+    // Coalescing needs stores to run off the loop threads.
+    struct store_coalescer *coalescer = NULL;
+    if (config.coalesce_stores && config.store_threads > 0) {
+        coalescer = new store_coalescer;
+        pthread_mutex_init(&coalescer->lock, NULL);
+    }
+
+    GroupCommit *group_commit = NULL;
+    if (config.durability == DURABILITY_GROUP) {
+        group_commit = new GroupCommit(config.tkt_spool_dir,
+                                       config.group_commit_ms,
+                                       store_job_sync_failed);
+        if (!group_commit->start()) {
+            delete group_commit;
+            if (coalescer) {
+                pthread_mutex_destroy(&coalescer->lock);
+                delete coalescer;
+            }
+            delete spool_index;
+            delete rcache;
+            delete acceptor;
+            for (int i = 0; i < nloops; ++i) {
+                close(loops[i].listen_fd);
+            }
+            return -1;
+        }
+    }
+
+    SpoolSweeper *sweeper = NULL;
+    if (config.expired != EXPIRED_KEEP) {
+        sweeper = new SpoolSweeper(config.tkt_spool_dir,
+                                   spool_index,
+                                   config.expired,
+                                   config.sweep_interval_ms,
+                                   config.sweep_batch);
+        if (!sweeper->start()) {
+            // Not fatal, expired files just stay.
+            delete sweeper;
+            sweeper = NULL;
+        }
+    }
+
+    Renewer *renewer = NULL;
+    if (config.renew) {
+        renewer = new Renewer(config, spool_index);
+        if (!renewer->start()) {
+            delete renewer;
+            renewer = NULL;
+        }
+    }
+
+    WorkPool *store_pool = NULL;
+    if (config.store_threads > 0) {
+        store_pool = new WorkPool(
+                "store",
+                config.store_threads,
+                config.max_pending_stores,
+                store_thread_init,
+                store_thread_fini,
+                (void *)&init
+                );
+    }
+
+    WorkPool *crypto_pool = NULL;
+    if (config.crypto_threads > 0) {
+        crypto_pool = new WorkPool(
+                "crypto",
+                config.crypto_threads,
+                config.max_pending_accepts
+                );
+    }
+
+    for (int i = 0; i < nloops; ++i) {
+        loops[i].store_pool = store_pool;
+        loops[i].crypto_pool = crypto_pool;
+        loops[i].acceptor = acceptor;
+        loops[i].rcache = rcache;
+        loops[i].group_commit = group_commit;
+        loops[i].spool_index = spool_index;
+        loops[i].coalescer = coalescer;
+    }
+
+    MetricsServer *metrics = NULL;
+    if (config.metrics_port > 0) {
+        metrics = new MetricsServer(config.metrics_addr,
+                                    config.metrics_port,
+                                    &loops[0],
+                                    nloops);
+        metrics->set_spool_index(spool_index);
+        metrics->set_sweeper(sweeper);
+        metrics->set_renewer(renewer);
+        if (!metrics->start()) {
+            // Not fatal, serve without metrics.
+            delete metrics;
+            metrics = NULL;
+        }
+    }
+
+    StatsSegment *stats = NULL;
+    if (!config.stats_shm.empty()) {
+        stats = new StatsSegment(config.stats_shm,
+                                 &loops[0],
+                                 nloops,
+                                 config.stats_forwards,
+                                 config.stats_publish_ms);
+        stats->set_spool_index(spool_index);
+        stats->set_sweeper(sweeper);
+        stats->set_renewer(renewer);
+        if (!stats->start()) {
+            // Not fatal, serve without the stats segment.
+            delete stats;
+            stats = NULL;
+        }
+    }
+
+    LoopWatchdog *watchdog = NULL;
+    if (config.stall_ms > 0) {
+        watchdog = new LoopWatchdog(&loops[0], nloops, config.stall_ms);
+        if (!watchdog->start()) {
+            // Not fatal, stalls are still counted when callbacks return.
+            delete watchdog;
+            watchdog = NULL;
+        }
+    }
+
+    LOG(INFO) << "Starting " << nloops << " event loop(s).";
+
+    // Loop 0 runs on the calling thread.
+    for (int i = 1; i < nloops; ++i) {
+        int rc = pthread_create(&loops[i].thread, NULL, run_loop, &loops[i]);
+        if (rc != 0) {
+            LOG(ERROR) << "Unable to start loop " << i << ": " << strerror(rc);
+            exit(-1);
+        }
+    }
+
+    loops[0].thread = pthread_self();
+    run_loop(&loops[0]);
+
+    for (int i = 1; i < nloops; ++i) {
+        pthread_join(loops[i].thread, NULL);
+    }
+
+    delete watchdog;
+    delete stats;
+    delete metrics;
+    delete sweeper;
+    delete crypto_pool;
+    delete store_pool;
+    // After the stores, they call back into the renewer.
+    delete renewer;
+    delete group_commit;
+    // Nothing posts to the loops any more.
+    for (int i = 0; i < nloops; ++i) {
+        loop_free(&loops[i]);
+    }
+    if (coalescer) {
+        pthread_mutex_destroy(&coalescer->lock);
+        delete coalescer;
+    }
+    spool_index->save();
+    delete spool_index;
+    delete acceptor;
+    delete rcache;
+
+    for (int i = 0; i < nloops; ++i) {
+        if (loops[i].listen_fd >= 0) {
+            close(loops[i].listen_fd);
+        }
+    }
     return 0;
 }
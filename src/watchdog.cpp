@@ -0,0 +1,135 @@
+#include "watchdog.h"
+#include "tktrecv.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <easylogging/easylogging++.h>
+
+void loop_activity_init(struct loop_activity *activity, int loop_id,
+                        unsigned stall_ms) {
+    memset(activity, 0, sizeof(*activity));
+    activity->loop_id = loop_id;
+    activity->stall_us = (uint64_t)stall_ms * 1000;
+    activity->callback = LOOP_CB_IDLE;
+}
+
+void loop_activity_stall(struct loop_activity *activity, int callback,
+                         uint64_t us) {
+    STAT_INC(activity->stalls[callback]);
+    if (us > activity->stall_max_us[callback]) {
+        __atomic_store_n(&activity->stall_max_us[callback], us,
+                         __ATOMIC_RELAXED);
+    }
+    HLOG(WARNING) << "Loop " << activity->loop_id << " stalled in "
+                  << loop_callback_name(callback) << " for "
+                  << (unsigned long long)(us / 1000) << " ms";
+}
+
+LoopWatchdog::LoopWatchdog(struct server_loop *loops_,
+                           int nloops_,
+                           unsigned stall_ms_):
+        loops(loops_),
+        nloops(nloops_),
+        stall_ms(stall_ms_),
+        reported_seq(new uint64_t[nloops_]()),
+        stopping(false),
+        started(false) {
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+LoopWatchdog::~LoopWatchdog() {
+    if (started) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(thread, NULL);
+    }
+
+    delete[] reported_seq;
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+bool LoopWatchdog::start() {
+    int rc = pthread_create(&thread, NULL, thread_main, this);
+    if (rc != 0) {
+        LOG(ERROR) << "Unable to start loop watchdog: " << strerror(rc);
+        return false;
+    }
+    started = true;
+    return true;
+}
+
+void *LoopWatchdog::thread_main(void *arg) {
+    LoopWatchdog *wd = (LoopWatchdog *)arg;
+
+    unsigned interval_ms = wd->stall_ms / 4;
+    if (interval_ms == 0) {
+        interval_ms = 1;
+    }
+
+    pthread_mutex_lock(&wd->lock);
+    while (!wd->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_ms / 1000;
+        deadline.tv_nsec += (long)(interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int wait_rc = 0;
+        while (!wd->stopping && wait_rc != ETIMEDOUT) {
+            wait_rc = pthread_cond_timedwait(&wd->cond, &wd->lock, &deadline);
+        }
+
+        if (wd->stopping) {
+            break;
+        }
+
+        pthread_mutex_unlock(&wd->lock);
+        wd->check();
+        pthread_mutex_lock(&wd->lock);
+    }
+    pthread_mutex_unlock(&wd->lock);
+    return NULL;
+}
+
+void LoopWatchdog::check() {
+    uint64_t now_us = monotonic_us();
+
+    for (int i = 0; i < nloops; ++i) {
+        struct loop_activity *activity = &loops[i].activity;
+
+        // seq is bumped after start_us is written; if it moved while
+        // reading, the loop went on to another callback.
+        uint64_t seq = __atomic_load_n(&activity->seq, __ATOMIC_ACQUIRE);
+        uint32_t callback = __atomic_load_n(&activity->callback,
+                                            __ATOMIC_ACQUIRE);
+        uint64_t start_us = __atomic_load_n(&activity->start_us,
+                                            __ATOMIC_RELAXED);
+        bool busy = callback != LOOP_CB_IDLE &&
+                    seq == __atomic_load_n(&activity->seq, __ATOMIC_ACQUIRE);
+
+        uint64_t us = busy && now_us > start_us ? now_us - start_us : 0;
+        if (us < activity->stall_us) {
+            __atomic_store_n(&activity->stalled_us, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        __atomic_store_n(&activity->stalled_us, us, __ATOMIC_RELAXED);
+        if (reported_seq[i] != seq) {
+            reported_seq[i] = seq;
+            LOG(WARNING) << "Loop " << activity->loop_id << " busy in "
+                         << loop_callback_name(callback) << " for "
+                         << us / 1000 << " ms";
+        }
+    }
+}
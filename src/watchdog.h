@@ -0,0 +1,152 @@
+#ifndef _WATCHDOG_H
+#define _WATCHDOG_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+struct server_loop;
+
+// What a loop thread is busy with. Callbacks nest, the innermost one is
+// reported: a store run inline from the read callback is a store.
+enum loop_callback {
+    // waiting for events
+    LOOP_CB_IDLE,
+    LOOP_CB_ACCEPT,
+    LOOP_CB_READ_HANDSHAKE,
+    // gss_accept_sec_context on the loop thread
+    LOOP_CB_GSS_ACCEPT,
+    LOOP_CB_STORE,
+    // ack flushed, drain and free_worker
+    LOOP_CB_CLOSE,
+    // wheel tick, keytab check, snapshot and stats timers
+    LOOP_CB_TIMER,
+    // pool completions, other than stores and accepts
+    LOOP_CB_COMPLETION,
+    LOOP_CB_COUNT
+};
+
+// Also used by tkt-stat, which does not link the watchdog.
+inline const char *loop_callback_name(int callback) {
+    static const char *names[LOOP_CB_COUNT] = {
+        "idle",
+        "accept",
+        "read_handshake",
+        "gss_accept",
+        "store",
+        "close",
+        "timer",
+        "completion",
+    };
+    if (callback < 0 || callback >= LOOP_CB_COUNT) {
+        return "unknown";
+    }
+    return names[callback];
+}
+
+// Callback tracking of one loop. The loop thread publishes the running
+// callback and when it started, the watchdog thread reads them. Stall
+// counters are written by the loop thread only, when a callback returns.
+struct loop_activity {
+    int loop_id;
+    // callbacks running longer are stalls, 0 - tracking disabled
+    uint64_t stall_us;
+
+    // loop_callback, LOOP_CB_IDLE between callbacks
+    uint32_t callback;
+    // bumped on every outermost callback, after start_us is written
+    uint64_t seq;
+    uint64_t start_us;
+    // stall already counted for an inner callback, loop thread only
+    bool attributed;
+
+    uint64_t stalls[LOOP_CB_COUNT];
+    uint64_t stall_max_us[LOOP_CB_COUNT];
+
+    // length of the stall in progress as seen by the watchdog, 0 - none
+    uint64_t stalled_us;
+};
+
+void loop_activity_init(struct loop_activity *activity, int loop_id,
+                        unsigned stall_ms);
+
+// Count and log a callback that ran over the threshold.
+void loop_activity_stall(struct loop_activity *activity, int callback,
+                         uint64_t us);
+
+// Marks a callback for the length of a scope, on the loop thread:
+//
+//     LoopActivity busy(&loop->activity, LOOP_CB_ACCEPT);
+//
+// Costs two clock reads per callback, nothing when tracking is disabled.
+class LoopActivity {
+public:
+    LoopActivity(struct loop_activity *activity_, loop_callback callback):
+            activity(activity_),
+            start_us(0),
+            prev(LOOP_CB_IDLE) {
+
+        if (activity->stall_us == 0) {
+            return;
+        }
+
+        start_us = monotonic_us();
+        prev = activity->callback;
+        if (prev == LOOP_CB_IDLE) {
+            activity->attributed = false;
+            __atomic_store_n(&activity->start_us, start_us, __ATOMIC_RELAXED);
+            __atomic_store_n(&activity->seq, activity->seq + 1,
+                             __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&activity->callback, callback, __ATOMIC_RELEASE);
+    }
+
+    ~LoopActivity() {
+        if (start_us == 0) {
+            return;
+        }
+
+        uint64_t us = monotonic_us() - start_us;
+        if (us >= activity->stall_us && !activity->attributed) {
+            loop_activity_stall(activity, activity->callback, us);
+            activity->attributed = true;
+        }
+        __atomic_store_n(&activity->callback, prev, __ATOMIC_RELEASE);
+    }
+
+private:
+    struct loop_activity *activity;
+    uint64_t start_us;
+    uint32_t prev;
+};
+
+// Watches the loops for callbacks that run past the stall threshold and
+// logs them while they are still running, so a loop stuck for good is
+// reported too. Checks every quarter of the threshold.
+class LoopWatchdog {
+public:
+    LoopWatchdog(struct server_loop *loops_, int nloops_, unsigned stall_ms_);
+    ~LoopWatchdog();
+
+    bool start();
+
+private:
+    static void *thread_main(void *arg);
+    void check();
+
+    struct server_loop *loops;
+    int nloops;
+    unsigned stall_ms;
+    // last stall logged per loop, by activity seq
+    uint64_t *reported_seq;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+
+    bool started;
+    pthread_t thread;
+};
+
+#endif  // _WATCHDOG_H
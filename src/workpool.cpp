@@ -0,0 +1,208 @@
+#include "workpool.h"
+#include "tktrecv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include <easylogging/easylogging++.h>
+
+WorkPool::WorkPool(const std::string& name_,
+                   int nthreads,
+                   size_t max_queued_,
+                   thread_init_fn init_,
+                   thread_fini_fn fini_,
+                   void *init_arg_):
+        name(name_),
+        max_queued(max_queued_),
+        init(init_),
+        fini(fini_),
+        init_arg(init_arg_),
+        head(NULL),
+        tail(NULL),
+        nqueued(0),
+        stopping(false) {
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, thread_main, this);
+        if (rc != 0) {
+            LOG(ERROR) << "Unable to start " << name << " thread: "
+                       << strerror(rc);
+            break;
+        }
+        threads.push_back(thread);
+    }
+
+    LOG(INFO) << "Started " << threads.size() << " " << name << " thread(s).";
+}
+
+WorkPool::~WorkPool() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < threads.size(); ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+bool WorkPool::submit(struct work_job *job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (nqueued >= max_queued || threads.empty()) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+
+    if (tail) {
+        tail->next = job;
+    }
+    else {
+        head = job;
+    }
+    tail = job;
+    ++nqueued;
+
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+size_t WorkPool::queued() const {
+    return nqueued.load(std::memory_order_relaxed);
+}
+
+void *WorkPool::thread_main(void *arg) {
+    WorkPool *pool = (WorkPool *)arg;
+
+    void *thread_ctx = NULL;
+    if (pool->init) {
+        thread_ctx = pool->init(pool->init_arg);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+
+        if (pool->head == NULL) {
+            break;
+        }
+
+        struct work_job *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        --pool->nqueued;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        job->run(job, thread_ctx);
+        if (job->post) {
+            job->post(job);
+        }
+        else {
+            loop_post(job->loop, job);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pool->fini) {
+        pool->fini(thread_ctx);
+    }
+    return NULL;
+}
+
+// Drain the mailbox and run completions on the loop thread.
+static void on_mailbox(int fd, short ev, void *arg) {
+    struct server_loop *loop = (struct server_loop *)arg;
+    LoopActivity busy(&loop->activity, LOOP_CB_COMPLETION);
+
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        LOG(ERROR) << "mailbox read failed, errno: " << errno;
+    }
+
+    pthread_mutex_lock(&loop->mailbox_lock);
+    struct work_job *job = loop->mailbox_head;
+    loop->mailbox_head = NULL;
+    loop->mailbox_tail = NULL;
+    pthread_mutex_unlock(&loop->mailbox_lock);
+
+    while (job) {
+        struct work_job *next = job->next;
+        job->done(job);
+        job = next;
+    }
+}
+
+bool loop_mailbox_init(struct server_loop *loop) {
+    pthread_mutex_init(&loop->mailbox_lock, NULL);
+    loop->mailbox_head = NULL;
+    loop->mailbox_tail = NULL;
+
+    loop->mailbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->mailbox_fd < 0) {
+        LOG(ERROR) << "eventfd: " << strerror(errno);
+        return false;
+    }
+
+    loop->mailbox_event = event_new(
+            loop->evbase,
+            loop->mailbox_fd,
+            EV_READ|EV_PERSIST,
+            on_mailbox,
+            (void *)loop
+            );
+    assert(loop->mailbox_event);
+    event_add(loop->mailbox_event, NULL);
+    return true;
+}
+
+void loop_mailbox_free(struct server_loop *loop) {
+    if (loop->mailbox_event) {
+        event_free(loop->mailbox_event);
+        loop->mailbox_event = NULL;
+    }
+    if (loop->mailbox_fd >= 0) {
+        close(loop->mailbox_fd);
+        loop->mailbox_fd = -1;
+    }
+    pthread_mutex_destroy(&loop->mailbox_lock);
+}
+
+void loop_post(struct server_loop *loop, struct work_job *job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&loop->mailbox_lock);
+    bool wakeup = (loop->mailbox_head == NULL);
+    if (loop->mailbox_tail) {
+        loop->mailbox_tail->next = job;
+    }
+    else {
+        loop->mailbox_head = job;
+    }
+    loop->mailbox_tail = job;
+    pthread_mutex_unlock(&loop->mailbox_lock);
+
+    if (wakeup) {
+        uint64_t one = 1;
+        if (write(loop->mailbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG(ERROR) << "mailbox write failed, errno: " << errno;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef _WORK_POOL_H
+#define _WORK_POOL_H
+
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+struct server_loop;
+
+// Unit of work handed to a WorkPool. run() is called on a pool thread with
+// the thread's private context, done() is posted back and called on the
+// owning loop thread. If post() is set, it is called on the pool thread
+// instead of posting the job and must eventually loop_post() it.
+struct work_job {
+    void (*run)(struct work_job *job, void *thread_ctx);
+    void (*done)(struct work_job *job);
+    void (*post)(struct work_job *job);
+
+    struct server_loop *loop;
+    struct work_job *next;
+};
+
+class WorkPool {
+public:
+    // Called once on every pool thread, returned pointer is passed to
+    // every job run() on that thread.
+    typedef void *(*thread_init_fn)(void *arg);
+    typedef void (*thread_fini_fn)(void *thread_ctx);
+
+    WorkPool(const std::string& name_,
+             int threads,
+             size_t max_queued_,
+             thread_init_fn init_ = NULL,
+             thread_fini_fn fini_ = NULL,
+             void *init_arg_ = NULL);
+    ~WorkPool();
+
+    // Queue job for execution, returns false if the queue is full.
+    bool submit(struct work_job *job);
+
+    // Lock free, may lag a concurrent submit() or dequeue.
+    size_t queued() const;
+
+private:
+    static void *thread_main(void *arg);
+
+    std::string name;
+    size_t max_queued;
+    thread_init_fn init;
+    thread_fini_fn fini;
+    void *init_arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct work_job *head;
+    struct work_job *tail;
+    // written under lock, read without it by queued()
+    std::atomic<size_t> nqueued;
+    bool stopping;
+
+    std::vector<pthread_t> threads;
+};
+
+// Completion mailbox of the loop, jobs posted from any thread are
+// delivered to job->done() on the loop thread.
+bool loop_mailbox_init(struct server_loop *loop);
+void loop_mailbox_free(struct server_loop *loop);
+void loop_post(struct server_loop *loop, struct work_job *job);
+
+#endif  // _WORK_POOL_H
@@ -31,6 +31,7 @@ make install DESTDIR=$RPM_BUILD_ROOT
 %{_sbindir}/ipa-ticket
 %{_bindir}/tkt-recv
 %{_bindir}/tkt-send
+%{_bindir}/tkt-stat
 %{_bindir}/kt-add
 %{_bindir}/kt-split
 %{_bindir}/k-realm